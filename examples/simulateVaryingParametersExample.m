@@ -36,15 +36,15 @@ toc;
 %% now we run the simulation with different call modes and check the time
 disp('Running .seq decoding only once...');
 tic;
-pulseqcestmex('init', PMEX, seq_fn);     % init the mex library
+h = pulseqcestmex('init', PMEX, seq_fn); % init the mex library, h is the handle of the simulation
 for t = 1:nT2
     PMEX.WaterPool.R2 = 1/T2(t);
-    pulseqcestmex('update', PMEX);       % update the struct without decoding the seq file again
-    M = pulseqcestmex('run');            % run the simulation
+    pulseqcestmex('update', h, PMEX);    % update the struct without decoding the seq file again
+    M = pulseqcestmex('run', h);         % run the simulation
     results{t,1} = M(nTotalPools*2+1,:);
     results{t,2} = T2(t);
 end
-pulseqcestmex('close');                  % close the library
+pulseqcestmex('close', h);               % close the simulation
 clear pulseqcestmex; 
 toc;
 
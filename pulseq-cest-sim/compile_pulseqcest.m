@@ -33,8 +33,21 @@ i_pulseq = ['-I' fullfile(script_fp, 'pulseq', 'src')];
 f_sbb = fullfile(script_fp, 'src', 'PulseqCESTmex.cpp');
 f_bmc = fullfile(script_fp, 'src', 'BMCSim.cpp');
 f_sp = fullfile(script_fp, 'src', 'SimulationParameters.cpp');
+f_bbmc = fullfile(script_fp, 'src', 'BatchedBlochMcConnellSolver.cpp');
+f_abmc = fullfile(script_fp, 'src', 'ArrowheadBlochMcConnellSolver.cpp');
+f_ps = fullfile(script_fp, 'src', 'ParameterSweep.cpp');
+f_df = fullfile(script_fp, 'src', 'DictionaryFile.cpp');
+f_pl = fullfile(script_fp, 'src', 'PulseLibrary.cpp');
+f_sc = fullfile(script_fp, 'src', 'SequenceCache.cpp');
 f_es = fullfile(script_fp, 'pulseq', 'src', 'ExternalSequence.cpp');
 opt_flag = 'CXXOPTIMFLAGS=""'; % gets overwritten if supported compiler is found
+max_fixed_pools = 8; % solvers with fixed-size matrices for up to this number of CEST pools, lower values reduce code size
+d_fixed = ['-DMAX_FIXED_SIZE_CEST_POOLS=' num2str(max_fixed_pools)];
+enable_stats = false; % counters and timers for pulseqcestmex('stats', h), they slightly slow down the simulation
+defines = {d_fixed};
+if enable_stats
+    defines{end+1} = '-DPULSEQCEST_STATS';
+end
 
 % compile simulation
 disp('Checking compilers...');
@@ -49,4 +62,4 @@ else
     warning('No tested compiler found. Trying to compile...');
 end
 disp(['Start compilation with ' mex.getCompilerConfigurations('CPP').Name '...']);
-mex(opt_flag, i_eigen, i_pulseq, f_sbb, f_bmc, f_sp, f_es, '-output', fullfile(script_fp,'pulseqcestmex'));
+mex(opt_flag, defines{:}, i_eigen, i_pulseq, f_sbb, f_bmc, f_sp, f_bbmc, f_abmc, f_ps, f_df, f_pl, f_sc, f_es, '-output', fullfile(script_fp,'pulseqcestmex'));
@@ -20,9 +20,9 @@ end
 
 % call the mex file with different call modes
 try
-    pulseqcestmex('init', PMEX, seq_fn); % init the mex library
-    M = pulseqcestmex('run');            % run the simulation
-    pulseqcestmex('close');              % close the library
+    h = pulseqcestmex('init', PMEX, seq_fn); % init the mex library, h is the handle of the simulation
+    M = pulseqcestmex('run', h);             % run the simulation
+    pulseqcestmex('close', h);               % close the simulation
     clear pulseqcestmex;                 % clear mex memory
 catch ME
     clear pulseqcestmex;                 % clear mex memory    
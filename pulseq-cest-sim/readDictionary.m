@@ -0,0 +1,68 @@
+%% read a dictionary file written by a parameter sweep
+% pulseq-cest project
+%
+% Input:  dict_fn: filename of the dictionary file
+%
+% Output: M   : memmapfile object, M.Data.M is a [components x adcs x entries]
+%               array of the completed entries (read from disk on access)
+%         info: struct with the stored components and adc events (1-based),
+%               the normalization adc event (0 for none) and the sweep axes
+
+% Kai Herz, 2021
+% kai.herz@tuebingen.mpg.de
+
+function [M, info] = readDictionary(dict_fn)
+
+%% check for file
+if ~exist(dict_fn, 'file')
+    error('dictionary file does not exist!')
+end
+
+%% read the header (see DictionaryFile.h)
+fid = fopen(dict_fn, 'r', 'l');
+cleanup = onCleanup(@() fclose(fid));
+magic = fread(fid, 8, '*uint8')';
+if ~isequal(magic, uint8(['PQCDICT' 0]))
+    error('%s is not a dictionary file', dict_fn);
+end
+version = fread(fid, 1, 'uint32');
+if version ~= 1
+    error('unsupported dictionary file version %d', version);
+end
+headerSize = fread(fid, 1, 'uint32');
+numEntries = fread(fid, 1, 'uint64');
+chunkSize = fread(fid, 1, 'uint64');
+numCompletedChunks = fread(fid, 1, 'uint64');
+numComponents = fread(fid, 1, 'uint32');
+numADCs = fread(fid, 1, 'uint32');
+normalizationADC = fread(fid, 1, 'int32');
+numAxes = fread(fid, 1, 'uint32');
+isGrid = fread(fid, 1, 'uint32');
+fread(fid, 1, 'uint32'); % reserved
+
+info.numEntries = numEntries;
+info.numCompletedEntries = min(numEntries, numCompletedChunks*chunkSize);
+info.components = fread(fid, numComponents, 'uint32')' + 1;
+info.adcs = fread(fid, numADCs, 'uint32')' + 1;
+info.normalizationADC = normalizationADC + 1;
+info.isGrid = isGrid ~= 0;
+
+%% sweep axes, the first axis varies fastest in a grid
+parameterNames = {'r1', 'r2', 'f', 'k', 'dw', 'b0', 'rel_b1', 'b0_inhom'};
+poolNames = {'water_pool', 'cest_pool', 'mt_pool', 'scanner'};
+fseek(fid, ceil(ftell(fid)/8)*8, 'bof');
+info.axes = struct('parameter', {}, 'pool', {}, 'cestPoolIdx', {}, 'values', {});
+for a = 1:numAxes
+    axisInfo = fread(fid, 4, 'uint32');
+    info.axes(a).parameter = parameterNames{axisInfo(1)+1};
+    info.axes(a).pool = poolNames{axisInfo(2)+1};
+    info.axes(a).cestPoolIdx = axisInfo(3) + 1;
+    info.axes(a).values = fread(fid, axisInfo(4), 'double')';
+end
+
+%% map the completed entries
+M = [];
+if info.numCompletedEntries > 0
+    M = memmapfile(dict_fn, 'Offset', headerSize, 'Repeat', 1, ...
+        'Format', {'double', [numComponents numADCs info.numCompletedEntries], 'M'});
+end
@@ -165,6 +165,27 @@ end
 if isfield(params, 'max_pulse_samples')
     PMEX.MaxPulseSamples = str2param(params.max_pulse_samples);
 end
+if isfield(params, 'max_pulse_error')
+    PMEX.MaxPulseError = str2param(params.max_pulse_error);
+end
+if isfield(params, 'sequence_cache')
+    PMEX.SequenceCache = double(str2param(params.sequence_cache));
+end
+if isfield(params, 'block_propagation')
+    PMEX.BlockPropagation = double(str2param(params.block_propagation));
+end
+if isfield(params, 'num_threads')
+    PMEX.NumThreads = str2param(params.num_threads);
+end
+if isfield(params, 'batch_lanes')
+    PMEX.BatchLanes = str2param(params.batch_lanes);
+end
+if isfield(params, 'propagation_method')
+    if ~strcmp(params.propagation_method, 'Pade') && ~strcmp(params.propagation_method, 'Expmv')
+        error([params.propagation_method ' is invalid. Please use "Pade" or "Expmv"']);
+    end
+    PMEX.PropagationMethod = params.propagation_method;
+end
 
     function value = str2param(str)
         value = nan;
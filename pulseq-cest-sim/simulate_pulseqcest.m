@@ -45,36 +45,11 @@ end
 %% simulation start
 disp('Simulating .seq file ... ');
 t_start = tic;
-%% multiple isochromats
-if isfield(PMEX, 'isochromats') && (PMEX.isochromats.numIsochromats > 1)
-    % prepare off-resonances
-    r2dash  = 1/PMEX.isochromats.t2star - PMEX.WaterPool.R2;
-    nIsochromats = PMEX.isochromats.numIsochromats;
-    dwSpins = r2dash*tan(pi*.9*linspace(-.5,.5,nIsochromats));
-    dwSpins = dwSpins./(PMEX.Scanner.B0*PMEX.Scanner.Gamma);
-    % allocate cell array for magnetization vecors
-    Mpar = cell(nIsochromats,1);
-    spmd
-        PMEX_local = PMEX; % local variable for parfor loop
-        pulseqcestmex('init', PMEX, seq_fn); % one process for each worker
-        for dwIdx = drange(1:numel(dwSpins))
-            PMEX_local.Scanner.B0Inhomogeneity = dwSpins(dwIdx);
-            pulseqcestmex('update', PMEX_local);
-            Mpar{dwIdx} = pulseqcestmex('run');
-        end
-        pulseqcestmex('close');
-    end
-    clear pulseqcestmex; % clear mex memory
-    % combine data from all workes in single cell
-    Mcomb = [Mpar{:}];
-    Mcomb = Mcomb(~cellfun('isempty',Mcomb));
-    Mcomb = cell2mat(Mcomb');
-    % reshape and calculate mean
-    M_out = mean(reshape(Mcomb, [size(Mcomb,1), size(Mcomb,2)/nIsochromats, nIsochromats]),3);
-else
-    %% single isochromat case (standard)
-    M_out = pulseqcest(PMEX, seq_fn);
+%% multiple isochromats are simulated and averaged in the mex file
+if isfield(PMEX, 'isochromats') && (PMEX.isochromats.numIsochromats > 1) && ~isfield(PMEX, 'NumThreads')
+    PMEX.NumThreads = 0; % use all available cores
 end
+M_out = pulseqcest(PMEX, seq_fn);
 
 %% simulation end
 t_end = toc(t_start);
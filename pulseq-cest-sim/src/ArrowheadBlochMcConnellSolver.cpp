@@ -0,0 +1,290 @@
+//!  ArrowheadBlochMcConnellSolver.cpp
+/*!
+Bloch-McConnell solver that exploits the arrowhead structure of the Bloch matrix for many CEST pools
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "ArrowheadBlochMcConnellSolver.h"
+
+// theta_m of the truncated taylor series of degree m for double precision (Al-Mohy and Higham, doi:10.1137/100788860)
+static const int numTaylorDegrees = 35;
+static const int taylorDegrees[numTaylorDegrees] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20,
+	21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 35, 40, 45, 50, 55 };
+static const double taylorTheta[numTaylorDegrees] = { 2.22e-16, 2.58e-8, 1.39e-5, 3.40e-4, 2.40e-3, 9.07e-3, 2.38e-2, 5.00e-2, 8.96e-2, 1.44e-1,
+	2.14e-1, 3.00e-1, 4.00e-1, 5.14e-1, 6.41e-1, 7.81e-1, 9.31e-1, 1.09, 1.26, 1.44,
+	1.62, 1.82, 2.01, 2.22, 2.43, 2.64, 2.86, 3.08, 3.31, 3.54, 4.7, 6.0, 7.2, 8.5, 9.9 };
+
+//! Constructor
+/*!	\param sp SimulationParamter object containing pool informations */
+ArrowheadBlochMcConnellSolver::ArrowheadBlochMcConnellSolver(SimulationParameters &sp) : BlochMcConnellSolver<Eigen::Dynamic>(sp)
+{
+	// indices of the water block and of the CEST pool blocks
+	waterIdx.push_back(0);
+	waterIdx.push_back(N + 1);
+	waterIdx.push_back(2 * (N + 1));
+	if (sp.IsMTActive()) {
+		waterIdx.push_back(3 * (N + 1));
+	}
+	for (unsigned int i = 0; i < N; i++) {
+		poolIdx.push_back(i + 1);
+		poolIdx.push_back(i + 2 + N);
+		poolIdx.push_back(i + 1 + 2 * (N + 1));
+	}
+
+	// sparsity pattern of the augmented matrix [A C; 0 0], the values get updated for each propagator
+	int n = A.rows();
+	std::vector<Eigen::Triplet<double> > pattern;
+	for (unsigned int r = 0; r < waterIdx.size(); r++) { // water is coupled to all pools
+		for (int c = 0; c < n; c++) {
+			pattern.push_back(Eigen::Triplet<double>(waterIdx[r], c, 0.0));
+		}
+	}
+	for (unsigned int i = 0; i < N; i++) {
+		for (int r = 0; r < 3; r++) {
+			for (int c = 0; c < 3; c++) { // pool block
+				pattern.push_back(Eigen::Triplet<double>(poolIdx[3 * i + r], poolIdx[3 * i + c], 0.0));
+			}
+			for (unsigned int c = 0; c < waterIdx.size(); c++) { // pool-water exchange
+				pattern.push_back(Eigen::Triplet<double>(poolIdx[3 * i + r], waterIdx[c], 0.0));
+			}
+		}
+	}
+	for (int r = 0; r < n; r++) { // relaxation vector
+		pattern.push_back(Eigen::Triplet<double>(r, n, 0.0));
+	}
+	sparseAt.resize(n + 1, n + 1);
+	sparseAt.setFromTriplets(pattern.begin(), pattern.end());
+	sparseAt.makeCompressed();
+
+	// workspace of the taylor series
+	expmvF.resize(n + 1);
+	expmvB.resize(n + 1);
+	expmvBb.resize(n + 1);
+}
+
+//! Destructor
+ArrowheadBlochMcConnellSolver::~ArrowheadBlochMcConnellSolver() {}
+
+//! Solve Bloch McConnell equation
+/*!
+	Uses the cached pade propagators or the truncated taylor series, depending on the PropagationMethod
+	\param M magnetization vector
+	\param t timestep for which the equation should be solved
+*/
+void ArrowheadBlochMcConnellSolver::SolveBlochEquation(Eigen::VectorXd &M, double t)
+{
+	if (simParams->GetPropagationMethod() != ExpmvPropagation) {
+		BlochMcConnellSolver<Eigen::Dynamic>::SolveBlochEquation(M, t);
+		return;
+	}
+	if (blochMatrixOutdated) {
+		SetupBlochMatrix();
+	}
+	bool rotate = (rfAmplitude != 0.0 && (sinPhase != 0.0 || cosPhase != 1.0));
+	if (rotate) {
+		RotateTransverseMagnetization(M, cosPhase, -sinPhase);
+	}
+	ExpmvBlochEquation(M, t);
+	if (rotate) {
+		RotateTransverseMagnetization(M, cosPhase, sinPhase);
+	}
+}
+
+//! Multiply the shifted, augmented Bloch matrix with a vector
+/*!
+	The augmented matrix B = [A C; 0 0] includes the relaxation vector, so that the
+	affine equation dM/dt = A*M + C becomes d[M;1]/dt = B*[M;1]. Only the O(N) non-zero
+	entries of the arrowhead matrix are used.
+	\param x augmented vector
+	\param y (B - mu*I) * x
+	\param mu shift of the diagonal
+*/
+void ArrowheadBlochMcConnellSolver::MultiplyAugmentedBlochMatrix(const Eigen::VectorXd &x, Eigen::VectorXd &y, double mu)
+{
+	int n = A.rows();
+	Eigen::Ref<const Eigen::VectorXd> xm = x.head(n);
+	y.resize(n + 1);
+	// water rows are coupled to all pools
+	for (unsigned int r = 0; r < waterIdx.size(); r++) {
+		y(waterIdx[r]) = A.row(waterIdx[r]).dot(xm);
+	}
+	// pool rows are only coupled to the pool itself and water
+	for (unsigned int i = 0; i < N; i++) {
+		for (int r = 0; r < 3; r++) {
+			int row = poolIdx[3 * i + r];
+			double sum = 0.0;
+			for (int c = 0; c < 3; c++) {
+				sum += A(row, poolIdx[3 * i + c]) * x(poolIdx[3 * i + c]);
+			}
+			for (unsigned int c = 0; c < waterIdx.size(); c++) {
+				sum += A(row, waterIdx[c]) * x(waterIdx[c]);
+			}
+			y(row) = sum;
+		}
+	}
+	y.head(n) += C * x(n) - mu * xm;
+	y(n) = -mu * x(n);
+}
+
+//! Get the 1-norm of the shifted, augmented Bloch matrix
+/*!
+	\param mu shift of the diagonal
+	\return ||B - mu*I||_1
+*/
+double ArrowheadBlochMcConnellSolver::AugmentedBlochMatrixNorm(double mu)
+{
+	int n = A.rows();
+	double norm = C.lpNorm<1>() + std::abs(mu);
+	for (unsigned int c = 0; c < waterIdx.size(); c++) { // water columns are coupled to all pools
+		double colSum = A.col(waterIdx[c]).lpNorm<1>() - std::abs(A(waterIdx[c], waterIdx[c])) + std::abs(A(waterIdx[c], waterIdx[c]) - mu);
+		norm = std::max(norm, colSum);
+	}
+	for (unsigned int i = 0; i < N; i++) {
+		for (int c = 0; c < 3; c++) {
+			int col = poolIdx[3 * i + c];
+			double colSum = 0.0;
+			for (int r = 0; r < 3; r++) {
+				int row = poolIdx[3 * i + r];
+				colSum += std::abs(A(row, col) - (row == col ? mu : 0.0));
+			}
+			for (unsigned int r = 0; r < waterIdx.size(); r++) {
+				colSum += std::abs(A(waterIdx[r], col));
+			}
+			norm = std::max(norm, colSum);
+		}
+	}
+	return norm;
+}
+
+//! Calculate exp(A*t) * M + (exp(A*t) - I) * A^-1 * C with a truncated taylor series
+/*!
+	The action of the matrix exponential of the augmented Bloch matrix on [M;1] is calculated
+	directly, without forming the propagator or A^-1 (Al-Mohy and Higham, doi:10.1137/100788860).
+	The degree m and the number of steps s are chosen to minimize the number of matrix-vector products,
+	the series of each step gets truncated as soon as the last two terms are below double precision.
+	\param M magnetization vector
+	\param t timestep for which the equation should be solved
+*/
+void ArrowheadBlochMcConnellSolver::ExpmvBlochEquation(Eigen::VectorXd &M, double t)
+{
+	int n = A.rows();
+	double mu = A.trace() / (n + 1); // shift the augmented matrix to reduce its norm
+	double norm = AugmentedBlochMatrixNorm(mu) * t;
+	if (norm == 0.0) {
+		return;
+	}
+	// number of taylor steps s and degree m with the smallest cost m*s
+	int m = taylorDegrees[numTaylorDegrees - 1];
+	double s = std::ceil(norm / taylorTheta[numTaylorDegrees - 1]);
+	for (int d = 0; d < numTaylorDegrees; d++) {
+		double steps = std::ceil(norm / taylorTheta[d]);
+		if (taylorDegrees[d] * steps < m * s) {
+			m = taylorDegrees[d];
+			s = steps;
+		}
+	}
+	const double tol = std::pow(2.0, -53);
+	double eta = std::exp(mu * t / s);
+	Eigen::VectorXd &f = expmvF;
+	f.head(n) = M;
+	f(n) = 1.0;
+	Eigen::VectorXd &b = expmvB;
+	b = f;
+	Eigen::VectorXd &Bb = expmvBb;
+	for (double step = 0; step < s; step++) {
+		double c1 = b.lpNorm<Eigen::Infinity>();
+		STATS_ADD(stats, expmvSteps, 1);
+		for (int k = 1; k <= m; k++) {
+			STATS_ADD(stats, expmvProducts, 1);
+			MultiplyAugmentedBlochMatrix(b, Bb, mu);
+			b = Bb * (t / (s * k));
+			f += b;
+			double c2 = b.lpNorm<Eigen::Infinity>();
+			if (c1 + c2 <= tol * f.lpNorm<Eigen::Infinity>()) {
+				break;
+			}
+			c1 = c2;
+		}
+		f *= eta;
+		b = f;
+	}
+	M = f.head(n);
+}
+
+//! Calculate the propagator for the current Bloch matrix
+/*!
+	Same pade approximation of the augmented system as BlochMcConnellSolver::CalculatePropagator,
+	but the matrix powers are sparse-dense products with the fixed sparsity pattern of the arrowhead matrix
+	\param t timestep for which the propagator should be calculated
+	\param prop Propagator that gets filled
+*/
+void ArrowheadBlochMcConnellSolver::CalculatePropagator(double t, Propagator &prop)
+{
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+	Eigen::internal::set_is_malloc_allowed(false); // only the propagator itself may allocate memory
+#endif
+	const int n = A.rows();
+	Eigen::MatrixXd &AtDense = workspace.At; // helper variable [A C; 0 0] * t
+	AtDense.setZero();
+	AtDense.topLeftCorner(n, n) = A * t;
+	AtDense.topRightCorner(n, 1) = C * t;
+	//solve exponential with pade method
+	int infExp; //infinity exponent of the matrix
+	int j;
+	std::frexp(AtDense.lpNorm<Eigen::Infinity>(), &infExp); // pade method is only stable if ||A||inf / 2^j <= 0.5
+	j = std::max(0, infExp + 1);
+	STATS_ADD(stats, padeExponentials, 1);
+	STATS_SQUARING_STEPS(stats, j, 1);
+	AtDense *= (1.0 / (pow(2, j)));
+	for (int k = 0; k < sparseAt.outerSize(); k++) { // only O(N) entries are non-zero
+		for (Eigen::SparseMatrix<double>::InnerIterator it(sparseAt, k); it; ++it) {
+			it.valueRef() = AtDense(it.row(), it.col());
+		}
+	}
+	// start in the second round of the approximation, see BlochMcConnellSolver::CalculatePropagator
+	Eigen::MatrixXd &X = workspace.X;
+	X = AtDense;
+	double c = 0.5;
+	Eigen::MatrixXd &Nm = workspace.Nm;
+	Nm.setIdentity();
+	Eigen::MatrixXd &D = workspace.D;
+	D = Nm - c * AtDense;
+	Nm += c * AtDense;
+	bool p = true;
+	double q = numApprox;
+	for (int k = 2; k <= q; k++)
+	{
+		c *= (q - k + 1) / (k*(2 * q - k + 1));
+		workspace.tmp.noalias() = sparseAt * X; // sparse * dense
+		X.swap(workspace.tmp);
+		Nm += c * X;
+		p ? D += c * X : D -= c * X;
+		p = !p;
+	}
+	Eigen::MatrixXd &F = workspace.F;
+	workspace.lu.compute(D);
+	F = workspace.lu.solve(Nm); // solve D*F = N for F
+	for (int k = 1; k <= j; k++)
+	{
+		workspace.tmp.noalias() = F * F;
+		F.swap(workspace.tmp);
+	}
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+	Eigen::internal::set_is_malloc_allowed(true);
+#endif
+	prop.F = F.topLeftCorner(n, n);
+	prop.offset = F.topRightCorner(n, 1);
+}
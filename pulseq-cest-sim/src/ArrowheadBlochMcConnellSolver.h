@@ -0,0 +1,64 @@
+//!  ArrowheadBlochMcConnellSolver.h
+/*!
+Bloch-McConnell solver that exploits the arrowhead structure of the Bloch matrix for many CEST pools
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "BlochMcConnellSolver.h"
+
+// !ArrowheadBlochMcConnellSolver class.
+/*!
+  Solver for many CEST pools. CEST pools only exchange with water, so the Bloch matrix is a
+  block-arrowhead matrix with a water block (plus MT), one 3x3 block per CEST pool and the
+  pool-water exchange terms. The propagator calculation uses this structure:
+  The pade approximation runs on the augmented matrix [A C; 0 0], its matrix powers are sparse-dense
+  products with O(N) nonzeros and the pade denominator is solved with a LU decomposition instead of being inverted.
+  The propagator exp(A*t) itself is dense, so the squaring and the matrix-vector products are not affected.
+  With the ExpmvPropagation method, exp(A*t)*M is calculated directly with O(N) matrix-vector products instead.
+*/
+class ArrowheadBlochMcConnellSolver : public BlochMcConnellSolver<Eigen::Dynamic>
+{
+public:
+	//! Constructor
+	ArrowheadBlochMcConnellSolver(SimulationParameters &sp);
+
+	//! Destructor
+	~ArrowheadBlochMcConnellSolver();
+
+	//! Solve Bloch McConnell equation
+	void SolveBlochEquation(Eigen::VectorXd &M, double t);
+
+protected:
+	//! Calculate the propagator for the current Bloch matrix
+	void CalculatePropagator(double t, Propagator &prop);
+
+private:
+	std::vector<int> waterIdx; /*!< indices of the water (and MT) entries */
+	std::vector<int> poolIdx;  /*!< indices of the x, y and z entries of each CEST pool */
+	Eigen::SparseMatrix<double> sparseAt; /*!< [A C; 0 0] * t with the fixed arrowhead sparsity pattern */
+	Eigen::VectorXd expmvF, expmvB, expmvBb; /*!< workspace of the taylor series */
+
+	//! Multiply the shifted, augmented Bloch matrix with a vector
+	void MultiplyAugmentedBlochMatrix(const Eigen::VectorXd &x, Eigen::VectorXd &y, double mu);
+
+	//! Get the 1-norm of the shifted, augmented Bloch matrix
+	double AugmentedBlochMatrixNorm(double mu);
+
+	//! Calculate exp(A*t) * M + (exp(A*t) - I) * A^-1 * C with a truncated taylor series
+	void ExpmvBlochEquation(Eigen::VectorXd &M, double t);
+};
@@ -19,6 +19,8 @@ WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
 
 
 #include "BMCSim.h"
+#include <complex>
+#include <cstring>
 
 //! Constructor
 /*!	\param SimPars initial SimulationParameters object */
@@ -26,6 +28,9 @@ BMCSim::BMCSim(SimulationParameters &simPars) {
 	sp = &simPars;
 	InitSolver();
 	sequenceLoaded = false;
+	outputBuffer = NULL;
+	normalizationADC = -1;
+	numRequiredADCs = 0;
 }
 
 //! Destructor
@@ -39,17 +44,221 @@ BMCSim::~BMCSim() {
 */
 bool BMCSim::LoadExternalSequence(std::string path)
 {
-	sequenceLoaded = seq.load(path);
-	if (sequenceLoaded) {
-		this->DecodeSeqRFInfo();
-		sequenceLoaded = this->DecodeSeqADCInfo();
-		if (sequenceLoaded)	{
-			Mvec = sp->GetInitialMagnetizationVector()->rowwise().replicate(numberOfADCBlocks);
+	std::string cachePath = path + ".simcache";
+	if (sp->GetUseSequenceCache() && this->ReadSequenceCache(cachePath, path)) {
+		sequenceLoaded = true;
+	}
+	else {
+		sequenceLoaded = seq.load(path);
+		if (sequenceLoaded) {
+			this->DecodeSeqRFInfo();
+			sequenceLoaded = this->CompileSimulationEvents();
+			if (sequenceLoaded && sp->GetUseSequenceCache()) {
+				this->WriteSequenceCache(cachePath, path); // if the cache can not be written, the next load just parses the .seq file again
+			}
 		}
 	}
+	if (sequenceLoaded)	{
+		Mvec = sp->GetInitialMagnetizationVector()->rowwise().replicate(numberOfADCBlocks);
+	}
 	return sequenceLoaded;
 }
 
+//! Append raw bytes to a buffer
+/*!
+	\param buffer destination
+	\param src source
+	\param length number of bytes
+*/
+static void AppendBytes(std::vector<char> &buffer, const void* src, size_t length)
+{
+	const char* bytes = static_cast<const char*>(src);
+	buffer.insert(buffer.end(), bytes, bytes + length);
+}
+
+//! Read raw bytes from a mapped file
+/*!
+	\param pos current position, advanced by length
+	\param end end of the mapped file
+	\param dst destination
+	\param length number of bytes
+	\return false if the file is too short
+*/
+static bool ReadBytes(const char* &pos, const char* end, void* dst, size_t length)
+{
+	if (size_t(end - pos) < length) {
+		return false;
+	}
+	if (length > 0) {
+		memcpy(dst, pos, length);
+	}
+	pos += length;
+	return true;
+}
+
+//! Fill the settings of a sequence cache header
+/*!
+	Only the settings that change the compiled sequence are stored, e.g. the relative B1 only matters for the adaptive resampling
+	\param header header that gets the magic, version and pulse resampling settings, the other fields are not changed
+*/
+void BMCSim::InitSequenceCacheHeader(SequenceCacheHeader &header)
+{
+	const char magic[8] = { 'P', 'Q', 'C', 'S', 'E', 'Q', 'C', 0 };
+	memcpy(header.magic, magic, sizeof(header.magic));
+	header.version = SEQUENCE_CACHE_VERSION;
+	header.eventSize = sizeof(SimulationEvent);
+	bool adaptive = sp->GetMaxPulseSampleError() > 0;
+	header.maxPulseSamples = adaptive ? 0 : sp->GetMaxNumberOfPulseSamples();
+	header.maxPulseError = sp->GetMaxPulseSampleError();
+	header.relB1 = adaptive ? sp->GetScannerRelB1() : 0.0;
+}
+
+//! Write the compiled sequence to a cache file
+/*!
+	The file contains the simulation events, the ADC segments and the pulse library, see SequenceCacheHeader
+	\param cachePath filename of the cache file
+	\param seqPath filename of the loaded .seq file, its hash is stored to validate the cache
+	\return false if no sequence is loaded or the file could not be written
+*/
+bool BMCSim::WriteSequenceCache(const std::string &cachePath, const std::string &seqPath)
+{
+	SequenceCacheHeader header;
+	memset(&header, 0, sizeof(SequenceCacheHeader));
+	if (!sequenceLoaded || !SequenceCache::HashFile(seqPath, header.seqFileHash, header.seqFileSize)) {
+		return false;
+	}
+	this->InitSequenceCacheHeader(header);
+	header.numEvents = events.size();
+	header.numADCs = numberOfADCBlocks;
+	header.numSegments = segmentStartBlocks.size();
+	header.numPulseIDs = uniquePulses.size();
+	header.numPulses = pulseLibrary.size();
+	std::vector<char> buffer;
+	AppendBytes(buffer, &header, sizeof(SequenceCacheHeader));
+	AppendBytes(buffer, events.data(), events.size() * sizeof(SimulationEvent));
+	for (unsigned int i = 0; i < header.numSegments; i++) {
+		uint32_t startBlock = segmentStartBlocks[i];
+		AppendBytes(buffer, &startBlock, sizeof(uint32_t));
+		AppendBytes(buffer, &segmentStartPhases[i], sizeof(float));
+	}
+	for (std::map<PulseID, unsigned int>::iterator it = uniquePulses.begin(); it != uniquePulses.end(); ++it) {
+		int32_t ids[3] = { std::get<0>(it->first), std::get<1>(it->first), std::get<2>(it->first) };
+		uint32_t pulseIdx = it->second;
+		AppendBytes(buffer, ids, sizeof(ids));
+		AppendBytes(buffer, &pulseIdx, sizeof(uint32_t));
+	}
+	for (unsigned int i = 0; i < header.numPulses; i++) {
+		const PulseEvent &pulse = *pulseLibrary[i];
+		const PulseLibrary::PulseKey &key = pulseKeys[i];
+		SequenceCachePulse record;
+		memset(&record, 0, sizeof(SequenceCachePulse));
+		record.hash = std::get<0>(key);
+		record.numRawSamples = std::get<1>(key);
+		record.deadTime = std::get<2>(key);
+		record.ringdownTime = std::get<3>(key);
+		record.maxSamples = std::get<4>(key);
+		record.maxError = std::get<5>(key);
+		record.maxAmplitude = std::get<6>(key);
+		record.length = pulse.length;
+		record.numSamples = pulse.samples.size();
+		AppendBytes(buffer, &record, sizeof(SequenceCachePulse));
+		AppendBytes(buffer, pulse.samples.data(), pulse.samples.size() * sizeof(PulseSample));
+	}
+	return SequenceCache::Write(cachePath, buffer);
+}
+
+//! Load the compiled sequence from a cache file
+/*!
+	The cache file is memory-mapped and only used if it was written for the same .seq file content and pulse resampling settings.
+	Pulses that are already used by other simulations are taken from the PulseLibrary.
+	\param cachePath filename of the cache file
+	\param seqPath filename of the .seq file the cache was written for
+	\return false if the cache file does not exist, is outdated or invalid, the sequence is not changed in this case
+*/
+bool BMCSim::ReadSequenceCache(const std::string &cachePath, const std::string &seqPath)
+{
+	SequenceCache cache;
+	if (!cache.Map(cachePath)) {
+		return false;
+	}
+	const char* pos = cache.GetData();
+	const char* end = pos + cache.GetSize();
+	SequenceCacheHeader header, expected;
+	memset(&expected, 0, sizeof(SequenceCacheHeader));
+	this->InitSequenceCacheHeader(expected);
+	if (!ReadBytes(pos, end, &header, sizeof(SequenceCacheHeader)) || memcmp(header.magic, expected.magic, sizeof(header.magic))
+		|| header.version != expected.version || header.eventSize != expected.eventSize || header.maxPulseSamples != expected.maxPulseSamples
+		|| header.maxPulseError != expected.maxPulseError || header.relB1 != expected.relB1 || header.numADCs == 0 || header.numSegments != header.numADCs + 1) {
+		return false;
+	}
+	uint64_t seqFileHash, seqFileSize;
+	if (!SequenceCache::HashFile(seqPath, seqFileHash, seqFileSize) || seqFileHash != header.seqFileHash || seqFileSize != header.seqFileSize) {
+		return false;
+	}
+	// decode into temporary containers, so that an invalid file does not change the loaded sequence
+	std::vector<SimulationEvent> cachedEvents(header.numEvents);
+	if (!ReadBytes(pos, end, cachedEvents.data(), cachedEvents.size() * sizeof(SimulationEvent))) {
+		return false;
+	}
+	std::vector<unsigned int> cachedStartBlocks(header.numSegments);
+	std::vector<float> cachedStartPhases(header.numSegments);
+	for (unsigned int i = 0; i < header.numSegments; i++) {
+		uint32_t startBlock;
+		if (!ReadBytes(pos, end, &startBlock, sizeof(uint32_t)) || !ReadBytes(pos, end, &cachedStartPhases[i], sizeof(float)) || startBlock > header.numEvents) {
+			return false;
+		}
+		cachedStartBlocks[i] = startBlock;
+	}
+	std::map<PulseID, unsigned int> cachedPulseIDs;
+	for (unsigned int i = 0; i < header.numPulseIDs; i++) {
+		int32_t ids[3];
+		uint32_t pulseIdx;
+		if (!ReadBytes(pos, end, ids, sizeof(ids)) || !ReadBytes(pos, end, &pulseIdx, sizeof(uint32_t)) || pulseIdx >= header.numPulses) {
+			return false;
+		}
+		cachedPulseIDs[std::make_tuple(ids[0], ids[1], ids[2])] = pulseIdx;
+	}
+	std::vector<std::shared_ptr<const PulseEvent> > cachedPulses(header.numPulses);
+	std::vector<PulseLibrary::PulseKey> cachedKeys(header.numPulses);
+	for (unsigned int i = 0; i < header.numPulses; i++) {
+		SequenceCachePulse record;
+		if (!ReadBytes(pos, end, &record, sizeof(SequenceCachePulse))) {
+			return false;
+		}
+		cachedKeys[i] = std::make_tuple(record.hash, record.numRawSamples, record.deadTime, record.ringdownTime, record.maxSamples, record.maxError, record.maxAmplitude);
+		cachedPulses[i] = PulseLibrary::Find(cachedKeys[i]);
+		if (cachedPulses[i]) { // already used by another simulation
+			if (size_t(end - pos) < record.numSamples * sizeof(PulseSample)) {
+				return false;
+			}
+			pos += record.numSamples * sizeof(PulseSample);
+			continue;
+		}
+		PulseEvent pulse;
+		pulse.length = record.length;
+		pulse.deadTime = record.deadTime;
+		pulse.ringdownTime = record.ringdownTime;
+		pulse.samples.resize(record.numSamples);
+		if (!ReadBytes(pos, end, pulse.samples.data(), pulse.samples.size() * sizeof(PulseSample))) {
+			return false;
+		}
+		cachedPulses[i] = PulseLibrary::Insert(cachedKeys[i], pulse);
+	}
+	for (unsigned int i = 0; i < cachedEvents.size(); i++) {
+		if (cachedEvents[i].kind == RF_EVENT && cachedEvents[i].pulseIdx >= header.numPulses) {
+			return false;
+		}
+	}
+	events.swap(cachedEvents);
+	segmentStartBlocks.swap(cachedStartBlocks);
+	segmentStartPhases.swap(cachedStartPhases);
+	uniquePulses.swap(cachedPulseIDs);
+	pulseLibrary.swap(cachedPulses);
+	pulseKeys.swap(cachedKeys);
+	numberOfADCBlocks = header.numADCs;
+	return true;
+}
+
 //! Set simulations parameters object
 /*!
 	\param SimPars new SimulationParameters object
@@ -58,8 +267,12 @@ bool BMCSim::LoadExternalSequence(std::string path)
 bool BMCSim::SetSimulationParameters(SimulationParameters &simPars) {
 	// sim parameters can only be updated if number of pools did not change
 	bool newSimParamsValid = (sp->GetNumberOfCESTPools() == simPars.GetNumberOfCESTPools() && sp->IsMTActive() == simPars.IsMTActive());
-	if (newSimParamsValid)
+	if (newSimParamsValid) {
+		bool newSolver = (sp->GetPropagationMethod() != simPars.GetPropagationMethod()); // solver type depends on the method
 		sp = &simPars;
+		if (newSolver)
+			InitSolver();
+	}
 	return newSimParamsValid;
 }
 
@@ -82,45 +295,116 @@ Eigen::MatrixXd BMCSim::GetCopyOfMagnetizationVectors()
 	return Mvec;
 }
 
+//! Get number of ADC events in the sequence
+/*!	\return number of columns of the magnetization vectors */
+unsigned int BMCSim::GetNumberOfADCEvents()
+{
+	return sequenceLoaded ? numberOfADCBlocks : 0;
+}
+
+//! Get number of returned ADC events
+/*!	\return number of columns of the returned magnetization vectors */
+unsigned int BMCSim::GetNumberOfOutputADCs()
+{
+	return sp->GetOutputADCs()->empty() ? this->GetNumberOfADCEvents() : sp->GetOutputADCs()->size();
+}
+
+//! Set an external buffer for the magnetization vectors
+/*!
+	The simulation writes the magnetization vectors directly to the buffer instead of Mvec, e.g. to the
+	output array of the mex function. The buffer must hold GetNumberOfOutputComponents() x GetNumberOfOutputADCs()
+	values in column-major order and stay valid during RunSimulation.
+	\param buffer external memory, NULL to store the magnetization vectors in Mvec again
+*/
+void BMCSim::SetOutputBuffer(double* buffer)
+{
+	outputBuffer = buffer;
+}
+
 
 //! Init the solver
 void BMCSim::InitSolver() {
-	switch (sp->GetNumberOfCESTPools()) {
-	case 0: // only water
-		if (sp->IsMTActive())
-			solver = std::unique_ptr<BlochMcConnellSolver<4> >(new BlochMcConnellSolver<4>(*sp));
-		else
-			solver = std::unique_ptr<BlochMcConnellSolver<3> >(new BlochMcConnellSolver<3>(*sp));
-		break;
-	case 1: // one cest pool
-		if (sp->IsMTActive())
-			solver = std::unique_ptr<BlochMcConnellSolver<7> >(new BlochMcConnellSolver<7>(*sp));
-		else
-			solver = std::unique_ptr<BlochMcConnellSolver<6> >(new BlochMcConnellSolver<6>(*sp));
-		break;
-	case 2: // two cest pools
-		if (sp->IsMTActive())
-			solver = std::unique_ptr<BlochMcConnellSolver<10> >(new BlochMcConnellSolver<10>(*sp));
-		else
-			solver = std::unique_ptr<BlochMcConnellSolver<9> >(new BlochMcConnellSolver<9>(*sp));
-		break;
-	case 3: // three cest pools
-		if (sp->IsMTActive())
-			solver = std::unique_ptr<BlochMcConnellSolver<13> >(new BlochMcConnellSolver<13>(*sp));
-		else
-			solver = std::unique_ptr<BlochMcConnellSolver<12> >(new BlochMcConnellSolver<12>(*sp));
-		break;
-	default:
-		solver = std::unique_ptr<BlochMcConnellSolver<Eigen::Dynamic> >(new BlochMcConnellSolver<Eigen::Dynamic>(*sp)); // > three pools
-		break;
+	workers.clear();
+	workers.resize(1);
+	workers[0].solver = this->CreateSolver();
+	workers[0].currentParams = NULL;
+	workers[0].currentBatch = -1;
+}
+
+
+//! Create a solver with a fixed matrix size
+/*!
+	Recursively generates the fixed-size solvers for 0 to numPools CEST pools, with and without MT
+*/
+template<int numPools> struct FixedSizeSolverFactory
+{
+	//! Create a new solver for the number of pools in sp
+	/*!
+		\param sp SimulationParameters object
+		\return fixed-size solver, NULL if sp has more than numPools CEST pools
+	*/
+	static std::unique_ptr<BlochMcConnellSolverBase> Create(SimulationParameters &sp)
+	{
+		if (sp.GetNumberOfCESTPools() != numPools) {
+			return FixedSizeSolverFactory<numPools - 1>::Create(sp);
+		}
+		if (sp.IsMTActive()) {
+			return std::unique_ptr<BlochMcConnellSolver<3 * (numPools + 1) + 1> >(new BlochMcConnellSolver<3 * (numPools + 1) + 1>(sp));
+		}
+		return std::unique_ptr<BlochMcConnellSolver<3 * (numPools + 1)> >(new BlochMcConnellSolver<3 * (numPools + 1)>(sp));
 	}
+};
+
+//! End of the recursion
+template<> struct FixedSizeSolverFactory<-1>
+{
+	static std::unique_ptr<BlochMcConnellSolverBase> Create(SimulationParameters &sp)
+	{
+		return std::unique_ptr<BlochMcConnellSolverBase>();
+	}
+};
+
+
+//! Create a new solver for the current number of pools
+/*!
+	Up to MAX_FIXED_SIZE_CEST_POOLS CEST pools, a solver with fixed-size matrices is used.
+	More pools and the ExpmvPropagation method for more than three pools use the arrowhead solver
+	\return Bloch McConnell solver with matching matrix size
+*/
+std::unique_ptr<BlochMcConnellSolverBase> BMCSim::CreateSolver() {
+	unsigned int numPools = sp->GetNumberOfCESTPools();
+	std::unique_ptr<BlochMcConnellSolverBase> solver;
+	if (numPools <= 3 || (numPools <= MAX_FIXED_SIZE_CEST_POOLS && sp->GetPropagationMethod() != ExpmvPropagation)) {
+		solver = FixedSizeSolverFactory<MAX_FIXED_SIZE_CEST_POOLS>::Create(*sp);
+	}
+	if (!solver) {
+		solver = std::unique_ptr<ArrowheadBlochMcConnellSolver>(new ArrowheadBlochMcConnellSolver(*sp));
+	}
+	return solver;
 }
 
 
 //! Decode the unique pulses from the seq file
 void BMCSim::DecodeSeqRFInfo()
 {
+	uniquePulses.clear();
+	pulseLibrary.clear();
+	pulseKeys.clear();
 	std::vector<PulseID> uniquePuleIDs;
+	std::map<const PulseEvent*, unsigned int> pulseIndices; // index of the shared pulses in pulseLibrary
+	// the error of an adaptively resampled pulse scales with the highest amplitude it is played out with
+	std::map<PulseID, double> maxAmplitudes;
+	if (sp->GetMaxPulseSampleError() > 0) {
+		for (unsigned int nSample = 0; nSample < seq.GetNumberOfBlocks(); nSample++) {
+			SeqBlock* seqBlock = seq.GetBlock(nSample);
+			if (seqBlock->isRF()) {
+				RFEvent rf = seqBlock->GetRFEvent();
+				double &maxAmplitude = maxAmplitudes[std::make_tuple(rf.magShape, rf.phaseShape, 0)];
+				maxAmplitude = std::max(maxAmplitude, fabs(rf.amplitude) * sp->GetScannerRelB1());
+			}
+			delete seqBlock;
+		}
+	}
 	for (unsigned int nSample = 0; nSample < seq.GetNumberOfBlocks(); nSample++)
 	{
 		SeqBlock* seqBlock = seq.GetBlock(nSample);
@@ -158,56 +442,73 @@ void BMCSim::DecodeSeqRFInfo()
 
 				amplitudeArray.erase(amplitudeArray.end() - delayAfterPulse, amplitudeArray.end());
 				phaseArray.erase(phaseArray.end() - delayAfterPulse, phaseArray.end());
-				// search for unique samples in amplitude and phase
-				std::vector<float> amplitudeArrayUnique(rfLength);
-				std::vector<float>::iterator it_amplitude = std::unique_copy(amplitudeArray.begin(), amplitudeArray.end(), amplitudeArrayUnique.begin());
-				amplitudeArrayUnique.resize(std::distance(amplitudeArrayUnique.begin(), it_amplitude));
-				std::vector<float> phaseArrayUnique(rfLength);
-				std::vector<float>::iterator it_phase = std::unique_copy(phaseArray.begin(), phaseArray.end(), phaseArrayUnique.begin());
-				phaseArrayUnique.resize(std::distance(phaseArrayUnique.begin(), it_phase));
-
-				// need to resample pulse
-				unsigned int max_samples = std::max(amplitudeArrayUnique.size(), phaseArrayUnique.size());
-				if (max_samples > sp->GetMaxNumberOfPulseSamples()) {
-					int sampleFactor = ceil(float(rfLength) / sp->GetMaxNumberOfPulseSamples());
-					float pulseSamples = rfLength / sampleFactor;
-					float timestep = float(sampleFactor) * 1e-6;
-					// resmaple the original pulse with max ssamples and run the simulation
-					pulse.samples.resize(pulseSamples);
-					for (int i = 0; i < pulseSamples; i++) {
-						pulse.samples[i].magnitude = seqBlock->GetRFAmplitudePtr()[i*sampleFactor];
-						pulse.samples[i].phase = seqBlock->GetRFPhasePtr()[i*sampleFactor];
-						pulse.samples[i].timestep = timestep;
+				// identical pulses of all simulations are decoded only once
+				PulseLibrary::PulseKey key = PulseLibrary::MakeKey(amplitudeArray, phaseArray, pulse.deadTime, pulse.ringdownTime,
+					sp->GetMaxNumberOfPulseSamples(), sp->GetMaxPulseSampleError(), maxAmplitudes[p]);
+				std::shared_ptr<const PulseEvent> sharedPulse = PulseLibrary::Find(key);
+				if (!sharedPulse) {
+					// search for unique samples in amplitude and phase
+					std::vector<float> amplitudeArrayUnique(rfLength);
+					std::vector<float>::iterator it_amplitude = std::unique_copy(amplitudeArray.begin(), amplitudeArray.end(), amplitudeArrayUnique.begin());
+					amplitudeArrayUnique.resize(std::distance(amplitudeArrayUnique.begin(), it_amplitude));
+					std::vector<float> phaseArrayUnique(rfLength);
+					std::vector<float>::iterator it_phase = std::unique_copy(phaseArray.begin(), phaseArray.end(), phaseArrayUnique.begin());
+					phaseArrayUnique.resize(std::distance(phaseArrayUnique.begin(), it_phase));
+
+					// need to resample pulse
+					unsigned int max_samples = std::max(amplitudeArrayUnique.size(), phaseArrayUnique.size());
+					if (sp->GetMaxPulseSampleError() > 0) { // merge samples as long as the error bound allows it
+						this->CompressPulseSamples(pulse, amplitudeArray, phaseArray, maxAmplitudes[p]);
 					}
-				}
-				else {
-					std::vector<unsigned int>samplePositions(max_samples + 1);
-					unsigned int sample_idx = 0;
-					if (amplitudeArrayUnique.size() >= phaseArrayUnique.size()) {
-						std::vector<float>::iterator it = amplitudeArray.begin();
-						for (it_amplitude = amplitudeArrayUnique.begin(); it_amplitude != amplitudeArrayUnique.end(); ++it_amplitude) {
-							it = std::find(it, amplitudeArray.end(), *it_amplitude);
-							samplePositions[sample_idx++] = std::distance(amplitudeArray.begin(), it);
+					else if (max_samples > sp->GetMaxNumberOfPulseSamples()) {
+						int sampleFactor = ceil(float(rfLength) / sp->GetMaxNumberOfPulseSamples());
+						float pulseSamples = rfLength / sampleFactor;
+						float timestep = float(sampleFactor) * 1e-6;
+						// resmaple the original pulse with max ssamples and run the simulation
+						pulse.samples.resize(pulseSamples);
+						for (int i = 0; i < pulseSamples; i++) {
+							pulse.samples[i].magnitude = seqBlock->GetRFAmplitudePtr()[i*sampleFactor];
+							pulse.samples[i].phase = seqBlock->GetRFPhasePtr()[i*sampleFactor];
+							pulse.samples[i].timestep = timestep;
 						}
 					}
 					else {
-						std::vector<float>::iterator it = phaseArray.begin();
-						for (it_phase = phaseArrayUnique.begin(); it_phase != phaseArrayUnique.end(); ++it_phase) {
-							it = std::find(it, phaseArray.end(), *it_phase);
-							samplePositions[sample_idx++] = std::distance(phaseArray.begin(), it);
+						std::vector<unsigned int>samplePositions(max_samples + 1);
+						unsigned int sample_idx = 0;
+						if (amplitudeArrayUnique.size() >= phaseArrayUnique.size()) {
+							std::vector<float>::iterator it = amplitudeArray.begin();
+							for (it_amplitude = amplitudeArrayUnique.begin(); it_amplitude != amplitudeArrayUnique.end(); ++it_amplitude) {
+								it = std::find(it, amplitudeArray.end(), *it_amplitude);
+								samplePositions[sample_idx++] = std::distance(amplitudeArray.begin(), it);
+							}
+						}
+						else {
+							std::vector<float>::iterator it = phaseArray.begin();
+							for (it_phase = phaseArrayUnique.begin(); it_phase != phaseArrayUnique.end(); ++it_phase) {
+								it = std::find(it, phaseArray.end(), *it_phase);
+								samplePositions[sample_idx++] = std::distance(phaseArray.begin(), it);
+							}
+						}
+						pulse.samples.resize(max_samples);
+						samplePositions[max_samples] = rfLength;
+						// now we have the duration of the single samples -> simulate it
+						for (int i = 0; i < max_samples; i++) {
+							pulse.samples[i].magnitude = seqBlock->GetRFAmplitudePtr()[samplePositions[i]];
+							pulse.samples[i].phase = seqBlock->GetRFPhasePtr()[samplePositions[i]];
+							pulse.samples[i].timestep = (samplePositions[i + 1] - samplePositions[i]) * 1e-6;
 						}
 					}
-					pulse.samples.resize(max_samples);
-					samplePositions[max_samples] = rfLength;
-					// now we have the duration of the single samples -> simulate it
-					for (int i = 0; i < max_samples; i++) {
-						pulse.samples[i].magnitude = seqBlock->GetRFAmplitudePtr()[samplePositions[i]];
-						pulse.samples[i].phase = seqBlock->GetRFPhasePtr()[samplePositions[i]];
-						pulse.samples[i].timestep = (samplePositions[i + 1] - samplePositions[i]) * 1e-6;
-					}
+					sharedPulse = PulseLibrary::Insert(key, pulse);
+				}
+				// pulses with different shape ids but the same samples get the same index
+				std::map<const PulseEvent*, unsigned int>::iterator itPulse = pulseIndices.find(sharedPulse.get());
+				if (itPulse == pulseIndices.end()) {
+					itPulse = pulseIndices.insert(std::make_pair(sharedPulse.get(), (unsigned int)pulseLibrary.size())).first;
+					pulseLibrary.push_back(sharedPulse);
+					pulseKeys.push_back(key);
 				}
 				uniquePuleIDs.push_back(p);
-				uniquePulses.insert(std::make_pair(p, pulse));
+				uniquePulses.insert(std::make_pair(p, itPulse->second));
 			}
 		}
 		delete seqBlock;
@@ -215,96 +516,712 @@ void BMCSim::DecodeSeqRFInfo()
 }
 
 
+//! Merge adjacent pulse samples to piecewise-constant segments with a bounded error
+/*!
+	Each segment is played out with the mean complex rf field of the merged samples, so the area of the
+	pulse is preserved. The error of a segment is the integrated deviation of the rf field from the mean,
+	which bounds the difference of the rotation [rad] and of the magnetization (relative to |M|).
+	Each segment may use a share of GetMaxPulseSampleError() proportional to its duration, so the error
+	of the whole pulse stays below the bound. The deviation is estimated with sqrt(n * sum(|b - mean|^2)),
+	which is an upper bound of sum(|b - mean|) and can be updated in O(1) when a sample is added.
+	\param pulse pulse event that gets the merged samples
+	\param amplitudes normalized amplitude of each 1 us sample
+	\param phases phase [rad] of each 1 us sample
+	\param maxAmplitude highest amplitude [Hz] the pulse is played out with
+*/
+void BMCSim::CompressPulseSamples(PulseEvent &pulse, const std::vector<float> &amplitudes, const std::vector<float> &phases, double maxAmplitude)
+{
+	const double dt = 1e-6; // pulseq shapes are sampled at 1 us
+	unsigned int numSamples = amplitudes.size();
+	pulse.samples.clear();
+	if (numSamples == 0) {
+		return;
+	}
+	double maxRMSDeviation = sp->GetMaxPulseSampleError() / (TWO_PI * maxAmplitude * numSamples * dt); // allowed rms deviation of the normalized samples in a segment
+	unsigned int start = 0;
+	while (start < numSamples) {
+		std::complex<double> sum = 0.0;
+		double sumSquares = 0.0;
+		unsigned int end;
+		for (end = start; end < numSamples; end++) {
+			std::complex<double> b = std::polar(double(amplitudes[end]), double(phases[end]));
+			unsigned int n = end - start + 1;
+			double deviation = std::max(0.0, sumSquares + std::norm(b) - std::norm(sum + b) / n); // sum(|b - mean|^2)
+			if (n > 1 && deviation > n * maxRMSDeviation * maxRMSDeviation) {
+				break;
+			}
+			sum += b;
+			sumSquares += std::norm(b);
+		}
+		std::complex<double> mean = sum / double(end - start);
+		PulseSample sample;
+		sample.magnitude = std::abs(mean);
+		sample.phase = std::arg(mean);
+		sample.timestep = (end - start) * dt;
+		pulse.samples.push_back(sample);
+		start = end;
+	}
+}
+
+
 //! Get a unique pulse
 /*!
 	\param pair a pair containing the magnitude and phase id of the seq file
 	\return pointer to vector containing the pulse samples of a unique pulse
 */
-PulseEvent* BMCSim::GetUniquePulse(PulseID id)
+const PulseEvent* BMCSim::GetUniquePulse(PulseID id)
 {
-	std::map<PulseID, PulseEvent>::iterator it;
+	std::map<PulseID, unsigned int>::iterator it;
 	it = uniquePulses.find(id);
-	return &(it->second);
+	return pulseLibrary[it->second].get();
 }
 
-//! Decode ADC info
-/*!	\return true if external sequence contains ADC events */
-bool BMCSim::DecodeSeqADCInfo() {
+//! Compile the sequence blocks to simulation events
+/*!
+	Decodes each block once, so that the simulation runs without accessing the seq file.
+	Also stores the first event and the accumulated rf phase of each ADC segment
+	\return true if external sequence contains ADC events
+*/
+bool BMCSim::CompileSimulationEvents() {
 	numberOfADCBlocks = 0;
+	events.clear();
+	events.reserve(seq.GetNumberOfBlocks());
+	segmentStartBlocks.clear();
+	segmentStartPhases.clear();
+	float accummPhase = 0;
+	segmentStartBlocks.push_back(0);
+	segmentStartPhases.push_back(accummPhase);
 	for (unsigned int nSample = 0; nSample < seq.GetNumberOfBlocks(); nSample++) {
 		SeqBlock* seqBlock = seq.GetBlock(nSample);
+		SimulationEvent event = {};
 		if (seqBlock->isADC()) {
+			event.kind = ADC_EVENT;
 			numberOfADCBlocks++;
+			segmentStartBlocks.push_back(nSample + 1);
+			segmentStartPhases.push_back(accummPhase);
+		}
+		else if (seqBlock->isTrapGradient(0) && seqBlock->isTrapGradient(1) && seqBlock->isTrapGradient(2)) {
+			event.kind = SPOILER_EVENT;
+			event.duration = seqBlock->GetDuration()*1e-6;
+		}
+		else if (seqBlock->isRF()) {
+			event.kind = RF_EVENT;
+			RFEvent rf = seqBlock->GetRFEvent();
+			int timeID = 0; // timeID is placeholder for future Pulseq 1.4 support
+			event.pulseIdx = uniquePulses.find(std::make_tuple(rf.magShape, rf.phaseShape, timeID))->second;
+			event.amplitude = rf.amplitude;
+			event.freqOffset = rf.freqOffset;
+			event.phaseOffset = rf.phaseOffset;
+			int phaseDegree = pulseLibrary[event.pulseIdx]->length * 1e-6 * 360 * rf.freqOffset;
+			phaseDegree %= 360;
+			event.phaseIncrement = float(phaseDegree) / 180 * PI;
+			accummPhase += event.phaseIncrement;
 		}
+		else { // delay or single gradient -> simulated as delay
+			event.kind = DELAY_EVENT;
+			float timestep = float(seqBlock->GetDuration())*1e-6;
+			event.duration = timestep;
+		}
+		events.push_back(event);
 		delete seqBlock; // pointer gets allocate with new in the GetBlock() function
 	}
 	return numberOfADCBlocks > 0 ? true : false;
 }
 
+//! Get the B0 inhomogeneity of an isochromat
+/*!
+	The off-resonances of the isochromats follow a Cauchy-Lorentz distribution
+	dw = R2' * tan(0.9 * pi * (X - 0.5)) with R2' = 1/T2* - R2 (doi:10.1002/mrm.22406)
+	\param isochromatIdx index of the isochromat [0 ... numberOfIsochromats-1]
+	\return B0 inhomogeneity of the isochromat [ppm]
+*/
+double BMCSim::GetIsochromatB0Inhomogeneity(unsigned int isochromatIdx)
+{
+	unsigned int numIsochromats = sp->GetNumberOfIsochromats();
+	double x = numIsochromats > 1 ? -0.5 + double(isochromatIdx) / double(numIsochromats - 1) : 0.0;
+	double r2dash = sp->GetT2Star() > 0.0 ? 1.0 / sp->GetT2Star() - sp->GetWaterPool()->GetR2() : 0.0;
+	double dwSpin = r2dash * tan(M_PI * 0.9 * x);
+	return sp->GetScannerB0Inhom() + dwSpin / (sp->GetScannerB0()*sp->GetScannerGamma());
+}
+
 //! Run Simulation
+/*!
+	Multiple isochromats and independent ADC segments are distributed to NumberOfThreads threads.
+	For multiple isochromats the mean magnetization of all isochromats is returned.
+	\return true if the simulation was successful
+*/
 bool BMCSim::RunSimulation() {
 	bool status = sequenceLoaded;
 	if (status) {
-		Mvec = sp->GetInitialMagnetizationVector()->rowwise().replicate(numberOfADCBlocks);
-		solver->UpdateSimulationParameters(*sp);
-		unsigned int currentADC = 0;
-		float accummPhase = 0; // since we simulate in reference frame, we need to take care of the accummulated phase
-		// loop through event blocks
-		Eigen::VectorXd M = Mvec.col(currentADC);
-		for (unsigned int nSample = 0; nSample < seq.GetNumberOfBlocks(); nSample++)
-		{
-			// get current event block
-			SeqBlock* seqBlock = seq.GetBlock(nSample);
-			if (seqBlock->isADC()) {
-				Mvec.col(currentADC) = M;
-				if (Mvec.cols() <= ++currentADC) {
-					break;
-				}
-				if (sp->GetUseInitMagnetization()) {
-					M = Mvec.col(currentADC);
+		// isochromats are simulated in groups of a single isochromat or a batch of lanes for the batched solver
+		unsigned int numIsochromats = std::max(1u, sp->GetNumberOfIsochromats());
+		unsigned int groupSize = 1;
+		if (numIsochromats > 1 && sp->GetNumberOfBatchLanes() > 1 && !sp->GetUseBlockPropagation()) {
+			unsigned int numLanes = (sp->GetNumberOfBatchLanes() + BATCH_LANE_BLOCK - 1) / BATCH_LANE_BLOCK * BATCH_LANE_BLOCK; // the solver uses full lane blocks anyway
+			groupSize = std::min(numIsochromats, numLanes);
+		}
+		unsigned int numGroups = (numIsochromats + groupSize - 1) / groupSize;
+		// parameters of all isochromats and results of all groups
+		std::vector<SimulationParameters> isochromatParams(numIsochromats > 1 ? numIsochromats : 0, *sp);
+		std::vector<SimulationParameters*> params(1, sp);
+		// results are written to the external buffer or Mvec, the storage is only reallocated if the size changed
+		if (!this->SetupOutput()) {
+			return false;
+		}
+		unsigned int numRows = sp->GetNumberOfOutputComponents();
+		unsigned int numCols = this->GetNumberOfOutputADCs();
+		if (outputBuffer == NULL) {
+			Mvec.resize(numRows, numCols);
+		}
+		Eigen::Map<Eigen::MatrixXd> output(outputBuffer != NULL ? outputBuffer : Mvec.data(), numRows, numCols);
+		normMvec.resize(numRows, numGroups);
+		std::vector<double*> results(1, output.data());
+		if (numIsochromats > 1) {
+			params.resize(numIsochromats);
+			results.resize(numGroups);
+			groupMvec.resize(numGroups);
+			for (unsigned int i = 0; i < numIsochromats; i++) {
+				isochromatParams[i].SetScannerB0Inhom(this->GetIsochromatB0Inhomogeneity(i));
+				params[i] = &isochromatParams[i];
+			}
+			for (unsigned int g = 0; g < numGroups; g++) {
+				groupMvec[g].resize(numRows, numCols);
+				results[g] = groupMvec[g].data();
+			}
+		}
+		// the parameters could have changed since the last run
+		for (unsigned int w = 0; w < workers.size(); w++) {
+			workers[w].currentParams = NULL;
+			workers[w].currentBatch = -1;
+		}
+		// all adc segments start from the initial magnetization and can be simulated independently
+		// they are only split if there are not enough isochromats to keep all threads busy, since
+		// the solver cache is cleared each time a thread switches to another isochromat
+		// segments without a returned ADC event are skipped
+		ThreadPool pool(sp->GetNumberOfThreads());
+		bool splitSegments = numGroups < pool.GetNumberOfThreads() && sp->GetUseInitMagnetization();
+		std::vector<unsigned int> segments(1, 0);
+		if (splitSegments) {
+			segments.clear();
+			for (unsigned int adc = 0; adc < numRequiredADCs; adc++) {
+				if (outputColumns[adc] >= 0 || int(adc) == normalizationADC) {
+					segments.push_back(adc);
 				}
 			}
-			else if (seqBlock->isTrapGradient(0) && seqBlock->isTrapGradient(1) && seqBlock->isTrapGradient(2)) {
-				// delay for block duration
-				solver->UpdateBlochMatrix(*sp, 0, 0, 0);
-				solver->SolveBlochEquation(M, seqBlock->GetDuration()*1e-6);
-				// kill transverse magnetization
-				for (int i = 0; i < (sp->GetNumberOfCESTPools() + 1) * 2; i++)
-					M[i] = 0.0;
+		}
+		unsigned int numSegments = segments.size();
+		unsigned int numTasks = numGroups * numSegments;
+		unsigned int numWorkers = std::min(pool.GetNumberOfThreads(), numTasks);
+		while (workers.size() < numWorkers) {
+			workers.push_back(SimulationWorker());
+			workers.back().solver = this->CreateSolver();
+			workers.back().currentParams = NULL;
+			workers.back().currentBatch = -1;
+		}
+		pool.Run(numTasks, [&](unsigned int w, unsigned int task) {
+			unsigned int group = task / numSegments;
+			unsigned int segment = segments[task % numSegments];
+			unsigned int endEvent = splitSegments ? segmentStartBlocks[segment + 1] : events.size();
+			if (groupSize > 1) {
+				unsigned int firstIsochromat = group * groupSize;
+				std::vector<SimulationParameters*> laneParams(params.begin() + firstIsochromat, params.begin() + std::min(firstIsochromat + groupSize, numIsochromats));
+				this->SetWorkerBatch(workers[w], laneParams, group, groupSize);
+				Eigen::Map<Eigen::MatrixXd> Mout(results[group], numRows, numCols);
+				this->SimulateEventsBatched(workers[w], Mout, normMvec.col(group), laneParams.size(), segmentStartBlocks[segment], endEvent, segment, segmentStartPhases[segment]);
+			}
+			else {
+				this->SetWorkerParameters(workers[w], *params[group]);
+				Eigen::VectorXd M = *(sp->GetInitialMagnetizationVector());
+				Eigen::Map<Eigen::MatrixXd> Mout(results[group], numRows, numCols);
+				this->SimulateEvents(workers[w], Mout, normMvec.col(group), M, segmentStartBlocks[segment], endEvent, segment, segmentStartPhases[segment]);
+			}
+		});
+		// mean of all isochromats
+		if (numIsochromats > 1) {
+			output = groupMvec[0];
+			for (unsigned int g = 1; g < numGroups; g++) {
+				output += groupMvec[g];
 			}
-			else if (seqBlock->isRF()) { // saturation pulse
-				int timeID = 0; // timeID is placeholder for future Pulseq 1.4 support
-				BMCSim::PulseID p = std::make_tuple(seqBlock->GetRFEvent().magShape, seqBlock->GetRFEvent().phaseShape, timeID); // get the magnitude, phase and time tuple
-				PulseEvent* pulse = this->GetUniquePulse(p); // find the unque rf id in the previously decoded seq file library
+			output /= double(numIsochromats);
+		}
+		// divide by the (mean) magnetization at the normalization ADC event
+		if (normalizationADC >= 0) {
+			Eigen::VectorXd norm = normMvec.rowwise().sum() / double(numIsochromats);
+			output.array().colwise() /= norm.array();
+		}
+	}
+	return status;
+}
+
+//! Run the simulation for the entries of a parameter sweep
+/*!
+	All entries share the decoded sequence and pulse library. The entries are distributed to NumberOfThreads threads,
+	each thread keeps a copy of the parameters that is overwritten for every entry it simulates.
+	The output components, output ADC events and normalization ADC event of the simulation parameters are used for all entries.
+	\param sweep parameter sweep with the same pools as the simulation parameters
+	\param output memory for numEntries x output ADCs x output components values, the magnetization vectors of an
+	       entry are stored consecutively with the same layout as GetMagnetizationVectors()
+	\param firstEntry index of the first simulated entry
+	\param numEntries number of simulated entries, limited to the remaining entries of the sweep
+	\return false if no sequence is loaded, the output selection is invalid, the pools differ or isochromats are used
+*/
+bool BMCSim::RunSweep(ParameterSweep &sweep, double* output, unsigned int firstEntry, unsigned int numEntries)
+{
+	SimulationParameters &base = *sweep.GetBaseParameters();
+	if (!sequenceLoaded || !this->SetupOutput() || sp->GetNumberOfIsochromats() > 1) {
+		return false;
+	}
+	if (base.GetNumberOfCESTPools() != sp->GetNumberOfCESTPools() || base.IsMTActive() != sp->IsMTActive() ||
+		base.GetInitialMagnetizationVector()->rows() != sp->GetInitialMagnetizationVector()->rows()) {
+		return false;
+	}
+	unsigned int numSweepEntries = sweep.GetNumberOfEntries();
+	if (firstEntry >= numSweepEntries) {
+		return numEntries == 0;
+	}
+	numEntries = std::min(numEntries, numSweepEntries - firstEntry);
+	unsigned int numRows = sp->GetNumberOfOutputComponents();
+	unsigned int numCols = this->GetNumberOfOutputADCs();
+	ThreadPool pool(sp->GetNumberOfThreads());
+	unsigned int numWorkers = std::min(pool.GetNumberOfThreads(), numEntries);
+	while (workers.size() < numWorkers) {
+		workers.push_back(SimulationWorker());
+		workers.back().solver = this->CreateSolver();
+		workers.back().currentParams = NULL;
+		workers.back().currentBatch = -1;
+	}
+	std::vector<SimulationParameters> entryParams(numWorkers, base);
+	Eigen::MatrixXd entryNorm(numRows, numWorkers);
+	// neighbouring entries stay on the same thread, which keeps the output writes of a thread contiguous
+	pool.Run(numEntries, [&](unsigned int w, unsigned int task) {
+		unsigned int entry = firstEntry + task;
+		sweep.ApplyEntry(entry, entryParams[w]);
+		workers[w].currentParams = NULL; // same object, but new values
+		this->SetWorkerParameters(workers[w], entryParams[w]);
+		Eigen::VectorXd M = *(entryParams[w].GetInitialMagnetizationVector());
+		Eigen::Map<Eigen::MatrixXd> Mout(output + size_t(task) * numRows * numCols, numRows, numCols);
+		this->SimulateEvents(workers[w], Mout, entryNorm.col(w), M, 0, events.size(), 0, 0.0);
+		if (normalizationADC >= 0) {
+			Mout.array().colwise() /= entryNorm.col(w).array();
+		}
+	});
+	// the solvers of the workers do not belong to the simulation parameters anymore
+	for (unsigned int w = 0; w < workers.size(); w++) {
+		workers[w].currentParams = NULL;
+	}
+	return true;
+}
+
+//! Get the counters and timers of all simulations since the last reset
+/*!
+	The counters of all threads and solvers are summed up, they are also reset if the solvers are recreated. All values except the pulse library info are zero
+	if the library was compiled without PULSEQCEST_STATS, see SimulationStats::IsEnabled()
+	\return summed counters and timers
+*/
+SimulationStats BMCSim::GetStats()
+{
+	SimulationStats stats;
+	for (unsigned int w = 0; w < workers.size(); w++) {
+		stats.Add(workers[w].stats);
+		stats.Add(*workers[w].solver->GetStats());
+		if (workers[w].batchedSolver) {
+			stats.Add(*workers[w].batchedSolver->GetStats());
+		}
+	}
+	stats.pulseLibrarySize = pulseLibrary.size();
+	for (unsigned int i = 0; i < pulseLibrary.size(); i++) {
+		stats.pulseLibrarySamples += pulseLibrary[i]->samples.size();
+	}
+	return stats;
+}
+
+//! Reset the counters and timers
+void BMCSim::ResetStats()
+{
+	for (unsigned int w = 0; w < workers.size(); w++) {
+		workers[w].stats.Reset();
+		workers[w].solver->GetStats()->Reset();
+		if (workers[w].batchedSolver) {
+			workers[w].batchedSolver->GetStats()->Reset();
+		}
+	}
+}
+
+//! Run the simulation for the remaining chunks of a dictionary file
+/*!
+	Each chunk is simulated directly into the mapped file and flushed before the next chunk starts,
+	so an interrupted sweep continues with the first chunk that was not completed.
+	Errors of the dictionary file are thrown as std::runtime_error
+	\param sweep parameter sweep the dictionary was created for
+	\param dictionary dictionary file that is open for writing
+	\return false if the sweep or the output selection does not match the dictionary or the simulation failed
+*/
+bool BMCSim::RunSweep(ParameterSweep &sweep, DictionaryFile &dictionary)
+{
+	if (!sequenceLoaded || !this->SetupOutput() || dictionary.GetNumberOfEntries() != sweep.GetNumberOfEntries() || dictionary.GetNormalizationADC() != normalizationADC) {
+		return false;
+	}
+	// the stored components and ADC events have to be the ones that are simulated
+	std::vector<unsigned int> components = *sp->GetOutputComponents();
+	for (unsigned int c = 0; components.empty() && c < sp->GetInitialMagnetizationVector()->rows(); c++) {
+		components.push_back(c);
+	}
+	std::vector<unsigned int> adcs(this->GetNumberOfOutputADCs());
+	for (unsigned int adc = 0; adc < numberOfADCBlocks; adc++) {
+		if (outputColumns[adc] >= 0) {
+			adcs[outputColumns[adc]] = adc;
+		}
+	}
+	if (components != *dictionary.GetComponents() || adcs != *dictionary.GetADCs()) {
+		return false;
+	}
+	unsigned int firstEntry, numEntries;
+	while (double* chunk = dictionary.BeginChunk(firstEntry, numEntries)) {
+		if (!this->RunSweep(sweep, chunk, firstEntry, numEntries)) {
+			return false;
+		}
+		dictionary.CommitChunk();
+	}
+	return true;
+}
+
+//! Set up the output columns from the output ADCs of the simulation parameters
+/*!
+	\return false if an output component or ADC event does not exist or an ADC event is selected twice
+*/
+bool BMCSim::SetupOutput()
+{
+	std::vector<unsigned int> &components = *sp->GetOutputComponents();
+	for (unsigned int c = 0; c < components.size(); c++) {
+		if (components[c] >= sp->GetInitialMagnetizationVector()->rows()) {
+			return false;
+		}
+	}
+	std::vector<unsigned int> &adcs = *sp->GetOutputADCs();
+	normalizationADC = sp->GetNormalizationADC();
+	if (normalizationADC >= int(numberOfADCBlocks)) {
+		return false;
+	}
+	outputColumns.assign(numberOfADCBlocks, adcs.empty() ? 0 : -1);
+	numRequiredADCs = adcs.empty() ? numberOfADCBlocks : normalizationADC + 1;
+	for (unsigned int i = 0; i < numberOfADCBlocks && adcs.empty(); i++) {
+		outputColumns[i] = i;
+	}
+	for (unsigned int i = 0; i < adcs.size(); i++) {
+		if (adcs[i] >= numberOfADCBlocks || outputColumns[adcs[i]] >= 0) {
+			return false;
+		}
+		outputColumns[adcs[i]] = i;
+		numRequiredADCs = std::max(numRequiredADCs, adcs[i] + 1);
+	}
+	return true;
+}
+
+//! Store the selected components of the magnetization at an ADC event
+/*!
+	\param Mout matrix with the returned magnetization vectors
+	\param Mnorm selected components at the normalization ADC event
+	\param adc index of the ADC event
+	\param M magnetization vector
+*/
+template<typename VectorType>
+void BMCSim::StoreMagnetization(Eigen::Ref<Eigen::MatrixXd> &Mout, Eigen::Ref<Eigen::VectorXd> &Mnorm, unsigned int adc, const VectorType &M)
+{
+	const std::vector<unsigned int> &components = *sp->GetOutputComponents();
+	int col = outputColumns[adc];
+	if (col >= 0) {
+		if (components.empty()) {
+			Mout.col(col) = M;
+		}
+		for (unsigned int c = 0; c < components.size(); c++) {
+			Mout(c, col) = M(components[c]);
+		}
+	}
+	if (int(adc) == normalizationADC) {
+		if (components.empty()) {
+			Mnorm = M;
+		}
+		for (unsigned int c = 0; c < components.size(); c++) {
+			Mnorm(c) = M(components[c]);
+		}
+	}
+}
+
+//! Set the parameters of a simulation worker
+/*!
+	The solver is only updated if the parameters changed
+	\param worker simulation worker
+	\param simPars new SimulationParameters object
+*/
+void BMCSim::SetWorkerParameters(SimulationWorker &worker, SimulationParameters &simPars)
+{
+	if (worker.currentParams != &simPars) {
+		worker.solver->UpdateSimulationParameters(simPars);
+		worker.blockPropagators.clear(); // solver dropped all block propagators
+		worker.currentParams = &simPars;
+	}
+}
+
+//! Set the lane parameters of the batched solver of a simulation worker
+/*!
+	The batched solver is created on first use and only updated if the batch changed
+	\param worker simulation worker
+	\param laneParams SimulationParameters objects of the lanes
+	\param batchIdx index of the batch
+	\param numLanes number of lanes of the batched solver
+*/
+void BMCSim::SetWorkerBatch(SimulationWorker &worker, std::vector<SimulationParameters*> &laneParams, unsigned int batchIdx, unsigned int numLanes)
+{
+	if (!worker.batchedSolver || worker.batchedSolver->GetNumberOfLanes() < numLanes) {
+		worker.batchedSolver = std::unique_ptr<BatchedBlochMcConnellSolver>(new BatchedBlochMcConnellSolver(*sp, numLanes));
+		worker.currentBatch = -1;
+	}
+	if (worker.currentBatch != int(batchIdx)) {
+		worker.batchedSolver->UpdateSimulationParameters(laneParams);
+		worker.currentBatch = batchIdx;
+	}
+}
+
+//! Simulate a range of simulation events
+/*!
+	\param worker simulation worker with the solver that is used
+	\param Mout matrix with the returned magnetization vectors
+	\param Mnorm selected components at the normalization ADC event
+	\param M magnetization vector
+	\param firstEvent index of the first event
+	\param endEvent index after the last event
+	\param firstADC index of the first ADC event in the event range
+	\param accummPhase accumulated rf phase before the first event
+*/
+void BMCSim::SimulateEvents(SimulationWorker &worker, Eigen::Ref<Eigen::MatrixXd> Mout, Eigen::Ref<Eigen::VectorXd> Mnorm, Eigen::VectorXd &M, unsigned int firstEvent, unsigned int endEvent, unsigned int firstADC, float accummPhase)
+{
+	BlochMcConnellSolverBase &solver = *worker.solver;
+	SimulationParameters &simPars = *worker.currentParams;
+	unsigned int currentADC = firstADC;
+	// since we simulate in reference frame, we need to take care of the accummulated phase
+	// loop through events
+	for (unsigned int nEvent = firstEvent; nEvent < endEvent; nEvent++)
+	{
+		const SimulationEvent &event = events[nEvent];
+		STATS_TIMER_START(eventStart);
+		switch (event.kind)
+		{
+		case ADC_EVENT:
+			this->StoreMagnetization(Mout, Mnorm, currentADC, M);
+			if (numRequiredADCs <= ++currentADC) {
+				STATS_TIMER_STOP(worker.stats, ADC_EVENT, eventStart);
+				return;
+			}
+			if (simPars.GetUseInitMagnetization()) {
+				M = *(simPars.GetInitialMagnetizationVector());
+			}
+			break;
+		case SPOILER_EVENT:
+			// delay for block duration
+			solver.UpdateBlochMatrix(simPars, 0, 0, 0);
+			solver.SolveBlochEquation(M, event.duration);
+			// kill transverse magnetization
+			for (int i = 0; i < (simPars.GetNumberOfCESTPools() + 1) * 2; i++)
+				M[i] = 0.0;
+			break;
+		case RF_EVENT:
+			if (simPars.GetUseBlockPropagation()) { // saturation pulse(s) with block propagators
+				nEvent = this->RunBlockPropagation(worker, M, nEvent, endEvent, accummPhase);
+			}
+			else { // saturation pulse
+				const PulseEvent &pulse = *pulseLibrary[event.pulseIdx];
 				// delay before pulse?
-				if (pulse->deadTime > 0) {
-					solver->UpdateBlochMatrix(*sp, 0, 0, 0);
-					solver->SolveBlochEquation(M, pulse->deadTime);
+				if (pulse.deadTime > 0) {
+					solver.UpdateBlochMatrix(simPars, 0, 0, 0);
+					solver.SolveBlochEquation(M, pulse.deadTime);
 				}
 				// loop trough pulse samples
-				std::vector<PulseSample>* pulseSamples = &(pulse->samples);
-				double rfFrequency = seqBlock->GetRFEvent().freqOffset;
-				for (int p = 0; p < pulseSamples->size(); p++) { // loop through pulse samples
-					solver->UpdateBlochMatrix(*sp, pulseSamples->at(p).magnitude*seqBlock->GetRFEvent().amplitude, rfFrequency, -pulseSamples->at(p).phase + seqBlock->GetRFEvent().phaseOffset - accummPhase);
-					solver->SolveBlochEquation(M, pulseSamples->at(p).timestep);
+				double rfFrequency = event.freqOffset;
+				STATS_ADD(worker.stats, rfSamples, pulse.samples.size());
+				for (unsigned int p = 0; p < pulse.samples.size(); p++) { // loop through pulse samples
+					solver.UpdateBlochMatrix(simPars, pulse.samples[p].magnitude*event.amplitude, rfFrequency, -pulse.samples[p].phase + event.phaseOffset - accummPhase);
+					solver.SolveBlochEquation(M, pulse.samples[p].timestep);
 				}
 				// delay at end of the pulse?
-				if (pulse->ringdownTime > 0) {
-					solver->UpdateBlochMatrix(*sp, 0, 0, 0);
-					solver->SolveBlochEquation(M, pulse->ringdownTime);
+				if (pulse.ringdownTime > 0) {
+					solver.UpdateBlochMatrix(simPars, 0, 0, 0);
+					solver.SolveBlochEquation(M, pulse.ringdownTime);
 				}
-				int phaseDegree = pulse->length * 1e-6 * 360 * seqBlock->GetRFEvent().freqOffset;
-				phaseDegree %= 360;
-				accummPhase += float(phaseDegree) / 180 * PI;
+				accummPhase += event.phaseIncrement;
+			}
+			break;
+		case DELAY_EVENT: // delay or single gradient -> simulated as delay
+			solver.UpdateBlochMatrix(simPars, 0, 0, 0);
+			solver.SolveBlochEquation(M, event.duration);
+			break;
+		}
+		STATS_TIMER_STOP(worker.stats, event.kind, eventStart);
+	}
+}
+
+
+//! Simulate a range of simulation events for a batch of parameter sets
+/*!
+	The sum of the magnetization vectors of all active lanes is stored at each ADC event
+	\param worker simulation worker with the batched solver that is used
+	\param Mout matrix with the returned summed magnetization vectors
+	\param Mnorm selected summed components at the normalization ADC event
+	\param numActiveLanes number of lanes that contribute to Mout
+	\param firstEvent index of the first event
+	\param endEvent index after the last event
+	\param firstADC index of the first ADC event in the event range
+	\param accummPhase accumulated rf phase before the first event
+*/
+void BMCSim::SimulateEventsBatched(SimulationWorker &worker, Eigen::Ref<Eigen::MatrixXd> Mout, Eigen::Ref<Eigen::VectorXd> Mnorm, unsigned int numActiveLanes, unsigned int firstEvent, unsigned int endEvent, unsigned int firstADC, float accummPhase)
+{
+	BatchedBlochMcConnellSolver &solver = *worker.batchedSolver;
+	BatchedBlochMcConnellSolver::BatchMatrix M = sp->GetInitialMagnetizationVector()->rowwise().replicate(solver.GetNumberOfLanes());
+	unsigned int currentADC = firstADC;
+	for (unsigned int nEvent = firstEvent; nEvent < endEvent; nEvent++)
+	{
+		const SimulationEvent &event = events[nEvent];
+		STATS_TIMER_START(eventStart);
+		switch (event.kind)
+		{
+		case ADC_EVENT:
+			this->StoreMagnetization(Mout, Mnorm, currentADC, M.leftCols(numActiveLanes).rowwise().sum());
+			if (numRequiredADCs <= ++currentADC) {
+				STATS_TIMER_STOP(worker.stats, ADC_EVENT, eventStart);
+				return;
+			}
+			if (sp->GetUseInitMagnetization()) {
+				M = sp->GetInitialMagnetizationVector()->rowwise().replicate(solver.GetNumberOfLanes());
+			}
+			break;
+		case SPOILER_EVENT:
+			// delay for block duration
+			solver.UpdateBlochMatrix(0, 0, 0);
+			solver.SolveBlochEquation(M, event.duration);
+			// kill transverse magnetization
+			M.topRows((sp->GetNumberOfCESTPools() + 1) * 2).setZero();
+			break;
+		case RF_EVENT:
+		{
+			const PulseEvent &pulse = *pulseLibrary[event.pulseIdx];
+			// delay before pulse?
+			if (pulse.deadTime > 0) {
+				solver.UpdateBlochMatrix(0, 0, 0);
+				solver.SolveBlochEquation(M, pulse.deadTime);
+			}
+			// loop trough pulse samples
+			double rfFrequency = event.freqOffset;
+			STATS_ADD(worker.stats, rfSamples, pulse.samples.size());
+			for (unsigned int p = 0; p < pulse.samples.size(); p++) {
+				solver.UpdateBlochMatrix(pulse.samples[p].magnitude*event.amplitude, rfFrequency, -pulse.samples[p].phase + event.phaseOffset - accummPhase);
+				solver.SolveBlochEquation(M, pulse.samples[p].timestep);
 			}
-			else { // delay or single gradient -> simulated as delay
-				float timestep = float(seqBlock->GetDuration())*1e-6;
-				solver->UpdateBlochMatrix(*sp, 0, 0, 0);
-				solver->SolveBlochEquation(M, timestep);
+			// delay at end of the pulse?
+			if (pulse.ringdownTime > 0) {
+				solver.UpdateBlochMatrix(0, 0, 0);
+				solver.SolveBlochEquation(M, pulse.ringdownTime);
 			}
-			delete seqBlock; // pointer gets allocated with new in the GetBlock() function
+			accummPhase += event.phaseIncrement;
+			break;
 		}
+		case DELAY_EVENT: // delay or single gradient -> simulated as delay
+			solver.UpdateBlochMatrix(0, 0, 0);
+			solver.SolveBlochEquation(M, event.duration);
+			break;
+		}
+		STATS_TIMER_STOP(worker.stats, event.kind, eventStart);
 	}
-	return status;
 }
 
+
+//! Simulate consecutive rf events with pre-composed block propagators
+/*!
+	Each rf event and the delay after it are simulated with a single propagator.
+	Consecutive blocks with the same pulse, amplitude, frequency, delay and phase are applied at once.
+	\param worker simulation worker with the solver that is used
+	\param M magnetization vector
+	\param nEvent index of the first rf event
+	\param endEvent index after the last event that can be simulated
+	\param accummPhase accumulated phase of the rf pulses
+	\return index of the last simulated event
+*/
+unsigned int BMCSim::RunBlockPropagation(SimulationWorker &worker, Eigen::VectorXd &M, unsigned int nEvent, unsigned int endEvent, float &accummPhase)
+{
+	unsigned int count = 0;
+	unsigned int blockIdx = 0;
+	double blockPhase = 0.0;
+	BlockPropagatorID blockID;
+	unsigned int nNext = nEvent;
+	while (nNext < endEvent && events[nNext].kind == RF_EVENT) {
+		const SimulationEvent &rf = events[nNext];
+		// a delay after the pulse is part of the block
+		double delay = 0;
+		unsigned int numEvents = 1;
+		if (nNext + 1 < endEvent && events[nNext + 1].kind == DELAY_EVENT) {
+			delay = events[nNext + 1].duration;
+			numEvents = 2;
+		}
+		BlockPropagatorID id = std::make_tuple(rf.pulseIdx, rf.amplitude, rf.freqOffset, delay);
+		double phase = double(rf.phaseOffset) - double(accummPhase);
+		if (count > 0 && (id != blockID || phase != blockPhase)) {
+			break;
+		}
+		if (count == 0) {
+			blockID = id;
+			blockPhase = phase;
+			blockIdx = this->GetBlockPropagator(worker, id);
+		}
+		count++;
+		accummPhase += rf.phaseIncrement;
+		nNext += numEvents;
+	}
+	worker.solver->ApplyBlockPropagator(M, blockIdx, blockPhase, count);
+	return nNext - 1;
+}
+
+
+//! Get the solver index of a block propagator
+/*!
+	The block propagator is composed if it does not exist yet
+	\param worker simulation worker with the solver that is used
+	\param id id of the block propagator
+	\return solver index of the block propagator
+*/
+unsigned int BMCSim::GetBlockPropagator(SimulationWorker &worker, BlockPropagatorID id)
+{
+	std::map<BlockPropagatorID, unsigned int>::iterator it = worker.blockPropagators.find(id);
+	if (it != worker.blockPropagators.end()) {
+		STATS_ADD(worker.stats, blockPropagatorHits, 1);
+		return it->second;
+	}
+	STATS_ADD(worker.stats, blockPropagatorMisses, 1);
+	BlochMcConnellSolverBase &solver = *worker.solver;
+	SimulationParameters &simPars = *worker.currentParams;
+	const PulseEvent &pulse = *pulseLibrary[std::get<0>(id)];
+	float amplitude = std::get<1>(id);
+	double rfFrequency = std::get<2>(id);
+	double delay = std::get<3>(id);
+	solver.BeginBlockPropagator();
+	// delay before pulse?
+	if (pulse.deadTime > 0) {
+		solver.UpdateBlochMatrix(simPars, 0, 0, 0);
+		solver.ComposeBlochEquation(pulse.deadTime);
+	}
+	// pulse samples, the phase offset of the block is considered in ApplyBlockPropagator
+	for (unsigned int p = 0; p < pulse.samples.size(); p++) {
+		solver.UpdateBlochMatrix(simPars, pulse.samples[p].magnitude*amplitude, rfFrequency, -pulse.samples[p].phase);
+		solver.ComposeBlochEquation(pulse.samples[p].timestep);
+	}
+	// delay at end of the pulse?
+	if (pulse.ringdownTime > 0) {
+		solver.UpdateBlochMatrix(simPars, 0, 0, 0);
+		solver.ComposeBlochEquation(pulse.ringdownTime);
+	}
+	// delay after the block
+	if (delay > 0) {
+		solver.UpdateBlochMatrix(simPars, 0, 0, 0);
+		solver.ComposeBlochEquation(delay);
+	}
+	unsigned int blockIdx = solver.EndBlockPropagator();
+	worker.blockPropagators.insert(std::make_pair(id, blockIdx));
+	return blockIdx;
+}
\ No newline at end of file
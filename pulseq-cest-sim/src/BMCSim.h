@@ -21,22 +21,38 @@ WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
 
 #include "SimulationParameters.h"
 #include "BlochMcConnellSolver.h"
-
-//! A single pulse sample for simulation
-struct PulseSample
+#include "BatchedBlochMcConnellSolver.h"
+#include "ArrowheadBlochMcConnellSolver.h"
+#include "ThreadPool.h"
+#include "PulseLibrary.h"
+#include "SequenceCache.h"
+#include "ParameterSweep.h"
+#include "DictionaryFile.h"
+#include <climits>
+
+#ifndef MAX_FIXED_SIZE_CEST_POOLS
+#define MAX_FIXED_SIZE_CEST_POOLS 8 // max number of CEST pools with a fixed-size solver, lower values reduce code size and compile time
+#endif
+
+//! Kind of a simulation event
+enum SimulationEventKind
 {
-	double magnitude;  /*!< pulse sample amplitude [Hz]*/
-	double phase;      /*!< pulse sample phase [rad]*/
-	double timestep;   /*!< pulse sample duration [rad]*/
+	ADC_EVENT,
+	SPOILER_EVENT,
+	RF_EVENT,
+	DELAY_EVENT
 };
 
-//! Pulse Event sctruct that contains the parameters important for simulation
-struct PulseEvent
+//! Simulation event struct that contains the decoded info of a single sequence block
+struct SimulationEvent
 {
-	double length;                     /*!< pulse duration [us]*/
-	double deadTime;                   /*!< pulse dead time [s]*/
-	double ringdownTime;               /*!< pulse ringdownTime time [s]*/
-	std::vector<PulseSample> samples;  /*!< vector with all pulse amplitude, phase and time samples*/
+	SimulationEventKind kind; /*!< kind of the event */
+	double duration;          /*!< duration of delay and spoiler events [s] */
+	unsigned int pulseIdx;    /*!< index of the pulse in the pulse library (rf events only) */
+	float amplitude;          /*!< rf amplitude [Hz] */
+	float freqOffset;         /*!< rf frequency offset [Hz] */
+	float phaseOffset;        /*!< rf phase offset [rad] */
+	double phaseIncrement;    /*!< phase that accumulates during the rf event [rad] */
 };
 
 //!  BMCSim class. 
@@ -50,6 +66,20 @@ public:
 	// typedef for pulse id with amplitude, phase and time id
 	typedef std::tuple<int, int, int> PulseID;
 
+	// typedef for block propagator id with pulse index, rf amplitude, rf frequency and the duration of the following delay
+	typedef std::tuple<unsigned int, float, float, double> BlockPropagatorID;
+
+	//! Solvers and block propagators of a single simulation thread
+	struct SimulationWorker
+	{
+		std::unique_ptr<BlochMcConnellSolverBase> solver;               /*!< Templated Bloch McConnell solver */
+		std::map<BlockPropagatorID, unsigned int> blockPropagators;      /*!< solver indices of the composed rf blocks */
+		SimulationParameters* currentParams;                             /*!< parameters the solver is currently set to */
+		std::unique_ptr<BatchedBlochMcConnellSolver> batchedSolver;     /*!< solver for batches of isochromats, created on first use */
+		int currentBatch;                                                /*!< batch the batched solver is currently set to, -1 if none */
+		SimulationStats stats;                                           /*!< event timers of the thread, only filled with PULSEQCEST_STATS */
+	};
+
 	//! Constructor
 	BMCSim(SimulationParameters &simPars);
 
@@ -59,8 +89,14 @@ public:
 	//! Load external Pulseq sequence
 	bool LoadExternalSequence(std::string path);
 
+	//! Write the compiled sequence to a cache file
+	bool WriteSequenceCache(const std::string &cachePath, const std::string &seqPath);
+
+	//! Load the compiled sequence from a cache file
+	bool ReadSequenceCache(const std::string &cachePath, const std::string &seqPath);
+
 	//! Get unique pulse
-	PulseEvent* GetUniquePulse(PulseID id);
+	const PulseEvent* GetUniquePulse(PulseID id);
 
 	//! Set simulations parameters object
 	bool SetSimulationParameters(SimulationParameters &simPars);
@@ -74,29 +110,98 @@ public:
 	//! Get a copy of the magnetization vector object
 	Eigen::MatrixXd GetCopyOfMagnetizationVectors();
 
+	//! Get number of ADC events in the sequence
+	unsigned int GetNumberOfADCEvents();
+
+	//! Get number of returned ADC events
+	unsigned int GetNumberOfOutputADCs();
+
+	//! Set an external buffer for the magnetization vectors
+	void SetOutputBuffer(double* buffer);
+
 	//! Run Simulation
 	bool RunSimulation();
 
+	//! Run the simulation for the entries of a parameter sweep
+	bool RunSweep(ParameterSweep &sweep, double* output, unsigned int firstEntry = 0, unsigned int numEntries = UINT_MAX);
+
+	//! Run the simulation for the remaining chunks of a dictionary file
+	bool RunSweep(ParameterSweep &sweep, DictionaryFile &dictionary);
+
+	//! Get the counters and timers of all simulations since the last reset
+	SimulationStats GetStats();
+
+	//! Reset the counters and timers
+	void ResetStats();
+
 
 private:
 
 	ExternalSequence seq; /*!< External Pulseq sequence */
 	bool sequenceLoaded; /*!< true if sequence was succesfully loaded */
-	std::map<PulseID, PulseEvent>  uniquePulses; /*!< vector with unique pulse sample */
+	std::map<PulseID, unsigned int>  uniquePulses; /*!< pulse library index of the unique pulses */
+	std::vector<std::shared_ptr<const PulseEvent> > pulseLibrary; /*!< unique pulses of the sequence, shared with other simulations via PulseLibrary */
+	std::vector<PulseLibrary::PulseKey> pulseKeys;                /*!< PulseLibrary key of each pulse in pulseLibrary */
+	std::vector<SimulationEvent> events;  /*!< compiled sequence with one event per block */
 	unsigned int numberOfADCBlocks;  /*!< number of ADC blocks in external seq file */
+	std::vector<unsigned int> segmentStartBlocks; /*!< index of the first event after each ADC (starts with 0) */
+	std::vector<float> segmentStartPhases;        /*!< accumulated rf phase at the start of each ADC segment */
 
 	SimulationParameters* sp; /*!< Pointer to SimulationParameters object */
 
-	std::unique_ptr<BlochMcConnellSolverBase> solver; /*!< Templated Bloch McConnell solver  */
+	std::vector<SimulationWorker> workers; /*!< solvers of all simulation threads, the first one is used for serial simulations */
 
 	Eigen::MatrixXd Mvec;  /*!< Matrix containing all magnetization vectors */
+	double* outputBuffer;  /*!< external memory for the magnetization vectors, NULL to use Mvec */
+	std::vector<Eigen::MatrixXd> groupMvec; /*!< summed magnetization vectors of the isochromat groups, kept between runs */
+	Eigen::MatrixXd normMvec;               /*!< magnetization at the normalization ADC event of each isochromat group */
+	std::vector<int> outputColumns;         /*!< output column of each ADC event, -1 if the ADC event is not returned */
+	int normalizationADC;                   /*!< ADC event the output gets divided by, -1 for none */
+	unsigned int numRequiredADCs;           /*!< the simulation stops after this number of ADC events */
 
 	//! Init solver
 	void InitSolver();
 
+	//! Create a new solver for the current number of pools
+	std::unique_ptr<BlochMcConnellSolverBase> CreateSolver();
+
+	//! Get the B0 inhomogeneity of an isochromat
+	double GetIsochromatB0Inhomogeneity(unsigned int isochromatIdx);
+
 	//! Decode the pulses in the sequence
 	void DecodeSeqRFInfo();
 
-	//! Decode the adc in the sequence
-	bool DecodeSeqADCInfo();
+	//! Merge adjacent pulse samples to piecewise-constant segments with a bounded error
+	void CompressPulseSamples(PulseEvent &pulse, const std::vector<float> &amplitudes, const std::vector<float> &phases, double maxAmplitude);
+
+	//! Compile the sequence blocks to simulation events
+	bool CompileSimulationEvents();
+
+	//! Fill the settings of a sequence cache header
+	void InitSequenceCacheHeader(SequenceCacheHeader &header);
+
+	//! Set the parameters of a simulation worker
+	void SetWorkerParameters(SimulationWorker &worker, SimulationParameters &simPars);
+
+	//! Set the lane parameters of the batched solver of a simulation worker
+	void SetWorkerBatch(SimulationWorker &worker, std::vector<SimulationParameters*> &laneParams, unsigned int batchIdx, unsigned int numLanes);
+
+	//! Set up the output columns from the output ADCs of the simulation parameters
+	bool SetupOutput();
+
+	//! Store the selected components of the magnetization at an ADC event
+	template<typename VectorType>
+	void StoreMagnetization(Eigen::Ref<Eigen::MatrixXd> &Mout, Eigen::Ref<Eigen::VectorXd> &Mnorm, unsigned int adc, const VectorType &M);
+
+	//! Simulate a range of simulation events
+	void SimulateEvents(SimulationWorker &worker, Eigen::Ref<Eigen::MatrixXd> Mout, Eigen::Ref<Eigen::VectorXd> Mnorm, Eigen::VectorXd &M, unsigned int firstEvent, unsigned int endEvent, unsigned int firstADC, float accummPhase);
+
+	//! Simulate a range of simulation events for a batch of parameter sets
+	void SimulateEventsBatched(SimulationWorker &worker, Eigen::Ref<Eigen::MatrixXd> Mout, Eigen::Ref<Eigen::VectorXd> Mnorm, unsigned int numActiveLanes, unsigned int firstEvent, unsigned int endEvent, unsigned int firstADC, float accummPhase);
+
+	//! Simulate consecutive rf events with pre-composed block propagators
+	unsigned int RunBlockPropagation(SimulationWorker &worker, Eigen::VectorXd &M, unsigned int nEvent, unsigned int endEvent, float &accummPhase);
+
+	//! Get the solver index of a block propagator, compose it if it does not exist yet
+	unsigned int GetBlockPropagator(SimulationWorker &worker, BlockPropagatorID id);
 };
\ No newline at end of file
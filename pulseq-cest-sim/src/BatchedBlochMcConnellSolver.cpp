@@ -0,0 +1,379 @@
+//!  BatchedBlochMcConnellSolver.cpp
+/*!
+Class to solve the Bloch-McConnell equations for multiple parameter sets in lock-step
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "BatchedBlochMcConnellSolver.h"
+#include <algorithm>
+
+// the lane kernels are compiled for multiple instruction sets, the best one is selected at runtime
+#if defined(__linux__) && defined(__x86_64__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define BATCH_TARGET_CLONES __attribute__((target_clones("arch=skylake-avx512", "arch=haswell", "default")))
+#endif
+#endif
+#ifndef BATCH_TARGET_CLONES
+#define BATCH_TARGET_CLONES
+#endif
+
+
+//! out = A * B for all lanes
+BATCH_TARGET_CLONES static void BatchedMatMul(unsigned int n, unsigned int K, const double* __restrict A, const double* __restrict B, double* __restrict out)
+{
+	for (unsigned int i = 0; i < n; i++) {
+		for (unsigned int j = 0; j < n; j++) {
+			for (unsigned int kb = 0; kb < K; kb += BATCH_LANE_BLOCK) {
+				double acc[BATCH_LANE_BLOCK] = { 0.0 };
+				for (unsigned int l = 0; l < n; l++) {
+					const double* a = A + (i * n + l) * K + kb;
+					const double* b = B + (l * n + j) * K + kb;
+					for (unsigned int k = 0; k < BATCH_LANE_BLOCK; k++) {
+						acc[k] += a[k] * b[k];
+					}
+				}
+				std::copy(acc, acc + BATCH_LANE_BLOCK, out + (i * n + j) * K + kb);
+			}
+		}
+	}
+}
+
+//! out = F * x for all lanes
+BATCH_TARGET_CLONES static void BatchedMatVec(unsigned int n, unsigned int K, const double* __restrict F, const double* __restrict x, double* __restrict out)
+{
+	for (unsigned int i = 0; i < n; i++) {
+		for (unsigned int kb = 0; kb < K; kb += BATCH_LANE_BLOCK) {
+			double acc[BATCH_LANE_BLOCK] = { 0.0 };
+			for (unsigned int j = 0; j < n; j++) {
+				const double* f = F + (i * n + j) * K + kb;
+				const double* xj = x + j * K + kb;
+				for (unsigned int k = 0; k < BATCH_LANE_BLOCK; k++) {
+					acc[k] += f[k] * xj[k];
+				}
+			}
+			std::copy(acc, acc + BATCH_LANE_BLOCK, out + i * K + kb);
+		}
+	}
+}
+
+//! y += c * x
+BATCH_TARGET_CLONES static void BatchedAxpy(unsigned int length, double c, const double* __restrict x, double* __restrict y)
+{
+	for (unsigned int kb = 0; kb < length; kb += BATCH_LANE_BLOCK) {
+		const double* xb = x + kb;
+		double* yb = y + kb;
+		for (unsigned int k = 0; k < BATCH_LANE_BLOCK; k++) {
+			yb[k] += c * xb[k];
+		}
+	}
+}
+
+//! Solve D * X = B for all lanes, X overwrites B and D gets destroyed
+/*!
+	Gauss-Jordan elimination without pivoting. This is stable for the pade denominator,
+	since ||D - I|| < 1 for the scaled matrix and D is therefore diagonally dominant.
+*/
+BATCH_TARGET_CLONES static void BatchedSolve(unsigned int n, unsigned int K, double* __restrict D, double* __restrict B, double* __restrict factor)
+{
+	for (unsigned int p = 0; p < n; p++) {
+		// normalize pivot row
+		const double* dpp = D + (p * n + p) * K;
+		for (unsigned int k = 0; k < K; k++) {
+			factor[k] = 1.0 / dpp[k];
+		}
+		for (unsigned int j = 0; j < n; j++) {
+			double* d = D + (p * n + j) * K;
+			double* b = B + (p * n + j) * K;
+			for (unsigned int kb = 0; kb < K; kb += BATCH_LANE_BLOCK) {
+				const double* f = factor + kb;
+				double* db = d + kb;
+				double* bb = b + kb;
+				for (unsigned int k = 0; k < BATCH_LANE_BLOCK; k++) {
+					db[k] *= f[k];
+					bb[k] *= f[k];
+				}
+			}
+		}
+		// eliminate column p from all other rows
+		for (unsigned int r = 0; r < n; r++) {
+			if (r == p) {
+				continue;
+			}
+			const double* drp = D + (r * n + p) * K;
+			for (unsigned int k = 0; k < K; k++) {
+				factor[k] = drp[k];
+			}
+			for (unsigned int j = 0; j < n; j++) {
+				const double* dp = D + (p * n + j) * K;
+				const double* bp = B + (p * n + j) * K;
+				double* dr = D + (r * n + j) * K;
+				double* br = B + (r * n + j) * K;
+				for (unsigned int kb = 0; kb < K; kb += BATCH_LANE_BLOCK) {
+					const double* f = factor + kb;
+					const double* dpb = dp + kb;
+					const double* bpb = bp + kb;
+					double* drb = dr + kb;
+					double* brb = br + kb;
+					for (unsigned int k = 0; k < BATCH_LANE_BLOCK; k++) {
+						drb[k] -= f[k] * dpb[k];
+						brb[k] -= f[k] * bpb[k];
+					}
+				}
+			}
+		}
+	}
+}
+
+
+//! Constructor
+/*!
+	\param sp SimulationParamter object with the pool setup of all lanes
+	\param nLanes number of lanes, gets rounded up to a multiple of BATCH_LANE_BLOCK
+*/
+BatchedBlochMcConnellSolver::BatchedBlochMcConnellSolver(SimulationParameters &sp, unsigned int nLanes)
+{
+	n = sp.GetInitialMagnetizationVector()->rows();
+	N = sp.GetNumberOfCESTPools();
+	numLanes = std::max(1u, (nLanes + BATCH_LANE_BLOCK - 1) / BATCH_LANE_BLOCK) * BATCH_LANE_BLOCK;
+	numApprox = 6;
+	maxCacheEntries = std::max(1u, (unsigned int)(MAX_PROPAGATOR_CACHE_MB * 1024.0 * 1024.0 / (sizeof(double) * n * (n + 1) * numLanes)));
+
+	for (unsigned int k = 0; k < numLanes; k++) {
+		laneSolvers.push_back(std::unique_ptr<BlochMcConnellSolver<Eigen::Dynamic> >(new BlochMcConnellSolver<Eigen::Dynamic>(sp)));
+	}
+	laneParameters.assign(numLanes, &sp);
+
+	// workspace, the pade approximation runs on the augmented (n+1)x(n+1) system
+	unsigned int na = n + 1;
+	At.resize(na * na * numLanes);
+	X.resize(na * na * numLanes);
+	Nm.resize(na * na * numLanes);
+	D.resize(na * na * numLanes);
+	F.resize(na * na * numLanes);
+	tmp.resize(na * na * numLanes);
+	Mtmp.resize(n * numLanes);
+
+	rfAmplitude = 0.0;
+	rfFrequency = 0.0;
+	cosPhase = 1.0;
+	sinPhase = 0.0;
+}
+
+//! Destructor
+BatchedBlochMcConnellSolver::~BatchedBlochMcConnellSolver() {}
+
+//! Update the tissue and scanner infos of all lanes
+/*!
+	Lanes without parameters simulate the last parameter set again
+	\param laneParams SimulationParamter objects of the lanes
+*/
+void BatchedBlochMcConnellSolver::UpdateSimulationParameters(std::vector<SimulationParameters*> &laneParams)
+{
+	for (unsigned int k = 0; k < numLanes; k++) {
+		laneParameters[k] = laneParams[std::min<size_t>(k, laneParams.size() - 1)];
+		laneSolvers[k]->UpdateSimulationParameters(*laneParameters[k]);
+	}
+	propagatorCache.clear();
+}
+
+//! Update Matrices with pulse info
+/*!
+	The rf pulse is the same for all lanes
+	\param rfAmplitude B1 amplitude [Hz]
+	\param rfFrequency B1 frequency offset from f0 [Hz]
+	\param rfPhase B1 phase offset [rad]
+*/
+void BatchedBlochMcConnellSolver::UpdateBlochMatrix(double rfAmplitude, double rfFrequency, double rfPhase)
+{
+	this->rfAmplitude = rfAmplitude;
+	this->rfFrequency = rfFrequency;
+	cosPhase = cos(rfPhase);
+	sinPhase = sin(rfPhase);
+}
+
+//! Solve Bloch McConnell equation for all lanes
+/*!
+	\param M magnetization vectors of all lanes
+	\param t timestep for which the equation should be solved
+*/
+void BatchedBlochMcConnellSolver::SolveBlochEquation(BatchMatrix &M, double t)
+{
+	const BatchPropagator &prop = GetPropagator(t);
+	bool rotate = (rfAmplitude != 0.0 && (sinPhase != 0.0 || cosPhase != 1.0));
+	if (rotate) {
+		RotateTransverseMagnetization(M, cosPhase, -sinPhase);
+	}
+	BatchedMatVec(n, numLanes, prop.F.data(), M.data(), Mtmp.data());
+	BatchedAxpy(n * numLanes, 1.0, prop.offset.data(), Mtmp.data());
+	std::copy(Mtmp.begin(), Mtmp.end(), M.data());
+	if (rotate) {
+		RotateTransverseMagnetization(M, cosPhase, sinPhase);
+	}
+}
+
+//! Get the (cached) propagators for the current rf amplitude and frequency
+/*!
+	\param t timestep of the propagators
+	\return propagators of all lanes (phase = 0)
+*/
+const BatchedBlochMcConnellSolver::BatchPropagator& BatchedBlochMcConnellSolver::GetPropagator(double t)
+{
+	PropagatorID id = std::make_tuple(rfAmplitude, rfFrequency, t);
+	std::map<PropagatorID, BatchPropagator>::iterator it = propagatorCache.find(id);
+	if (it == propagatorCache.end()) {
+		STATS_ADD(stats, propagatorCacheMisses, 1);
+		if (propagatorCache.size() >= maxCacheEntries) {
+			propagatorCache.clear();
+		}
+		it = propagatorCache.insert(std::make_pair(id, BatchPropagator())).first;
+		CalculatePropagator(t, it->second);
+	}
+	else {
+		STATS_ADD(stats, propagatorCacheHits, 1);
+	}
+	return it->second;
+}
+
+//! Calculate the propagators of all lanes
+/*!
+	Same pade approximation of the augmented system as BlochMcConnellSolver::CalculatePropagator, but all lanes use the
+	same number of squarings, which is determined by the lane with the largest norm
+	\param t timestep for which the propagators should be calculated
+	\param prop BatchPropagator that gets filled
+*/
+void BatchedBlochMcConnellSolver::CalculatePropagator(double t, BatchPropagator &prop)
+{
+	const unsigned int K = numLanes;
+	const unsigned int na = n + 1; // size of the augmented system [A C; 0 0]
+	Eigen::MatrixXd A;
+	Eigen::VectorXd C;
+	double maxNorm = 0.0;
+	std::fill(At.begin(), At.end(), 0.0);
+	for (unsigned int k = 0; k < K; k++) {
+		laneSolvers[k]->UpdateBlochMatrix(*laneParameters[k], rfAmplitude, rfFrequency, 0.0);
+		laneSolvers[k]->GetBlochMatrix(A, C);
+		double rowNorm = 0.0;
+		for (unsigned int i = 0; i < n; i++) {
+			for (unsigned int j = 0; j < n; j++) {
+				At[(i * na + j) * K + k] = A(i, j) * t;
+			}
+			At[(i * na + n) * K + k] = C(i) * t;
+			rowNorm = std::max(rowNorm, (A.row(i).lpNorm<1>() + std::abs(C(i))) * t);
+		}
+		maxNorm = std::max(maxNorm, rowNorm);
+	}
+	//solve exponential with pade method
+	int infExp; //infinity exponent of the matrix
+	std::frexp(maxNorm, &infExp); // pade method is only stable if ||A||inf / 2^j <= 0.5
+	int j = std::max(0, infExp + 1);
+	STATS_ADD(stats, padeExponentials, K); // one exponential per lane
+	STATS_SQUARING_STEPS(stats, j, K);
+	double scale = 1.0 / (pow(2, j));
+	for (unsigned int i = 0; i < At.size(); i++) {
+		At[i] *= scale;
+	}
+	// start in the second round of the approximation, see BlochMcConnellSolver::CalculatePropagator
+	X = At;
+	double c = 0.5;
+	std::fill(Nm.begin(), Nm.end(), 0.0);
+	for (unsigned int i = 0; i < na; i++) {
+		std::fill(Nm.begin() + (i * na + i) * K, Nm.begin() + (i * na + i + 1) * K, 1.0);
+	}
+	D = Nm;
+	BatchedAxpy(na * na * K, c, At.data(), Nm.data());
+	BatchedAxpy(na * na * K, -c, At.data(), D.data());
+	bool p = true;
+	double q = numApprox;
+	for (int k = 2; k <= q; k++)
+	{
+		c *= (q - k + 1) / (k*(2 * q - k + 1));
+		BatchedMatMul(na, K, At.data(), X.data(), tmp.data());
+		X.swap(tmp);
+		BatchedAxpy(na * na * K, c, X.data(), Nm.data());
+		BatchedAxpy(na * na * K, p ? c : -c, X.data(), D.data());
+		p = !p;
+	}
+	BatchedSolve(na, K, D.data(), Nm.data(), Mtmp.data()); // Nm = D^-1 * N
+	F.swap(Nm);
+	for (int k = 1; k <= j; k++)
+	{
+		BatchedMatMul(na, K, F.data(), F.data(), tmp.data());
+		F.swap(tmp);
+	}
+	// exp([A C; 0 0]*t) = [exp(A*t) (exp(A*t) - I) * A^-1 * C; 0 1]
+	prop.F.resize(n * n * K);
+	prop.offset.resize(n * K);
+	for (unsigned int i = 0; i < n; i++) {
+		std::copy(F.begin() + i * na * K, F.begin() + (i * na + n) * K, prop.F.begin() + i * n * K);
+		std::copy(F.begin() + (i * na + n) * K, F.begin() + (i * na + n + 1) * K, prop.offset.begin() + i * K);
+	}
+}
+
+//! Rotate the transverse magnetization of all pools and lanes around z
+/*!
+	\param M magnetization vectors of all lanes
+	\param cosAngle cosine of the rotation angle
+	\param sinAngle sine of the rotation angle
+*/
+void BatchedBlochMcConnellSolver::RotateTransverseMagnetization(BatchMatrix &M, double cosAngle, double sinAngle)
+{
+	for (unsigned int i = 0; i <= N; i++) {
+		for (unsigned int k = 0; k < numLanes; k++) {
+			double mx = M(i, k);
+			double my = M(i + N + 1, k);
+			M(i, k) = cosAngle * mx - sinAngle * my;
+			M(i + N + 1, k) = sinAngle * mx + cosAngle * my;
+		}
+	}
+}
+
+//! Set number of steps for pade approximation
+/*!
+	\param nApprox Number of approximations (default = 6)
+*/
+void BatchedBlochMcConnellSolver::SetNumStepsForPadeApprox(unsigned int nApprox)
+{
+	numApprox = nApprox;
+	propagatorCache.clear();
+}
+
+//! Get the number of lanes
+/*!	\return number of lanes that are simulated together */
+unsigned int BatchedBlochMcConnellSolver::GetNumberOfLanes()
+{
+	return numLanes;
+}
+
+//! Get the instruction set that is used for the lanes
+/*!	\return name of the instruction set */
+const char* BatchedBlochMcConnellSolver::GetInstructionSet()
+{
+#if defined(__linux__) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return "avx512";
+	if (__builtin_cpu_supports("avx2"))
+		return "avx2";
+#endif
+	return "default";
+}
+
+//! Get the counters of the solver
+/*!	\return pointer to the counters, only filled with PULSEQCEST_STATS */
+SimulationStats* BatchedBlochMcConnellSolver::GetStats()
+{
+	return &stats;
+}
@@ -0,0 +1,107 @@
+//!  BatchedBlochMcConnellSolver.h
+/*!
+Class to solve the Bloch-McConnell equations for multiple parameter sets in lock-step
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "BlochMcConnellSolver.h"
+#include <memory>
+
+#define BATCH_LANE_BLOCK 8 // number of lanes processed together in the inner loops, the number of lanes is a multiple of this
+
+// !BatchedBlochMcConnellSolver class.
+/*!
+  Solves the Bloch-McConnell equations for multiple parameter sets (lanes) that see the same rf events,
+  e.g. isochromats with different B0 inhomogeneities.
+  All matrices are stored in structure-of-arrays layout: element (i,j) of lane k is at index (i*n+j)*numLanes+k.
+  The pade approximation and the squaring run for all lanes at once, the innermost loops are over the lanes
+  and get vectorized with the best instruction set of the cpu (selected at runtime).
+*/
+class BatchedBlochMcConnellSolver
+{
+public:
+	// typedef for the magnetization vectors of all lanes (rows: magnetization entries, columns: lanes)
+	typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> BatchMatrix;
+
+	// typedef for propagator id with rf amplitude, rf frequency and duration
+	typedef std::tuple<double, double, double> PropagatorID;
+
+	//! Propagators M(t) = F * M(0) + offset of all lanes
+	struct BatchPropagator
+	{
+		std::vector<double> F;      /*!< matrix exponentials exp(A*t) */
+		std::vector<double> offset; /*!< affine terms (F - I) * A^-1 * C */
+	};
+
+	//! Constructor
+	BatchedBlochMcConnellSolver(SimulationParameters &sp, unsigned int nLanes);
+
+	//! Destructor
+	~BatchedBlochMcConnellSolver();
+
+	//! Update the tissue and scanner infos of all lanes
+	void UpdateSimulationParameters(std::vector<SimulationParameters*> &laneParams);
+
+	//! Update Matrices with pulse info
+	void UpdateBlochMatrix(double rfAmplitude, double rfFrequency, double rfPhase);
+
+	//! Solve Bloch McConnell equation for all lanes
+	void SolveBlochEquation(BatchMatrix &M, double t);
+
+	//! Set number of steps for pade approximation
+	void SetNumStepsForPadeApprox(unsigned int nApprox);
+
+	//! Get the number of lanes
+	unsigned int GetNumberOfLanes();
+
+	//! Get the instruction set that is used for the lanes
+	static const char* GetInstructionSet();
+
+	//! Get the counters of the solver
+	SimulationStats* GetStats();
+
+private:
+	unsigned int n;           /*!< size of the Bloch matrix */
+	unsigned int numLanes;    /*!< number of lanes, multiple of BATCH_LANE_BLOCK */
+	unsigned int N;           /*!< Number of CEST pools */
+	unsigned int numApprox;   /*!< number of steps for pade approximation */
+
+	std::vector<std::unique_ptr<BlochMcConnellSolver<Eigen::Dynamic> > > laneSolvers; /*!< solvers that set up the Bloch matrix of each lane */
+	std::vector<SimulationParameters*> laneParameters; /*!< parameters of each lane */
+
+	double rfAmplitude;       /*!< current B1 amplitude [Hz] */
+	double rfFrequency;       /*!< current B1 frequency offset [Hz] */
+	double cosPhase;          /*!< cosine of the current B1 phase */
+	double sinPhase;          /*!< sine of the current B1 phase */
+
+	std::map<PropagatorID, BatchPropagator> propagatorCache; /*!< propagators of all rf amplitude, frequency and time combinations */
+	unsigned int maxCacheEntries;                             /*!< cache gets cleared if this number of propagators is reached */
+
+	std::vector<double> At, X, Nm, D, F, tmp, Mtmp; /*!< workspace of the pade approximation */
+
+	SimulationStats stats; /*!< counters of the solver, only filled with PULSEQCEST_STATS */
+
+	//! Get the (cached) propagators for the current rf amplitude and frequency
+	const BatchPropagator& GetPropagator(double t);
+
+	//! Calculate the propagators of all lanes
+	void CalculatePropagator(double t, BatchPropagator &prop);
+
+	//! Rotate the transverse magnetization of all pools and lanes around z
+	void RotateTransverseMagnetization(BatchMatrix &M, double cosAngle, double sinAngle);
+};
@@ -20,6 +20,13 @@ WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
 #pragma once
 
 #include "SimulationParameters.h"
+#include "SimulationStats.h"
+#include <map>
+#include <tuple>
+#include <vector>
+
+#define MAX_PROPAGATOR_CACHE_MB 128 // upper limit for the memory used by the propagator cache
+#define MAX_EIGENVECTOR_CONDITION 1e3 // eigendecompositions with worse conditioned eigenvectors fall back to the pade approximation
 
 // !BlochMcConnellSolverBase class.
 /*!
@@ -30,7 +37,7 @@ class BlochMcConnellSolverBase
 public:
 
 	BlochMcConnellSolverBase() {}
-	~BlochMcConnellSolverBase() {}
+	virtual ~BlochMcConnellSolverBase() {}
 
 	// Vitual Update function that can be called from base class pointer
 	virtual void UpdateSimulationParameters(SimulationParameters &sp) {};
@@ -44,20 +51,79 @@ public:
 	//! Set number of steps for pade approximation 
 	virtual void SetNumStepsForPadeApprox(unsigned int nApprox) {};
 
+	//! Start a new block propagator
+	virtual void BeginBlockPropagator() {};
+
+	//! Add the current Bloch matrix for duration t to the block propagator
+	virtual void ComposeBlochEquation(double t) {};
+
+	//! Store the block propagator and return its index
+	virtual unsigned int EndBlockPropagator() { return 0; };
+
+	//! Apply a stored block propagator multiple times
+	virtual void ApplyBlockPropagator(Eigen::VectorXd &M, unsigned int blockIdx, double rfPhase, unsigned int count) {};
 
+	//! Get the counters of the solver
+	SimulationStats* GetStats() { return &stats; }
 
+protected:
+	SimulationStats stats; /*!< counters of the solver, only filled with PULSEQCEST_STATS */
 };
 
 
 // !BlochMcConnellSolver class.
 /*!
   Template class that handles all the Bloch-McConnell equation stuff 
+  The propagators are cached, so that repeated pulse samples and delays only cost a matrix-vector product
+  If the same Bloch matrix is needed for different durations (e.g. delays, cw pulses), it gets diagonalized once
+  and the propagators of all durations are calculated from the exponentials of its eigenvalues
 */
 template <int size> class BlochMcConnellSolver : public BlochMcConnellSolverBase
 {
 public:
 	typedef Eigen::Matrix<double, size, 1> VectorNd; // typedef for Magnetization Vector
 	typedef Eigen::Matrix<double, size, size> MatrixNd; // typedef for Bloch Matrix
+	typedef Eigen::Matrix<double, size == Eigen::Dynamic ? Eigen::Dynamic : size + 1, size == Eigen::Dynamic ? Eigen::Dynamic : size + 1> AugmentedMatrixNd; // typedef for augmented Bloch Matrix [A C; 0 0]
+
+	// typedef for propagator id with rf amplitude, rf frequency and duration
+	typedef std::tuple<double, double, double> PropagatorID;
+
+	//! Propagator M(t) = F * M(0) + offset for a constant Bloch matrix
+	struct Propagator
+	{
+		MatrixNd F;       /*!< matrix exponential exp(A*t) */
+		VectorNd offset;  /*!< affine term (F - I) * A^-1 * C */
+	};
+
+	// typedef for the propagator cache
+	typedef std::map<PropagatorID, Propagator, std::less<PropagatorID>, Eigen::aligned_allocator<std::pair<const PropagatorID, Propagator> > > PropagatorCache;
+
+	// typedef for Bloch matrix id with rf amplitude and rf frequency
+	typedef std::pair<double, double> BlochMatrixID;
+
+	//! Eigendecomposition A = V * diag(lambda) * V^-1 of a Bloch matrix
+	struct EigenDecomposition
+	{
+		Eigen::Matrix<std::complex<double>, size, size> V;    /*!< eigenvectors */
+		Eigen::Matrix<std::complex<double>, size, size> VInv; /*!< inverse of the eigenvectors */
+		Eigen::Matrix<std::complex<double>, size, 1> lambda;  /*!< eigenvalues */
+		VectorNd AInvC;   /*!< A^-1 * C */
+		bool valid;       /*!< false if the decomposition failed or is ill-conditioned */
+	};
+
+	// typedef for the eigendecomposition cache
+	typedef std::map<BlochMatrixID, EigenDecomposition, std::less<BlochMatrixID>, Eigen::aligned_allocator<std::pair<const BlochMatrixID, EigenDecomposition> > > EigenDecompositionCache;
+
+	//! Preallocated matrices for the propagator calculation and propagation, so that dynamic sizes do not allocate memory per step
+	struct Workspace
+	{
+		AugmentedMatrixNd At, X, Nm, D, F, tmp;     /*!< pade approximation of the augmented Bloch matrix */
+		Eigen::PartialPivLU<AugmentedMatrixNd> lu;  /*!< LU decomposition of the pade denominator */
+		Eigen::Matrix<std::complex<double>, size, 1> expLambdaT;         /*!< exponentials of the eigenvalues */
+		Eigen::Matrix<std::complex<double>, size, size> VExp, VExpVInv; /*!< V * diag(exp(lambda*t)) and V * diag(exp(lambda*t)) * V^-1 */
+		MatrixNd blockF, blockFb, blockTmp;         /*!< composition and binary exponentiation of block propagators */
+		VectorNd M, blockOffset, blockOffsetb;      /*!< propagated vector and offsets of the block propagators */
+	};
 
 	//! Constructor
 	BlochMcConnellSolver(SimulationParameters &sp);
@@ -77,15 +143,65 @@ public:
 	//! Set number of steps for pade approximation 
 	void SetNumStepsForPadeApprox(unsigned int nApprox);
 
+	//! Start a new block propagator
+	void BeginBlockPropagator();
+
+	//! Add the current Bloch matrix for duration t to the block propagator
+	void ComposeBlochEquation(double t);
+
+	//! Store the block propagator and return its index
+	unsigned int EndBlockPropagator();
+
+	//! Apply a stored block propagator multiple times
+	void ApplyBlockPropagator(Eigen::VectorXd &M, unsigned int blockIdx, double rfPhase, unsigned int count);
 
-private:
-	Eigen::Matrix<double, size, size> A;               /*!< Matrix containing pool and pulse paramters   */
+	//! Get the Bloch matrix for the current rf amplitude and frequency
+	void GetBlochMatrix(Eigen::MatrixXd &blochMatrix, Eigen::VectorXd &relaxationVector);
+
+protected:
+	Eigen::Matrix<double, size, size> A;               /*!< Matrix containing pool and pulse paramters (pulse phase = 0) */
 	Eigen::Matrix<double, size, 1> C;               /*!< Vector containing pool relaxation parameters */
 	unsigned int N;           /*!< Number of CEST pools */
 	unsigned int numApprox;   /*!< number of steps for pade approximation       */
 	double w0;                /*!< scanner larmor frequency [rad]                  */
 	double dw0;               /*!< scanner inhomogeneity [rad]                  */
+	MTLineshapeTable mtLineshape; /*!< lookup table of the MT lineshape */
+
+	SimulationParameters* simParams; /*!< parameters of the last UpdateBlochMatrix call */
+	double rfAmplitude;       /*!< current B1 amplitude [Hz] */
+	double rfFrequency;       /*!< current B1 frequency offset [Hz] */
+	double cosPhase;          /*!< cosine of the current B1 phase */
+	double sinPhase;          /*!< sine of the current B1 phase */
+	bool blochMatrixOutdated; /*!< true if A does not correspond to the current rf amplitude and frequency */
+
+	PropagatorCache propagatorCache; /*!< propagators of all rf amplitude, frequency and time combinations */
+	unsigned int maxCacheEntries;    /*!< cache gets cleared if this number of propagators is reached */
+	EigenDecompositionCache eigenCache; /*!< eigendecompositions of Bloch matrices that are used for different durations */
+
+	std::vector<Propagator, Eigen::aligned_allocator<Propagator> > blockPropagators; /*!< composed propagators of entire rf blocks */
+	Propagator currentBlock;         /*!< block propagator that is currently composed */
+	Workspace workspace;             /*!< matrices that are sized once in the constructor */
+
+	//! Fill the Bloch matrix with the current rf amplitude and frequency
+	void SetupBlochMatrix();
+
+	//! Get the (cached) propagator for the current Bloch matrix
+	const Propagator& GetPropagator(double t);
+
+	//! Calculate the propagator for the current Bloch matrix
+	virtual void CalculatePropagator(double t, Propagator &prop);
 
+	//! Calculate the propagator from the eigendecomposition of the current Bloch matrix
+	bool CalculateEigenPropagator(double t, Propagator &prop);
+
+	//! Diagonalize the current Bloch matrix
+	void DecomposeBlochMatrix(EigenDecomposition &decomp);
+
+	//! Rotate the transverse magnetization of all pools around z
+	template<typename Derived> void RotateTransverseMagnetization(Eigen::MatrixBase<Derived> &M, double cosAngle, double sinAngle);
+
+	//! Calculate v = F * v + offset without temporaries
+	template<typename Derived> void PropagateVector(const MatrixNd &F, const VectorNd &offset, Eigen::MatrixBase<Derived> &v);
 };
 
 
@@ -110,6 +226,36 @@ template<int size> BlochMcConnellSolver<size>::BlochMcConnellSolver(SimulationPa
 	// set steps for pade approximation
 	numApprox = 6;
 
+	// limit the memory of the propagator cache
+	unsigned int n = sp.GetInitialMagnetizationVector()->rows();
+	maxCacheEntries = std::max(1u, (unsigned int)(MAX_PROPAGATOR_CACHE_MB * 1024.0 * 1024.0 / (sizeof(double) * n * (n + 1))));
+
+	simParams = &sp;
+	rfAmplitude = 0.0;
+	rfFrequency = 0.0;
+	cosPhase = 1.0;
+	sinPhase = 0.0;
+
+	// size the workspace once, fixed sizes are already allocated
+	workspace.At.resize(n + 1, n + 1);
+	workspace.X.resize(n + 1, n + 1);
+	workspace.Nm.resize(n + 1, n + 1);
+	workspace.D.resize(n + 1, n + 1);
+	workspace.F.resize(n + 1, n + 1);
+	workspace.tmp.resize(n + 1, n + 1);
+	workspace.lu = Eigen::PartialPivLU<AugmentedMatrixNd>(n + 1);
+	workspace.expLambdaT.resize(n);
+	workspace.VExp.resize(n, n);
+	workspace.VExpVInv.resize(n, n);
+	workspace.blockF.resize(n, n);
+	workspace.blockFb.resize(n, n);
+	workspace.blockTmp.resize(n, n);
+	workspace.M.resize(n);
+	workspace.blockOffset.resize(n);
+	workspace.blockOffsetb.resize(n);
+	currentBlock.F.resize(n, n);
+	currentBlock.offset.resize(n);
+
 	this->UpdateSimulationParameters(sp);
 }
 
@@ -190,10 +336,25 @@ template<int size> void BlochMcConnellSolver<size>::UpdateSimulationParameters(S
 	// set inhomogeneity
 	w0 = sp.GetScannerB0()*sp.GetScannerGamma();
 	dw0 = w0 * sp.GetScannerB0Inhom();
+
+	// tabulate the MT lineshape, it only gets rebuilt if R2, shift or larmor frequency changed
+	if (sp.IsMTActive()) {
+		mtLineshape.Init(*sp.GetMTPool(), w0);
+	}
+
+	// cached propagators are invalid now
+	simParams = &sp;
+	propagatorCache.clear();
+	eigenCache.clear();
+	blockPropagators.clear();
+	blochMatrixOutdated = true;
 }
 
 //! Update Matrix with pulse info 
 /*!
+	The matrix itself is only filled if the propagator is not in the cache yet.
+	The pulse phase is not part of the matrix. It is considered as a rotation around z
+	in SolveBlochEquation, so that pulse samples with different phases share a propagator.
 	\param sp SimulationParamter object containing pool informations
 	\param rfAmplitude B1 amplitude [Hz]
 	\param rfFrequency B1 frequency offset from f0 [Hz]
@@ -201,29 +362,35 @@ template<int size> void BlochMcConnellSolver<size>::UpdateSimulationParameters(S
 */
 template<int size> void BlochMcConnellSolver<size>::UpdateBlochMatrix(SimulationParameters &sp, double rfAmplitude, double rfFrequency, double rfPhase)
 {
+	if (simParams != &sp || this->rfAmplitude != rfAmplitude || this->rfFrequency != rfFrequency) {
+		simParams = &sp;
+		this->rfAmplitude = rfAmplitude;
+		this->rfFrequency = rfFrequency;
+		blochMatrixOutdated = true;
+	}
+	cosPhase = cos(rfPhase);
+	sinPhase = sin(rfPhase);
+}
+
+//! Fill the Bloch matrix with the current rf amplitude and frequency
+template<int size> void BlochMcConnellSolver<size>::SetupBlochMatrix()
+{
+	SimulationParameters &sp = *simParams;
 	A(0, 1 + N) = dw0; // dephasing of water pool
 	A(1 + N, 0) = -dw0;
 
-	// set omega 1
+	// set omega 1 (phase = 0)
 	double rfAmplitude2pi = rfAmplitude*TWO_PI*sp.GetScannerRelB1();
-	double rfAmplitude2piCosPhi = rfAmplitude2pi * cos(rfPhase);
-	double rfAmplitude2piSinPhi = rfAmplitude2pi * sin(rfPhase);
 
 	//water
-	A(0, 2 * (N + 1)) = -rfAmplitude2piSinPhi;
-	A(2 * (N + 1), 0) = rfAmplitude2piSinPhi;
-
-	A(N + 1, 2 * (N + 1)) = rfAmplitude2piCosPhi;
-	A(2 * (N + 1), N + 1) = -rfAmplitude2piCosPhi;
+	A(N + 1, 2 * (N + 1)) = rfAmplitude2pi;
+	A(2 * (N + 1), N + 1) = -rfAmplitude2pi;
 
 	//CEST 
 	for (int i = 1; i <= N; i++)
 	{
-		A(i, i + 2 * (N + 1)) = -rfAmplitude2piSinPhi;
-		A(i + 2 * (N + 1), i) = rfAmplitude2piSinPhi;
-
-		A(N + 1 + i, i + 2 * (N + 1)) = rfAmplitude2piCosPhi;
-		A(i + 2 * (N + 1), N + 1 + i) = -rfAmplitude2piCosPhi;
+		A(N + 1 + i, i + 2 * (N + 1)) = rfAmplitude2pi;
+		A(i + 2 * (N + 1), N + 1 + i) = -rfAmplitude2pi;
 	}
 
 	// set off-resonance terms
@@ -241,8 +408,24 @@ template<int size> void BlochMcConnellSolver<size>::UpdateBlochMatrix(Simulation
 
 	//set MT term
 	if (sp.IsMTActive()) {
-		A(3 * (N + 1), 3 * (N + 1)) = -sp.GetMTPool()->GetR1() - sp.GetMTPool()->GetExchangeRateInHz() - pow(rfAmplitude2pi, 2)* sp.GetMTPool()->GetMTLineAtCurrentOffset(rfFreqOffset2pi + dw0, w0);
+		A(3 * (N + 1), 3 * (N + 1)) = -sp.GetMTPool()->GetR1() - sp.GetMTPool()->GetExchangeRateInHz() - pow(rfAmplitude2pi, 2)* mtLineshape.GetMTLineAtCurrentOffset(rfFreqOffset2pi + dw0);
 	}
+	blochMatrixOutdated = false;
+}
+
+//! Get the Bloch matrix for the current rf amplitude and frequency
+/*!
+	The matrix is set up for a pulse phase of 0
+	\param blochMatrix matrix A of dM/dt = A * M + C
+	\param relaxationVector vector C of dM/dt = A * M + C
+*/
+template<int size> void BlochMcConnellSolver<size>::GetBlochMatrix(Eigen::MatrixXd &blochMatrix, Eigen::VectorXd &relaxationVector)
+{
+	if (blochMatrixOutdated) {
+		SetupBlochMatrix();
+	}
+	blochMatrix = A;
+	relaxationVector = C;
 }
 
 //! Solve Bloch McConnell equation 
@@ -252,41 +435,313 @@ template<int size> void BlochMcConnellSolver<size>::UpdateBlochMatrix(Simulation
 */
 template<int size> void BlochMcConnellSolver<size>::SolveBlochEquation(Eigen::VectorXd &M, double t)
 {
-	VectorNd AInvT = A.inverse()*C; // helper variable A^-1 * C
-	MatrixNd At = A * t;			// helper variable A * t
+	const Propagator &prop = GetPropagator(t);
+	// A(phase) = R(phase) * A(0) * R(-phase) -> exp(A(phase)*t) = R(phase) * exp(A(0)*t) * R(-phase)
+	bool rotate = (rfAmplitude != 0.0 && (sinPhase != 0.0 || cosPhase != 1.0));
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+	Eigen::internal::set_is_malloc_allowed(false); // the propagation must not allocate memory
+#endif
+	if (rotate) {
+		RotateTransverseMagnetization(M, cosPhase, -sinPhase);
+	}
+	PropagateVector(prop.F, prop.offset, M);
+	if (rotate) {
+		RotateTransverseMagnetization(M, cosPhase, sinPhase);
+	}
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+	Eigen::internal::set_is_malloc_allowed(true);
+#endif
+}
+
+
+//! Get the (cached) propagator for the current Bloch matrix
+/*!
+	\param t timestep of the propagator
+	\return propagator for the current rf amplitude and frequency (phase = 0)
+*/
+template<int size> const typename BlochMcConnellSolver<size>::Propagator& BlochMcConnellSolver<size>::GetPropagator(double t)
+{
+	PropagatorID id = std::make_tuple(rfAmplitude, rfFrequency, t);
+	typename PropagatorCache::iterator it = propagatorCache.find(id);
+	if (it == propagatorCache.end()) {
+		STATS_ADD(stats, propagatorCacheMisses, 1);
+		if (propagatorCache.size() >= maxCacheEntries) {
+			propagatorCache.clear(); // offsets are simulated one after another, old entries are usually not needed anymore
+		}
+		if (blochMatrixOutdated) {
+			SetupBlochMatrix();
+		}
+		Propagator prop; // only the cached propagator itself is allocated
+		if (!CalculateEigenPropagator(t, prop)) {
+			CalculatePropagator(t, prop);
+		}
+		it = propagatorCache.insert(std::make_pair(id, std::move(prop))).first;
+	}
+	else {
+		STATS_ADD(stats, propagatorCacheHits, 1);
+	}
+	return it->second;
+}
+
+
+//! Start a new block propagator
+/*!
+	The following ComposeBlochEquation calls get multiplied to a single propagator
+	that can be applied to the magnetization vector with ApplyBlockPropagator
+*/
+template<int size> void BlochMcConnellSolver<size>::BeginBlockPropagator()
+{
+	currentBlock.F.setIdentity();
+	currentBlock.offset.setZero();
+}
+
+
+//! Add the current Bloch matrix for duration t to the block propagator
+/*!	\param t timestep for which the equation should be solved */
+template<int size> void BlochMcConnellSolver<size>::ComposeBlochEquation(double t)
+{
+	const Propagator &prop = GetPropagator(t);
+	bool rotate = (rfAmplitude != 0.0 && (sinPhase != 0.0 || cosPhase != 1.0));
+	if (rotate) {
+		RotateTransverseMagnetization(currentBlock.F, cosPhase, -sinPhase);
+		RotateTransverseMagnetization(currentBlock.offset, cosPhase, -sinPhase);
+	}
+	workspace.blockTmp.noalias() = prop.F * currentBlock.F;
+	currentBlock.F.swap(workspace.blockTmp);
+	PropagateVector(prop.F, prop.offset, currentBlock.offset);
+	if (rotate) {
+		RotateTransverseMagnetization(currentBlock.F, cosPhase, sinPhase);
+		RotateTransverseMagnetization(currentBlock.offset, cosPhase, sinPhase);
+	}
+}
+
+
+//! Store the block propagator and return its index
+/*!	\return index of the block propagator for ApplyBlockPropagator */
+template<int size> unsigned int BlochMcConnellSolver<size>::EndBlockPropagator()
+{
+	blockPropagators.push_back(currentBlock);
+	return blockPropagators.size() - 1;
+}
+
+
+//! Apply a stored block propagator multiple times
+/*!
+	Long runs of the same block are applied by binary exponentiation of the propagator
+	\param M magnetization vector
+	\param blockIdx index of the block propagator
+	\param rfPhase phase offset of the blocks [rad]
+	\param count number of consecutive blocks
+*/
+template<int size> void BlochMcConnellSolver<size>::ApplyBlockPropagator(Eigen::VectorXd &M, unsigned int blockIdx, double rfPhase, unsigned int count)
+{
+	const Propagator &block = blockPropagators[blockIdx];
+	double cosBlockPhase = cos(rfPhase);
+	double sinBlockPhase = sin(rfPhase);
+	if (rfPhase != 0.0) {
+		RotateTransverseMagnetization(M, cosBlockPhase, -sinBlockPhase);
+	}
+	// squaring costs ~2*log2(count) matrix products, the plain loop count matrix-vector products
+	unsigned int numSquarings = 0;
+	for (unsigned int c = count; c > 1; c >>= 1) {
+		numSquarings++;
+	}
+	if (count > 2 * numSquarings * A.rows()) {
+		MatrixNd &F = workspace.blockF;
+		VectorNd &offset = workspace.blockOffset;
+		MatrixNd &Fb = workspace.blockFb;
+		VectorNd &offsetb = workspace.blockOffsetb;
+		F.setIdentity();
+		offset.setZero();
+		Fb = block.F;
+		offsetb = block.offset;
+		for (unsigned int c = count; c > 0; c >>= 1) {
+			if (c & 1) {
+				PropagateVector(Fb, offsetb, offset);
+				workspace.blockTmp.noalias() = Fb * F;
+				F.swap(workspace.blockTmp);
+			}
+			if (c > 1) {
+				PropagateVector(Fb, offsetb, offsetb);
+				workspace.blockTmp.noalias() = Fb * Fb;
+				Fb.swap(workspace.blockTmp);
+			}
+		}
+		PropagateVector(F, offset, M);
+	}
+	else {
+		for (unsigned int c = 0; c < count; c++) {
+			PropagateVector(block.F, block.offset, M);
+		}
+	}
+	if (rfPhase != 0.0) {
+		RotateTransverseMagnetization(M, cosBlockPhase, sinBlockPhase);
+	}
+}
+
+
+//! Calculate the propagator for the current Bloch matrix
+/*!
+	The pade approximation runs on the augmented system d/dt [M; 1] = [A C; 0 0] * [M; 1].
+	Its exponential [exp(A*t) (exp(A*t) - I) * A^-1 * C; 0 1] contains the affine term,
+	so A does not need to be inverted, which is also stable for nearly singular A (e.g. tiny R1)
+	\param t timestep for which the propagator should be calculated
+	\param prop Propagator that gets filled
+*/
+template<int size> void BlochMcConnellSolver<size>::CalculatePropagator(double t, Propagator &prop)
+{
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+	Eigen::internal::set_is_malloc_allowed(false); // only the propagator itself may allocate memory
+#endif
+	const int n = A.rows();
+	AugmentedMatrixNd &At = workspace.At; // helper variable [A C; 0 0] * t
+	At.setZero();
+	At.topLeftCorner(n, n) = A * t;
+	At.topRightCorner(n, 1) = C * t;
 	//solve exponential with pade method
 	int infExp; //infinity exponent of the matrix
 	int j;
 	std::frexp(At.template lpNorm<Eigen::Infinity>(), &infExp); // pade method is only stable if ||A||inf / 2^j <= 0.5
 	j = std::max(0, infExp + 1);
-	At = At * (1.0 / (pow(2, j)));
+	STATS_ADD(stats, padeExponentials, 1);
+	STATS_SQUARING_STEPS(stats, j, 1);
+	At *= (1.0 / (pow(2, j)));
 	//the algorithm usually starts with D = X = N = Identity and c = 1
 	// since c is alway 0.5 after the first loop, we can start in the second round and init the matrices corresponding to that
-	MatrixNd X(At); // X = A after first loop
+	AugmentedMatrixNd &X = workspace.X;
+	X = At; // X = A after first loop
 	double c = 0.5; // c = 0.5 after first loop
-	MatrixNd N(At);
-	N.setIdentity();
-	MatrixNd D = N - c * At;
-	N += c * At;
+	AugmentedMatrixNd &Nm = workspace.Nm;
+	Nm.setIdentity();
+	AugmentedMatrixNd &D = workspace.D;
+	D = Nm - c * At;
+	Nm += c * At;
 	bool p = true; // D +- cX is dependent from (-1)^k, fastest way is with changing boolean in the loop
 	double q = numApprox;
-	MatrixNd cX; // helper variable for c * X
 	// run the approximation
 	for (int k = 2; k <= q; k++)
 	{
 		c *= (q - k + 1) / (k*(2 * q - k + 1));
-		X = At * X;
-		cX = c * X;
-		N += cX;
-		p ? D += cX : D -= cX;
+		workspace.tmp.noalias() = At * X;
+		X.swap(workspace.tmp);
+		Nm += c * X;
+		p ? D += c * X : D -= c * X;
 		p = !p;
 	}
-	MatrixNd F = D.inverse()*N; // solve D*F = N for F
+	AugmentedMatrixNd &F = workspace.F;
+	workspace.lu.compute(D);
+	F = workspace.lu.solve(Nm); // solve D*F = N for F
 	for (int k = 1; k <= j; k++)
 	{
-		F *= F;
+		workspace.tmp.noalias() = F * F;
+		F.swap(workspace.tmp);
 	}
-	M = F * (M + AInvT) - AInvT;
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+	Eigen::internal::set_is_malloc_allowed(true);
+#endif
+	prop.F = F.topLeftCorner(n, n);
+	prop.offset = F.topRightCorner(n, 1);
+}
+
+
+//! Calculate the propagator from the eigendecomposition of the current Bloch matrix
+/*!
+	The Bloch matrix gets diagonalized as soon as it is needed for a second duration.
+	Afterwards, the propagators of all durations only need the exponentials of the eigenvalues:
+	exp(A*t) = V * diag(exp(lambda*t)) * V^-1
+	\param t timestep for which the propagator should be calculated
+	\param prop Propagator that gets filled
+	\return false if the pade approximation should be used instead
+*/
+template<int size> bool BlochMcConnellSolver<size>::CalculateEigenPropagator(double t, Propagator &prop)
+{
+	BlochMatrixID id = std::make_pair(rfAmplitude, rfFrequency);
+	typename EigenDecompositionCache::iterator it = eigenCache.find(id);
+	if (it == eigenCache.end()) {
+		// the propagator cache is sorted by amplitude, frequency and time, so other durations of this matrix are next to each other
+		typename PropagatorCache::iterator prev = propagatorCache.lower_bound(std::make_tuple(rfAmplitude, rfFrequency, -HUGE_VAL));
+		if (prev == propagatorCache.end() || std::get<0>(prev->first) != rfAmplitude || std::get<1>(prev->first) != rfFrequency) {
+			return false; // first duration of this matrix, the decomposition would not pay off
+		}
+		if (eigenCache.size() >= std::max(1u, maxCacheEntries / 4)) {
+			eigenCache.clear(); // a decomposition needs ~4 times the memory of a propagator
+		}
+		it = eigenCache.insert(std::make_pair(id, EigenDecomposition())).first;
+		DecomposeBlochMatrix(it->second);
+	}
+	const EigenDecomposition &decomp = it->second;
+	if (!decomp.valid) {
+		return false;
+	}
+	workspace.expLambdaT = (decomp.lambda * t).array().exp().matrix();
+	workspace.VExp.noalias() = decomp.V * workspace.expLambdaT.asDiagonal();
+	workspace.VExpVInv.noalias() = workspace.VExp * decomp.VInv;
+	prop.F = workspace.VExpVInv.real();
+	prop.offset = -decomp.AInvC;
+	prop.offset.noalias() += prop.F * decomp.AInvC;
+	STATS_ADD(stats, eigenExponentials, 1);
+	return true;
+}
+
+
+//! Diagonalize the current Bloch matrix
+/*!
+	The decomposition is only marked as valid if the eigenvectors are well conditioned,
+	otherwise exp(A*t) would lose too much accuracy (e.g. for nearly defective matrices)
+	\param decomp EigenDecomposition that gets filled
+*/
+template<int size> void BlochMcConnellSolver<size>::DecomposeBlochMatrix(EigenDecomposition &decomp)
+{
+	decomp.valid = false;
+	STATS_ADD(stats, eigenDecompositions, 1);
+	Eigen::EigenSolver<MatrixNd> es(A);
+	if (es.info() != Eigen::Success) {
+		return;
+	}
+	decomp.V = es.eigenvectors();
+	decomp.lambda = es.eigenvalues();
+	decomp.VInv = decomp.V.partialPivLu().inverse();
+	double condition = decomp.V.cwiseAbs().colwise().sum().maxCoeff() * decomp.VInv.cwiseAbs().colwise().sum().maxCoeff();
+	if (!(condition < MAX_EIGENVECTOR_CONDITION) || (decomp.lambda.array() == std::complex<double>(0.0)).any()) {
+		return;
+	}
+	// A^-1 * C = V * diag(1/lambda) * V^-1 * C
+	decomp.AInvC = (decomp.V * (decomp.VInv * C.template cast<std::complex<double> >()).cwiseQuotient(decomp.lambda)).real();
+	decomp.valid = true;
+}
+
+
+//! Rotate the transverse magnetization of all pools around z
+/*!
+	If M is a matrix, all of its columns get rotated
+	\param M magnetization vector(s) that get rotated
+	\param cosAngle cosine of the rotation angle
+	\param sinAngle sine of the rotation angle
+*/
+template<int size> template<typename Derived> void BlochMcConnellSolver<size>::RotateTransverseMagnetization(Eigen::MatrixBase<Derived> &M, double cosAngle, double sinAngle)
+{
+	for (int i = 0; i <= N; i++) {
+		for (int col = 0; col < M.cols(); col++) {
+			double mx = M(i, col);
+			double my = M(i + N + 1, col);
+			M(i, col) = cosAngle * mx - sinAngle * my;
+			M(i + N + 1, col) = sinAngle * mx + cosAngle * my;
+		}
+	}
+}
+
+
+//! Calculate v = F * v + offset without temporaries
+/*!
+	\param F propagator matrix
+	\param offset propagator offset
+	\param v vector that gets propagated, may be offset itself
+*/
+template<int size> template<typename Derived> void BlochMcConnellSolver<size>::PropagateVector(const MatrixNd &F, const VectorNd &offset, Eigen::MatrixBase<Derived> &v)
+{
+	workspace.M = offset;
+	workspace.M.noalias() += F * v;
+	v = workspace.M;
 }
 
 
@@ -297,4 +752,5 @@ template<int size> void BlochMcConnellSolver<size>::SolveBlochEquation(Eigen::Ve
 template<int size> void BlochMcConnellSolver<size>::SetNumStepsForPadeApprox(unsigned int nApprox)
 {
 	numApprox = nApprox;
+	propagatorCache.clear();
 }
\ No newline at end of file
@@ -0,0 +1,520 @@
+//!  DictionaryFile.cpp
+/*!
+Memory-mapped binary file for the results of parameter sweeps
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "DictionaryFile.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char dictionaryMagic[8] = { 'P', 'Q', 'C', 'D', 'I', 'C', 'T', 0 };
+
+//! Size of the fixed-size header, the tables and the padding
+/*!
+	\param numComponents number of stored components
+	\param numADCs number of stored ADC events
+	\param axes axes of the sweep
+	\return offset of the first entry
+*/
+static uint32_t GetHeaderSize(uint32_t numComponents, uint32_t numADCs, const std::vector<SweepAxis> &axes)
+{
+	size_t size = sizeof(DictionaryHeader) + (numComponents + numADCs) * sizeof(uint32_t);
+	size = (size + 7) / 8 * 8;
+	for (unsigned int i = 0; i < axes.size(); i++) {
+		size += 4 * sizeof(uint32_t) + axes[i].values.size() * sizeof(double);
+	}
+	return uint32_t((size + DICTIONARY_DATA_ALIGNMENT - 1) / DICTIONARY_DATA_ALIGNMENT * DICTIONARY_DATA_ALIGNMENT);
+}
+
+//! Get the granularity of offsets of memory mappings
+/*!	\return page size or allocation granularity [bytes] */
+static uint64_t GetMappingGranularity()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwAllocationGranularity;
+#else
+	return uint64_t(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+//! Read from the file at an offset
+/*!
+	\param file file descriptor or handle
+	\param offset offset in the file [bytes]
+	\param buffer destination
+	\param length number of bytes
+	\return false if less than length bytes could be read
+*/
+static bool ReadAt(intptr_t file, uint64_t offset, void* buffer, size_t length)
+{
+#ifdef _WIN32
+	OVERLAPPED ov = {};
+	ov.Offset = DWORD(offset);
+	ov.OffsetHigh = DWORD(offset >> 32);
+	DWORD numRead = 0;
+	return ReadFile(HANDLE(file), buffer, DWORD(length), &numRead, &ov) && numRead == length;
+#else
+	return pread(int(file), buffer, length, off_t(offset)) == ssize_t(length);
+#endif
+}
+
+//! Write to the file at an offset and flush it to disk
+/*!
+	\param file file descriptor or handle
+	\param offset offset in the file [bytes]
+	\param buffer source
+	\param length number of bytes
+	\return false if the data could not be written
+*/
+static bool WriteAt(intptr_t file, uint64_t offset, const void* buffer, size_t length)
+{
+#ifdef _WIN32
+	OVERLAPPED ov = {};
+	ov.Offset = DWORD(offset);
+	ov.OffsetHigh = DWORD(offset >> 32);
+	DWORD numWritten = 0;
+	return WriteFile(HANDLE(file), buffer, DWORD(length), &numWritten, &ov) && numWritten == length && FlushFileBuffers(HANDLE(file));
+#else
+	return pwrite(int(file), buffer, length, off_t(offset)) == ssize_t(length) && fsync(int(file)) == 0;
+#endif
+}
+
+//! Get the size of the file
+/*!
+	\param file file descriptor or handle
+	\return size [bytes]
+*/
+static uint64_t GetFileSize(intptr_t file)
+{
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	return GetFileSizeEx(HANDLE(file), &size) ? uint64_t(size.QuadPart) : 0;
+#else
+	struct stat st;
+	return fstat(int(file), &st) == 0 ? uint64_t(st.st_size) : 0;
+#endif
+}
+
+//! Constructor
+DictionaryFile::DictionaryFile()
+{
+	file = -1;
+	writable = false;
+	memset(&header, 0, sizeof(DictionaryHeader));
+	chunkMapping.base = NULL;
+	readMapping.base = NULL;
+	currentChunk = 0;
+	readMappingEntries = 0;
+}
+
+//! Destructor, closes the file
+DictionaryFile::~DictionaryFile()
+{
+	this->Close();
+}
+
+//! Create a new dictionary file for a sweep
+/*!
+	An existing file is overwritten
+	\param path filename
+	\param sweep parameter sweep, the axes are stored in the header
+	\param components stored components of the magnetization vector
+	\param adcs stored ADC events
+	\param normalizationADC ADC event the entries are divided by, -1 for none
+	\param chunkSize number of entries that are simulated and flushed at once
+*/
+void DictionaryFile::Create(const std::string &path, ParameterSweep &sweep, const std::vector<unsigned int> &components, const std::vector<unsigned int> &adcs, int normalizationADC, unsigned int chunkSize)
+{
+	this->Close();
+	if (chunkSize == 0 || components.empty() || adcs.empty()) {
+		throw std::runtime_error("Dictionary needs at least one entry per chunk, one component and one ADC event");
+	}
+	std::vector<SweepAxis> &sweepAxes = *sweep.GetAxes();
+	memcpy(header.magic, dictionaryMagic, sizeof(header.magic));
+	header.version = DICTIONARY_FILE_VERSION;
+	header.headerSize = GetHeaderSize(components.size(), adcs.size(), sweepAxes);
+	header.numEntries = sweep.GetNumberOfEntries();
+	header.chunkSize = chunkSize;
+	header.numCompletedChunks = 0;
+	header.numComponents = components.size();
+	header.numADCs = adcs.size();
+	header.normalizationADC = normalizationADC;
+	header.numAxes = sweepAxes.size();
+	header.isGrid = sweep.IsGrid() ? 1 : 0;
+	header.reserved = 0;
+	// serialize the header with all tables
+	std::vector<char> buffer(header.headerSize, 0);
+	char* pos = buffer.data();
+	memcpy(pos, &header, sizeof(DictionaryHeader));
+	pos += sizeof(DictionaryHeader);
+	for (unsigned int i = 0; i < components.size(); i++, pos += sizeof(uint32_t)) {
+		uint32_t value = components[i];
+		memcpy(pos, &value, sizeof(uint32_t));
+	}
+	for (unsigned int i = 0; i < adcs.size(); i++, pos += sizeof(uint32_t)) {
+		uint32_t value = adcs[i];
+		memcpy(pos, &value, sizeof(uint32_t));
+	}
+	pos = buffer.data() + (pos - buffer.data() + 7) / 8 * 8;
+	for (unsigned int i = 0; i < sweepAxes.size(); i++) {
+		uint32_t axisInfo[4] = { uint32_t(sweepAxes[i].parameter), uint32_t(sweepAxes[i].pool), sweepAxes[i].cestPoolIdx, uint32_t(sweepAxes[i].values.size()) };
+		memcpy(pos, axisInfo, sizeof(axisInfo));
+		pos += sizeof(axisInfo);
+		memcpy(pos, sweepAxes[i].values.data(), sweepAxes[i].values.size() * sizeof(double));
+		pos += sweepAxes[i].values.size() * sizeof(double);
+	}
+#ifdef _WIN32
+	HANDLE h = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	file = (h == INVALID_HANDLE_VALUE) ? -1 : intptr_t(h);
+#else
+	file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+	if (file == -1) {
+		throw std::runtime_error("Could not create dictionary file " + path);
+	}
+	this->path = path;
+	writable = true;
+	this->components = components;
+	this->adcs = adcs;
+	axes = sweepAxes;
+	if (!WriteAt(file, 0, buffer.data(), buffer.size())) {
+		this->Close();
+		throw std::runtime_error("Could not write the header of dictionary file " + path);
+	}
+}
+
+//! Open an existing dictionary file
+/*!
+	\param path filename
+	\param writable true to continue writing the chunks that are not completed yet
+*/
+void DictionaryFile::Open(const std::string &path, bool writable)
+{
+	this->Close();
+#ifdef _WIN32
+	HANDLE h = CreateFileA(path.c_str(), GENERIC_READ | (writable ? GENERIC_WRITE : 0), FILE_SHARE_READ | (writable ? 0 : FILE_SHARE_WRITE), NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	file = (h == INVALID_HANDLE_VALUE) ? -1 : intptr_t(h);
+#else
+	file = open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+#endif
+	if (file == -1) {
+		throw std::runtime_error("Could not open dictionary file " + path);
+	}
+	this->path = path;
+	this->writable = writable;
+	uint64_t fileSize = GetFileSize(file);
+	if (!ReadAt(file, 0, &header, sizeof(DictionaryHeader)) || memcmp(header.magic, dictionaryMagic, sizeof(header.magic)) != 0) {
+		this->Close();
+		throw std::runtime_error(path + " is not a dictionary file");
+	}
+	if (header.version != DICTIONARY_FILE_VERSION) {
+		this->Close();
+		throw std::runtime_error("Unsupported version of dictionary file " + path);
+	}
+	// read the tables
+	std::vector<char> buffer(header.headerSize);
+	if (header.headerSize < sizeof(DictionaryHeader) || header.headerSize > fileSize || !ReadAt(file, 0, buffer.data(), buffer.size())) {
+		this->Close();
+		throw std::runtime_error("Corrupt header in dictionary file " + path);
+	}
+	const char* pos = buffer.data() + sizeof(DictionaryHeader);
+	const char* end = buffer.data() + buffer.size();
+	if (uint64_t(header.numComponents + header.numADCs) * sizeof(uint32_t) > uint64_t(end - pos)) {
+		this->Close();
+		throw std::runtime_error("Corrupt header in dictionary file " + path);
+	}
+	components.resize(header.numComponents);
+	adcs.resize(header.numADCs);
+	for (unsigned int i = 0; i < header.numComponents; i++, pos += sizeof(uint32_t)) {
+		uint32_t value;
+		memcpy(&value, pos, sizeof(uint32_t));
+		components[i] = value;
+	}
+	for (unsigned int i = 0; i < header.numADCs; i++, pos += sizeof(uint32_t)) {
+		uint32_t value;
+		memcpy(&value, pos, sizeof(uint32_t));
+		adcs[i] = value;
+	}
+	pos = buffer.data() + (pos - buffer.data() + 7) / 8 * 8;
+	axes.resize(header.numAxes);
+	for (unsigned int i = 0; i < header.numAxes; i++) {
+		uint32_t axisInfo[4];
+		if (pos + sizeof(axisInfo) > end) {
+			this->Close();
+			throw std::runtime_error("Corrupt header in dictionary file " + path);
+		}
+		memcpy(axisInfo, pos, sizeof(axisInfo));
+		pos += sizeof(axisInfo);
+		if (uint64_t(axisInfo[3]) * sizeof(double) > uint64_t(end - pos)) {
+			this->Close();
+			throw std::runtime_error("Corrupt header in dictionary file " + path);
+		}
+		axes[i].parameter = SweepParameter(axisInfo[0]);
+		axes[i].pool = SweepPool(axisInfo[1]);
+		axes[i].cestPoolIdx = axisInfo[2];
+		axes[i].values.resize(axisInfo[3]);
+		memcpy(axes[i].values.data(), pos, axisInfo[3] * sizeof(double));
+		pos += axisInfo[3] * sizeof(double);
+	}
+	if (header.chunkSize == 0 || header.numCompletedChunks > this->GetNumberOfChunks() || header.headerSize + this->GetNumberOfCompletedEntries() * this->GetEntrySize() > fileSize) {
+		this->Close();
+		throw std::runtime_error("Dictionary file " + path + " is shorter than its completed chunks");
+	}
+}
+
+//! Close the file
+/*!	An incomplete chunk is discarded and rewritten when the file is opened again */
+void DictionaryFile::Close()
+{
+	this->Unmap(chunkMapping);
+	this->Unmap(readMapping);
+	readMappingEntries = 0;
+	if (file != -1) {
+#ifdef _WIN32
+		CloseHandle(HANDLE(file));
+#else
+		close(int(file));
+#endif
+		file = -1;
+	}
+}
+
+//! Get number of entries
+/*!	\return number of entries of the sweep */
+unsigned int DictionaryFile::GetNumberOfEntries()
+{
+	return header.numEntries;
+}
+
+//! Get number of entries per chunk
+/*!	\return number of entries that are simulated and flushed at once */
+unsigned int DictionaryFile::GetChunkSize()
+{
+	return header.chunkSize;
+}
+
+//! Get number of chunks
+/*!	\return number of chunks, the last chunk can be smaller than the chunk size */
+unsigned int DictionaryFile::GetNumberOfChunks()
+{
+	return header.chunkSize > 0 ? (header.numEntries + header.chunkSize - 1) / header.chunkSize : 0;
+}
+
+//! Get number of completely written chunks
+/*!	\return number of completed chunks */
+unsigned int DictionaryFile::GetNumberOfCompletedChunks()
+{
+	return header.numCompletedChunks;
+}
+
+//! Get number of entries in the completed chunks
+/*!	\return number of entries that can be read */
+unsigned int DictionaryFile::GetNumberOfCompletedEntries()
+{
+	return std::min(header.numEntries, header.numCompletedChunks * header.chunkSize);
+}
+
+//! Get stored components of the magnetization vector
+/*!	\return pointer to the vector with the component indices */
+std::vector<unsigned int>* DictionaryFile::GetComponents()
+{
+	return &components;
+}
+
+//! Get stored ADC events
+/*!	\return pointer to the vector with the ADC event indices */
+std::vector<unsigned int>* DictionaryFile::GetADCs()
+{
+	return &adcs;
+}
+
+//! Get ADC event the entries are divided by
+/*!	\return ADC event index, -1 for none */
+int DictionaryFile::GetNormalizationADC()
+{
+	return header.normalizationADC;
+}
+
+//! Get the axes of the sweep
+/*!	\return pointer to the vector with all axes */
+std::vector<SweepAxis>* DictionaryFile::GetAxes()
+{
+	return &axes;
+}
+
+//! Check if the sweep is a grid
+/*!	\return true if the entries are all combinations of the axes */
+bool DictionaryFile::IsGrid()
+{
+	return header.isGrid != 0;
+}
+
+//! Map the next chunk that is not completed yet
+/*!
+	The file is extended to the end of the chunk, data of an interrupted chunk is overwritten
+	\param firstEntry gets the index of the first entry of the chunk
+	\param numEntries gets the number of entries of the chunk
+	\return pointer to numEntries x GetEntrySize() bytes, NULL if all chunks are completed
+*/
+double* DictionaryFile::BeginChunk(unsigned int &firstEntry, unsigned int &numEntries)
+{
+	if (!writable) {
+		throw std::runtime_error("Dictionary file " + path + " is not open for writing");
+	}
+	this->Unmap(chunkMapping);
+	currentChunk = header.numCompletedChunks;
+	if (currentChunk >= this->GetNumberOfChunks()) {
+		return NULL;
+	}
+	firstEntry = currentChunk * header.chunkSize;
+	numEntries = std::min(header.numEntries - firstEntry, header.chunkSize);
+	uint64_t offset = header.headerSize + uint64_t(firstEntry) * this->GetEntrySize();
+	size_t length = numEntries * this->GetEntrySize();
+	this->Resize(offset + length);
+	chunkMapping = this->Map(offset, length, true);
+	return reinterpret_cast<double*>(chunkMapping.data);
+}
+
+//! Flush the current chunk and mark it as completed
+/*!	The header is only updated after the data of the chunk reached the disk */
+void DictionaryFile::CommitChunk()
+{
+	if (chunkMapping.base == NULL) {
+		throw std::runtime_error("No chunk of dictionary file " + path + " is mapped");
+	}
+#ifdef _WIN32
+	bool flushed = FlushViewOfFile(chunkMapping.base, chunkMapping.length) && FlushFileBuffers(HANDLE(file));
+#else
+	bool flushed = msync(chunkMapping.base, chunkMapping.length, MS_SYNC) == 0;
+#endif
+	this->Unmap(chunkMapping);
+	if (!flushed) {
+		throw std::runtime_error("Could not flush chunk of dictionary file " + path);
+	}
+	header.numCompletedChunks = currentChunk + 1;
+	this->WriteCompletedChunks();
+}
+
+//! Get read access to an entry of a completed chunk
+/*!
+	The completed part of the file is mapped on first access and remapped if more chunks were completed since then
+	\param entry index of the entry
+	\return pointer to numComponents x numADCs doubles (column-major), valid until the file is closed or the next chunk is committed
+*/
+const double* DictionaryFile::GetEntry(unsigned int entry)
+{
+	if (entry >= this->GetNumberOfCompletedEntries()) {
+		throw std::runtime_error("Entry " + std::to_string(entry) + " of dictionary file " + path + " is not completed");
+	}
+	if (entry >= readMappingEntries) {
+		this->Unmap(readMapping);
+		readMappingEntries = this->GetNumberOfCompletedEntries();
+		readMapping = this->Map(header.headerSize, readMappingEntries * this->GetEntrySize(), false);
+	}
+	return reinterpret_cast<const double*>(readMapping.data + entry * this->GetEntrySize());
+}
+
+//! Get size of an entry [bytes]
+/*!	\return numComponents x numADCs x sizeof(double) */
+size_t DictionaryFile::GetEntrySize()
+{
+	return size_t(header.numComponents) * header.numADCs * sizeof(double);
+}
+
+//! Write the number of completed chunks to the header in the file
+void DictionaryFile::WriteCompletedChunks()
+{
+	if (!WriteAt(file, offsetof(DictionaryHeader, numCompletedChunks), &header.numCompletedChunks, sizeof(header.numCompletedChunks))) {
+		throw std::runtime_error("Could not update the header of dictionary file " + path);
+	}
+}
+
+//! Map a part of the file
+/*!
+	\param offset offset in the file [bytes]
+	\param length number of bytes
+	\param write true for write access
+	\return mapping with data pointing to offset
+*/
+DictionaryFile::Mapping DictionaryFile::Map(uint64_t offset, size_t length, bool write)
+{
+	uint64_t granularity = GetMappingGranularity();
+	uint64_t alignedOffset = offset / granularity * granularity;
+	Mapping mapping;
+	mapping.length = length + (offset - alignedOffset);
+#ifdef _WIN32
+	HANDLE fileMapping = CreateFileMappingA(HANDLE(file), NULL, write ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+	mapping.base = fileMapping == NULL ? NULL : MapViewOfFile(fileMapping, write ? FILE_MAP_WRITE : FILE_MAP_READ, DWORD(alignedOffset >> 32), DWORD(alignedOffset), mapping.length);
+	if (fileMapping != NULL) {
+		CloseHandle(fileMapping); // the view keeps the mapping alive
+	}
+#else
+	mapping.base = mmap(NULL, mapping.length, write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, int(file), off_t(alignedOffset));
+	if (mapping.base == MAP_FAILED) {
+		mapping.base = NULL;
+	}
+#endif
+	if (mapping.base == NULL) {
+		throw std::runtime_error("Could not map dictionary file " + path);
+	}
+	mapping.data = static_cast<char*>(mapping.base) + (offset - alignedOffset);
+	return mapping;
+}
+
+//! Unmap a part of the file
+/*!	\param mapping mapping that gets unmapped, nothing happens if it is not mapped */
+void DictionaryFile::Unmap(Mapping &mapping)
+{
+	if (mapping.base != NULL) {
+#ifdef _WIN32
+		UnmapViewOfFile(mapping.base);
+#else
+		munmap(mapping.base, mapping.length);
+#endif
+		mapping.base = NULL;
+	}
+}
+
+//! Set the size of the file
+/*!	\param size new size [bytes] */
+void DictionaryFile::Resize(uint64_t size)
+{
+#ifdef _WIN32
+	LARGE_INTEGER pos;
+	pos.QuadPart = LONGLONG(size);
+	bool resized = SetFilePointerEx(HANDLE(file), pos, NULL, FILE_BEGIN) && SetEndOfFile(HANDLE(file));
+#else
+	bool resized = ftruncate(int(file), off_t(size)) == 0;
+#endif
+	if (!resized) {
+		throw std::runtime_error("Could not resize dictionary file " + path);
+	}
+}
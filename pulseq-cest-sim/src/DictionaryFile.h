@@ -0,0 +1,154 @@
+//!  DictionaryFile.h
+/*!
+Memory-mapped binary file for the results of parameter sweeps
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "ParameterSweep.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define DICTIONARY_FILE_VERSION 1     // version of the dictionary file layout
+#define DICTIONARY_DATA_ALIGNMENT 4096 // the entries start at a multiple of this number of bytes
+
+//! Fixed-size part of the dictionary file header
+/*!
+	The header is followed by the output components (uint32), the output ADC events (uint32), padding to 8 bytes and
+	the axes (uint32 parameter, pool, CEST pool index and number of values followed by the double values).
+	The entries start at headerSize, each entry contains numComponents x numADCs doubles (column-major, one column per ADC event).
+	All values are stored in the native byte order.
+*/
+struct DictionaryHeader
+{
+	char magic[8];               /*!< "PQCDICT" */
+	uint32_t version;            /*!< DICTIONARY_FILE_VERSION */
+	uint32_t headerSize;         /*!< offset of the first entry [bytes] */
+	uint64_t numEntries;         /*!< number of entries of the sweep */
+	uint64_t chunkSize;          /*!< number of entries per chunk */
+	uint64_t numCompletedChunks; /*!< chunks that are completely written, updated after the chunk was flushed */
+	uint32_t numComponents;      /*!< number of stored components of the magnetization vector */
+	uint32_t numADCs;            /*!< number of stored ADC events */
+	int32_t normalizationADC;    /*!< ADC event the entries are divided by, -1 for none */
+	uint32_t numAxes;            /*!< number of sweep axes */
+	uint32_t isGrid;             /*!< 1 if the entries are all combinations of the axes, 0 for a list */
+	uint32_t reserved;           /*!< unused, 0 */
+};
+
+//!  DictionaryFile class.
+/*!
+  Stores the results of a parameter sweep in chunks. A chunk is mapped into memory while it is simulated,
+  flushed to disk afterwards and only then marked as completed in the header. An interrupted sweep can be
+  resumed by opening the file for writing, the file grows by one chunk at a time.
+  Errors are thrown as std::runtime_error.
+*/
+class DictionaryFile
+{
+public:
+
+	//! Constructor
+	DictionaryFile();
+
+	//! Destructor, closes the file
+	~DictionaryFile();
+
+	//! Create a new dictionary file for a sweep
+	void Create(const std::string &path, ParameterSweep &sweep, const std::vector<unsigned int> &components, const std::vector<unsigned int> &adcs, int normalizationADC, unsigned int chunkSize);
+
+	//! Open an existing dictionary file
+	void Open(const std::string &path, bool writable = false);
+
+	//! Close the file
+	void Close();
+
+	//! Get number of entries
+	unsigned int GetNumberOfEntries();
+
+	//! Get number of entries per chunk
+	unsigned int GetChunkSize();
+
+	//! Get number of chunks
+	unsigned int GetNumberOfChunks();
+
+	//! Get number of completely written chunks
+	unsigned int GetNumberOfCompletedChunks();
+
+	//! Get number of entries in the completed chunks
+	unsigned int GetNumberOfCompletedEntries();
+
+	//! Get stored components of the magnetization vector
+	std::vector<unsigned int>* GetComponents();
+
+	//! Get stored ADC events
+	std::vector<unsigned int>* GetADCs();
+
+	//! Get ADC event the entries are divided by
+	int GetNormalizationADC();
+
+	//! Get the axes of the sweep
+	std::vector<SweepAxis>* GetAxes();
+
+	//! Check if the sweep is a grid
+	bool IsGrid();
+
+	//! Map the next chunk that is not completed yet
+	double* BeginChunk(unsigned int &firstEntry, unsigned int &numEntries);
+
+	//! Flush the current chunk and mark it as completed
+	void CommitChunk();
+
+	//! Get read access to an entry of a completed chunk
+	const double* GetEntry(unsigned int entry);
+
+private:
+
+	//! Memory-mapped part of the file
+	struct Mapping
+	{
+		void* base;     /*!< start of the mapping, aligned to the mapping granularity */
+		size_t length;  /*!< length of the mapping [bytes] */
+		char* data;     /*!< requested start */
+	};
+
+	std::string path;                   /*!< filename */
+	intptr_t file;                      /*!< file descriptor or handle, -1 if no file is open */
+	bool writable;                      /*!< true if the file is open for writing */
+	DictionaryHeader header;            /*!< copy of the fixed-size header */
+	std::vector<unsigned int> components; /*!< stored components */
+	std::vector<unsigned int> adcs;     /*!< stored ADC events */
+	std::vector<SweepAxis> axes;        /*!< axes of the sweep */
+	Mapping chunkMapping;               /*!< chunk that is currently written */
+	unsigned int currentChunk;          /*!< index of the mapped chunk */
+	Mapping readMapping;                /*!< completed entries for read access */
+	unsigned int readMappingEntries;    /*!< number of entries covered by the read mapping */
+
+	//! Get size of an entry [bytes]
+	size_t GetEntrySize();
+
+	//! Write the number of completed chunks to the header in the file
+	void WriteCompletedChunks();
+
+	//! Map a part of the file
+	Mapping Map(uint64_t offset, size_t length, bool write);
+
+	//! Unmap a part of the file
+	void Unmap(Mapping &mapping);
+
+	//! Set the size of the file
+	void Resize(uint64_t size);
+};
@@ -0,0 +1,178 @@
+//!  ParameterSweep.cpp
+/*!
+Variations of the simulation parameters for dictionary simulations
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "ParameterSweep.h"
+
+//! Constructor
+/*!
+	\param base SimulationParameters that are varied, they have to stay valid as long as the sweep is used
+	\param grid true to simulate all combinations of the axes, false to combine the i-th values of all axes
+*/
+ParameterSweep::ParameterSweep(SimulationParameters &base, bool grid)
+{
+	this->base = &base;
+	isGrid = grid;
+}
+
+//! Add an axis
+/*!
+	\param axis parameter, pool and values
+	\return false if the pool does not exist, the parameter does not belong to the pool, the axis has no values
+	        or the number of values differs from the other axes of a list
+*/
+bool ParameterSweep::AddAxis(SweepAxis axis)
+{
+	if (axis.values.empty()) {
+		return false;
+	}
+	if (!isGrid && !axes.empty() && axes[0].values.size() != axis.values.size()) {
+		return false;
+	}
+	bool isScannerParameter = axis.parameter == SweepB0 || axis.parameter == SweepRelB1 || axis.parameter == SweepB0Inhomogeneity;
+	if (isScannerParameter != (axis.pool == SweepScanner)) {
+		return false;
+	}
+	if ((axis.parameter == SweepExchangeRate || axis.parameter == SweepShift) && axis.pool == SweepWaterPool) {
+		return false;
+	}
+	if ((axis.pool == SweepCESTPool && axis.cestPoolIdx >= base->GetNumberOfCESTPools()) || (axis.pool == SweepMTPool && !base->IsMTActive())) {
+		return false;
+	}
+	axes.push_back(axis);
+	return true;
+}
+
+//! Get the axes
+/*!	\return pointer to the vector with all axes */
+std::vector<SweepAxis>* ParameterSweep::GetAxes()
+{
+	return &axes;
+}
+
+//! Check if the sweep is a grid
+/*!	\return true if all combinations of the axes are simulated */
+bool ParameterSweep::IsGrid()
+{
+	return isGrid;
+}
+
+//! Get the base parameters
+/*!	\return pointer to the SimulationParameters that are varied */
+SimulationParameters* ParameterSweep::GetBaseParameters()
+{
+	return base;
+}
+
+//! Get number of entries
+/*!	\return product of the axis lengths for a grid, length of the axes for a list, 1 if there are no axes */
+unsigned int ParameterSweep::GetNumberOfEntries()
+{
+	unsigned int numEntries = 1;
+	for (unsigned int i = 0; i < axes.size(); i++) {
+		if (isGrid) {
+			numEntries *= axes[i].values.size();
+		}
+		else {
+			numEntries = axes[i].values.size();
+		}
+	}
+	return numEntries;
+}
+
+//! Set the parameters of an entry
+/*!
+	sp is overwritten with the base parameters and the values of the entry
+	\param entry index of the entry, the first axis varies fastest in a grid
+	\param sp SimulationParameters object that gets filled
+*/
+void ParameterSweep::ApplyEntry(unsigned int entry, SimulationParameters &sp)
+{
+	sp = *base;
+	for (unsigned int i = 0; i < axes.size(); i++) {
+		unsigned int numValues = axes[i].values.size();
+		unsigned int valueIdx = isGrid ? entry % numValues : entry;
+		this->ApplyValue(axes[i], axes[i].values[valueIdx], sp);
+		if (isGrid) {
+			entry /= numValues;
+		}
+	}
+}
+
+//! Set a single parameter value
+/*!
+	A changed fraction scales the z-magnetization of the pool in the initial magnetization vector
+	\param axis parameter and pool
+	\param value new value of the parameter
+	\param sp SimulationParameters object that gets changed
+*/
+void ParameterSweep::ApplyValue(const SweepAxis &axis, double value, SimulationParameters &sp)
+{
+	// [MxA, MxB, MyA, MyB, MzA, MzB, MzC] -> z-magnetization starts at index 2*numPools
+	unsigned int numPools = sp.GetNumberOfCESTPools() + 1;
+	WaterPool* pool = NULL;
+	unsigned int mzIdx = 0;
+	switch (axis.pool)
+	{
+	case SweepWaterPool:
+		pool = sp.GetWaterPool();
+		mzIdx = numPools * 2;
+		break;
+	case SweepCESTPool:
+		pool = sp.GetCESTPool(axis.cestPoolIdx);
+		mzIdx = numPools * 2 + axis.cestPoolIdx + 1;
+		break;
+	case SweepMTPool:
+		pool = sp.GetMTPool();
+		mzIdx = numPools * 3;
+		break;
+	case SweepScanner:
+		break;
+	}
+	switch (axis.parameter)
+	{
+	case SweepR1:
+		pool->SetR1(value);
+		break;
+	case SweepR2:
+		pool->SetR2(value);
+		break;
+	case SweepFraction: {
+		double &Mz = (*sp.GetInitialMagnetizationVector())(mzIdx);
+		double oldFraction = pool->GetFraction();
+		Mz = (oldFraction != 0.0 && Mz != 0.0) ? Mz * value / oldFraction : value;
+		pool->SetFraction(value);
+		break;
+	}
+	case SweepExchangeRate:
+		static_cast<CESTPool*>(pool)->SetExchangeRateInHz(value);
+		break;
+	case SweepShift:
+		static_cast<CESTPool*>(pool)->SetShiftinPPM(value);
+		break;
+	case SweepB0:
+		sp.InitScanner(value, sp.GetScannerRelB1(), sp.GetScannerB0Inhom(), sp.GetScannerGamma());
+		break;
+	case SweepRelB1:
+		sp.SetScannerRelB1(value);
+		break;
+	case SweepB0Inhomogeneity:
+		sp.SetScannerB0Inhom(value);
+		break;
+	}
+}
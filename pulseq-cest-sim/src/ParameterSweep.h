@@ -0,0 +1,96 @@
+//!  ParameterSweep.h
+/*!
+Variations of the simulation parameters for dictionary simulations
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "SimulationParameters.h"
+
+//! Parameter that is varied along a sweep axis
+enum SweepParameter
+{
+	SweepR1,            // longitudinal relaxation rate of a pool [Hz]
+	SweepR2,            // transversal relaxation rate of a pool [Hz]
+	SweepFraction,      // proton fraction of a pool, the initial magnetization is scaled accordingly
+	SweepExchangeRate,  // exchange rate of a CEST or MT pool [Hz]
+	SweepShift,         // chemical shift of a CEST or MT pool [ppm]
+	SweepB0,            // static field [T]
+	SweepRelB1,         // relative B1
+	SweepB0Inhomogeneity // field inhomogeneity [ppm]
+};
+
+//! Pool of a sweep axis
+enum SweepPool
+{
+	SweepWaterPool,
+	SweepCESTPool,
+	SweepMTPool,
+	SweepScanner   // for B0, relative B1 and B0 inhomogeneity
+};
+
+//! Values of a single parameter
+struct SweepAxis
+{
+	SweepParameter parameter;    /*!< varied parameter */
+	SweepPool pool;              /*!< pool of the parameter */
+	unsigned int cestPoolIdx;    /*!< index of the CEST pool (SweepCESTPool only) */
+	std::vector<double> values;  /*!< values of the parameter */
+};
+
+//!  ParameterSweep class.
+/*!
+  Describes a set of variations of base simulation parameters. The axes are either combined as
+  a grid (all combinations, the first axis varies fastest) or as a list (entry i uses the i-th value of each axis).
+  The entries are not stored, they are applied to a copy of the base parameters on demand.
+*/
+class ParameterSweep
+{
+public:
+
+	//! Constructor
+	ParameterSweep(SimulationParameters &base, bool grid = true);
+
+	//! Default destructor
+	~ParameterSweep() {};
+
+	//! Add an axis
+	bool AddAxis(SweepAxis axis);
+
+	//! Get the axes
+	std::vector<SweepAxis>* GetAxes();
+
+	//! Check if the sweep is a grid
+	bool IsGrid();
+
+	//! Get the base parameters
+	SimulationParameters* GetBaseParameters();
+
+	//! Get number of entries
+	unsigned int GetNumberOfEntries();
+
+	//! Set the parameters of an entry
+	void ApplyEntry(unsigned int entry, SimulationParameters &sp);
+
+private:
+	SimulationParameters* base;   /*!< parameters that are varied */
+	bool isGrid;                  /*!< true for all combinations of the axes, false for a list */
+	std::vector<SweepAxis> axes;  /*!< varied parameters */
+
+	//! Set a single parameter value
+	void ApplyValue(const SweepAxis &axis, double value, SimulationParameters &sp);
+};
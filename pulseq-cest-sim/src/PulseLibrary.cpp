@@ -0,0 +1,114 @@
+//!  PulseLibrary.cpp
+/*!
+Process-wide library of decoded rf pulses that is shared by all simulations
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "PulseLibrary.h"
+#include <cstring>
+
+std::mutex PulseLibrary::libraryMutex;
+std::map<PulseLibrary::PulseKey, std::weak_ptr<const PulseEvent> > PulseLibrary::pulses;
+
+//! Create the key of a pulse
+/*!
+	The samples are hashed with 64 bit FNV-1a, the settings are part of the key because they change the resampled pulse
+	\param amplitudes normalized amplitude of each 1 us sample (without ringdown time)
+	\param phases phase [rad] of each 1 us sample (without ringdown time)
+	\param deadTime dead time before the pulse [s]
+	\param ringdownTime ringdown time after the pulse [s]
+	\param maxSamples max number of pulse samples (SimulationParameters::GetMaxNumberOfPulseSamples)
+	\param maxError error bound of the adaptive resampling (SimulationParameters::GetMaxPulseSampleError)
+	\param maxAmplitude highest amplitude [Hz] the pulse is played out with, only needed for the adaptive resampling
+	\return key of the pulse
+*/
+PulseLibrary::PulseKey PulseLibrary::MakeKey(const std::vector<float> &amplitudes, const std::vector<float> &phases, double deadTime, double ringdownTime,
+	unsigned int maxSamples, double maxError, double maxAmplitude)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (unsigned int i = 0; i < amplitudes.size(); i++) {
+		uint32_t bits[2];
+		std::memcpy(&bits[0], &amplitudes[i], sizeof(float));
+		std::memcpy(&bits[1], &phases[i], sizeof(float));
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(bits);
+		for (unsigned int b = 0; b < sizeof(bits); b++) {
+			hash = (hash ^ bytes[b]) * 1099511628211ULL;
+		}
+	}
+	if (maxError <= 0) {
+		maxAmplitude = 0.0; // the amplitude only matters for the adaptive resampling
+	}
+	else {
+		maxSamples = 0; // the number of samples only matters for the fixed resampling
+	}
+	return std::make_tuple(hash, (unsigned int)amplitudes.size(), deadTime, ringdownTime, maxSamples, maxError, maxAmplitude);
+}
+
+//! Get a pulse from the library
+/*!
+	\param key key of the pulse
+	\return shared pulse, empty if the pulse is not in the library
+*/
+std::shared_ptr<const PulseEvent> PulseLibrary::Find(const PulseKey &key)
+{
+	std::lock_guard<std::mutex> lock(libraryMutex);
+	std::map<PulseKey, std::weak_ptr<const PulseEvent> >::iterator it = pulses.find(key);
+	return it != pulses.end() ? it->second.lock() : std::shared_ptr<const PulseEvent>();
+}
+
+//! Add a pulse to the library
+/*!
+	If another simulation added the same pulse in the meantime, the existing pulse is returned
+	\param key key of the pulse
+	\param pulse decoded pulse
+	\return shared pulse
+*/
+std::shared_ptr<const PulseEvent> PulseLibrary::Insert(const PulseKey &key, const PulseEvent &pulse)
+{
+	std::lock_guard<std::mutex> lock(libraryMutex);
+	std::map<PulseKey, std::weak_ptr<const PulseEvent> >::iterator it = pulses.find(key);
+	std::shared_ptr<const PulseEvent> sharedPulse = it != pulses.end() ? it->second.lock() : std::shared_ptr<const PulseEvent>();
+	if (!sharedPulse) {
+		RemoveExpiredPulses();
+		sharedPulse = std::make_shared<const PulseEvent>(pulse);
+		pulses[key] = sharedPulse;
+	}
+	return sharedPulse;
+}
+
+//! Get the number of pulses in the library
+/*!	\return number of pulses that are used by at least one simulation */
+unsigned int PulseLibrary::GetNumberOfPulses()
+{
+	std::lock_guard<std::mutex> lock(libraryMutex);
+	RemoveExpiredPulses();
+	return pulses.size();
+}
+
+//! Remove the pulses that are not used anymore
+/*!	libraryMutex must be locked by the caller */
+void PulseLibrary::RemoveExpiredPulses()
+{
+	for (std::map<PulseKey, std::weak_ptr<const PulseEvent> >::iterator it = pulses.begin(); it != pulses.end();) {
+		if (it->second.expired()) {
+			it = pulses.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+}
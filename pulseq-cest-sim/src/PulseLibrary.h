@@ -0,0 +1,79 @@
+//!  PulseLibrary.h
+/*!
+Process-wide library of decoded rf pulses that is shared by all simulations
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+//! A single pulse sample for simulation
+struct PulseSample
+{
+	double magnitude;  /*!< pulse sample amplitude [Hz]*/
+	double phase;      /*!< pulse sample phase [rad]*/
+	double timestep;   /*!< pulse sample duration [rad]*/
+};
+
+//! Pulse Event sctruct that contains the parameters important for simulation
+struct PulseEvent
+{
+	double length;                     /*!< pulse duration [us]*/
+	double deadTime;                   /*!< pulse dead time [s]*/
+	double ringdownTime;               /*!< pulse ringdownTime time [s]*/
+	std::vector<PulseSample> samples;  /*!< vector with all pulse amplitude, phase and time samples*/
+};
+
+//!  PulseLibrary class. 
+/*!
+  Pulses are identified by a hash of the raw 1 us amplitude and phase samples, the timing and the resampling settings,
+  independent of the shape ids in the seq file. Identical pulses of all sequences and simulations in the process
+  are therefore decoded and resampled only once and share the same samples. The library only holds weak references,
+  a pulse is freed once no simulation uses it anymore.
+*/
+class PulseLibrary
+{
+public:
+
+	// typedef for a pulse key with the hash and number of the raw samples, dead time, ringdown time, max number of samples, max error and max amplitude
+	typedef std::tuple<uint64_t, unsigned int, double, double, unsigned int, double, double> PulseKey;
+
+	//! Create the key of a pulse
+	static PulseKey MakeKey(const std::vector<float> &amplitudes, const std::vector<float> &phases, double deadTime, double ringdownTime,
+		unsigned int maxSamples, double maxError, double maxAmplitude);
+
+	//! Get a pulse from the library
+	static std::shared_ptr<const PulseEvent> Find(const PulseKey &key);
+
+	//! Add a pulse to the library
+	static std::shared_ptr<const PulseEvent> Insert(const PulseKey &key, const PulseEvent &pulse);
+
+	//! Get the number of pulses in the library
+	static unsigned int GetNumberOfPulses();
+
+private:
+	static std::mutex libraryMutex;                                        /*!< guards the pulses of all simulations */
+	static std::map<PulseKey, std::weak_ptr<const PulseEvent> > pulses;    /*!< pulses that are used by at least one simulation */
+
+	//! Remove the pulses that are not used anymore
+	static void RemoveExpiredPulses();
+};
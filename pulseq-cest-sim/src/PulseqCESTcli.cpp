@@ -0,0 +1,92 @@
+//!  PulseqCESTcli.cpp
+/*!
+Command line interface for Bloch-McConnell pulseq cest simulation without MATLAB
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "BMCSim.h"
+#include "SimulationParametersReader.h"
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+
+//! Writes the magnetization vectors as comma separated values
+/*!
+	Each row is one entry of the magnetization vector, each column one ADC event (same layout as the MATLAB output)
+	\param out output stream
+	\param M MatrixXd containg Magnetization vectors
+*/
+void WriteMagnetizationVectors(std::ostream &out, Eigen::MatrixXd* M)
+{
+	out.precision(std::numeric_limits<double>::max_digits10);
+	for (int y = 0; y < M->rows(); y++) {
+		for (int x = 0; x < M->cols(); x++) {
+			out << (x > 0 ? "," : "") << (*M)(y, x);
+		}
+		out << "\n";
+	}
+}
+
+
+//! Main function of the command line interface
+/*!
+	pulseqcest-cli <.seq file> <.yaml parameter file> [output .csv file]
+	The magnetization vectors are written to stdout if no output file is given
+	\param argc number of arguments
+	\param argv arguments
+	\return 0 on success, 1 otherwise
+*/
+int main(int argc, char *argv[])
+{
+	if (argc < 3 || argc > 4) {
+		std::cerr << "Usage: " << argv[0] << " <seq file> <yaml parameter file> [output csv file]" << std::endl;
+		return 1;
+	}
+	try {
+		SimulationParameters sp;
+		std::vector<std::string> warnings;
+		ReadSimulationParameters(std::string(argv[2]), sp, &warnings);
+		for (size_t i = 0; i < warnings.size(); i++) {
+			std::cerr << "Warning: " << warnings[i] << std::endl;
+		}
+
+		BMCSim simFramework(sp);
+		if (!simFramework.LoadExternalSequence(std::string(argv[1]))) {
+			throw std::runtime_error("Could not read external .seq file");
+		}
+		if (!simFramework.RunSimulation()) {
+			throw std::runtime_error("Simulation failed");
+		}
+
+		if (argc == 4) {
+			std::ofstream out(argv[3]);
+			if (!out) {
+				throw std::runtime_error(std::string("Could not open output file ") + argv[3]);
+			}
+			WriteMagnetizationVectors(out, simFramework.GetMagnetizationVectors());
+		}
+		else {
+			WriteMagnetizationVectors(std::cout, simFramework.GetMagnetizationVectors());
+		}
+	}
+	catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
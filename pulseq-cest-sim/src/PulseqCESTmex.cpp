@@ -20,16 +20,22 @@ WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
 #include "BMCSim.h"
 #include <matrix.h>
 #include <mex.h>
+#include <map>
 
-#define MAX_CEST_POOLS 100
+//! Simulation with its parameters and decoded sequence that stays in memory between mex calls
+struct Simulation
+{
+	SimulationParameters sp;             /*!< parameters of the simulation */
+	std::unique_ptr<BMCSim> simFramework; /*!< simulation framework with the decoded sequence */
+};
 
 // global variables 
-ExternalSequence seq;
-SimulationParameters sp;
-std::unique_ptr<BMCSim> simFramework;
+std::map<unsigned int, std::unique_ptr<Simulation> > simulations; // all initialized simulations, accessed by their handle
+unsigned int nextHandle = 1;   // handle of the next initialized simulation
+unsigned int lastHandle = 0;   // handle of the latest initialized simulation, used if no handle is passed
 
 // determine how the mex function was called
-enum CallMode { INIT, UPDATE, RUN, CLOSE, INVALID };
+enum CallMode { INIT, UPDATE, RUN, STATS, CLOSE, INVALID };
 
 //! Simple class to handle matlab error messages in try, catch block
 class MatlabError 
@@ -44,19 +50,15 @@ public:
 //! Reads the MATLAB input
 /*!
 	Input should be a single struct. The function searches for all required and optional struct parameters
-	\param nrhs number of input arguments
-	\param prhs Array of pointers to the mxArray input arguments
+	\param inStruct mxArray with the input struct
 	\param sp SimulationParameters object that gets filled
-	\param numADCEvents number of ADC events
 */
-void ParseInputStruct(int nrhs, const mxArray *prhs[], SimulationParameters &sp)
+void ParseInputStruct(const mxArray *inStruct, SimulationParameters &sp)
 {
 
-	if (nrhs < 2)
+	if (inStruct == NULL || !mxIsStruct(inStruct))
 		throw(MatlabError("pulseqcestmex:ParseInputStruct", "No input found."));
 
-	//Struct containing everything
-	const mxArray* inStruct = prhs[1];
 
 	//** Magnetization Vector **//
 	if (mxGetField(inStruct, 0, "M") == NULL) {
@@ -169,6 +171,36 @@ void ParseInputStruct(int nrhs, const mxArray *prhs[], SimulationParameters &sp)
 		throw(MatlabError("pulseqcestmex:ParseInputStruct", "Number of Pools does not match with the M vector!"));
 	}
 
+	//** Returned entries of the magnetization vector, e.g. only water Mz **//
+	if (mxGetField(inStruct, 0, "OutputComponents") != NULL) {
+		const mxArray* compIdx = mxGetField(inStruct, 0, "OutputComponents");
+		double* comps = mxGetPr(compIdx);
+		std::vector<unsigned int> components(mxGetNumberOfElements(compIdx));
+		for (unsigned int i = 0; i < components.size(); i++) {
+			if (comps[i] < 1 || comps[i] > Msize) {
+				throw(MatlabError("pulseqcestmex:ParseInputStruct", "OutputComponents must contain indices of the M vector"));
+			}
+			components[i] = (unsigned int)(comps[i]) - 1; // matlab indices start at 1
+		}
+		sp.SetOutputComponents(components);
+	}
+
+	//** Returned ADC events and ADC event for the normalization, e.g. the M0 scan **//
+	if (mxGetField(inStruct, 0, "OutputADCs") != NULL) {
+		const mxArray* adcIdx = mxGetField(inStruct, 0, "OutputADCs");
+		double* adcIn = mxGetPr(adcIdx);
+		std::vector<unsigned int> adcs(mxGetNumberOfElements(adcIdx));
+		for (unsigned int i = 0; i < adcs.size(); i++) {
+			if (adcIn[i] < 1) {
+				throw(MatlabError("pulseqcestmex:ParseInputStruct", "OutputADCs must contain indices of ADC events"));
+			}
+			adcs[i] = (unsigned int)(adcIn[i]) - 1; // matlab indices start at 1
+		}
+		sp.SetOutputADCs(adcs);
+	}
+	if (mxGetField(inStruct, 0, "NormalizationADC") != NULL)
+		sp.SetNormalizationADC(int(*(mxGetPr(mxGetField(inStruct, 0, "NormalizationADC")))) - 1); // 0 disables the normalization
+
 	//** Scanner properties **//
 	if (mxGetField(inStruct, 0, "Scanner") == NULL) {
 		throw(MatlabError("pulseqcestmex:ParseInputStruct", "No Scanner found. \nInput struct must contain a 'Scanner' field!"));
@@ -196,22 +228,54 @@ void ParseInputStruct(int nrhs, const mxArray *prhs[], SimulationParameters &sp)
 	//** Maximum number of pulse samples **//
 	if (mxGetField(inStruct, 0, "MaxPulseSamples") != NULL)
 		sp.SetMaxNumberOfPulseSamples(*(mxGetPr(mxGetField(inStruct, 0, "MaxPulseSamples"))));
-}
 
+	//** Error bound of the adaptive pulse resampling **//
+	if (mxGetField(inStruct, 0, "MaxPulseError") != NULL)
+		sp.SetMaxPulseSampleError(*(mxGetPr(mxGetField(inStruct, 0, "MaxPulseError"))));
 
-//! Returns the final Magnetization vectors for each PPM sample
-/*!
-	\param plhs Array of pointers to the mxArray output arguments
-	\param M MatrixXd containg Magnetization vectors
-*/
-void ReturnResultToMATLAB(mxArray *plhs[], Eigen::MatrixXd* M) {
-	//prepare the output for matlab
-	plhs[0] = mxCreateDoubleMatrix(M->rows(), M->cols(), mxREAL);
-	double *zOut = mxGetPr(plhs[0]);
-	for (int x = 0; x < M->cols(); x++) {
-		for (int y = 0; y < M->rows(); y++) {
-			zOut[y + M->rows()*x] = (*M)(y, x);
+	//** Store the compiled sequence in a cache file **//
+	if (mxGetField(inStruct, 0, "SequenceCache") != NULL)
+		sp.SetUseSequenceCache(*(mxGetPr(mxGetField(inStruct, 0, "SequenceCache"))));
+
+	//** Simulate rf blocks with pre-composed propagators **//
+	if (mxGetField(inStruct, 0, "BlockPropagation") != NULL)
+		sp.SetUseBlockPropagation(*(mxGetPr(mxGetField(inStruct, 0, "BlockPropagation"))));
+
+	//** Number of threads for the simulation of independent ADC segments **//
+	if (mxGetField(inStruct, 0, "NumThreads") != NULL)
+		sp.SetNumberOfThreads(*(mxGetPr(mxGetField(inStruct, 0, "NumThreads"))));
+
+	//** Number of isochromats that are simulated together by the batched solver **//
+	if (mxGetField(inStruct, 0, "BatchLanes") != NULL)
+		sp.SetNumberOfBatchLanes(*(mxGetPr(mxGetField(inStruct, 0, "BatchLanes"))));
+
+	//** Method to solve the Bloch-McConnell equations **//
+	if (mxGetField(inStruct, 0, "PropagationMethod") != NULL) {
+		const int cbuffer = 64;
+		char tempMethod[cbuffer];
+		if (mxGetString(mxGetField(inStruct, 0, "PropagationMethod"), tempMethod, cbuffer) != 0) {
+			throw(MatlabError("pulseqcestmex:ParseInputStruct", "Reading propagation method failed"));
+		}
+		std::string methodString = std::string(tempMethod);
+		if (methodString.compare("Pade") == 0) {
+			sp.SetPropagationMethod(PadePropagation);
+		}
+		else if (methodString.compare("Expmv") == 0) {
+			sp.SetPropagationMethod(ExpmvPropagation);
+		}
+		else {
+			throw(MatlabError("pulseqcestmex:ParseInputStruct", "No valid propagation method! Use Pade or Expmv"));
+		}
+	}
+
+	//** Multiple isochromats for T2* dephasing **//
+	if (mxGetField(inStruct, 0, "isochromats") != NULL) {
+		const mxArray* isoIdx = mxGetField(inStruct, 0, "isochromats");
+		if (mxGetField(isoIdx, 0, "numIsochromats") == NULL || mxGetField(isoIdx, 0, "t2star") == NULL) {
+			throw(MatlabError("pulseqcestmex:ParseInputStruct", "Could not parse arguments of isochromats. Please make sure that the struct contains numIsochromats and t2star"));
 		}
+		sp.SetNumberOfIsochromats(*(mxGetPr(mxGetField(isoIdx, 0, "numIsochromats"))));
+		sp.SetT2Star(*(mxGetPr(mxGetField(isoIdx, 0, "t2star"))));
 	}
 }
 
@@ -241,6 +305,9 @@ CallMode GetCallMode(int nrhs, const mxArray *prhs[])
 		else if (!strcmp("update", tmpCharBuffer)) {
 			mode = UPDATE;
 		}
+		else if (!strcmp("stats", tmpCharBuffer)) {
+			mode = STATS;
+		}
 		else if (!strcmp("close", tmpCharBuffer)) {
 			mode = CLOSE;
 		}
@@ -249,17 +316,104 @@ CallMode GetCallMode(int nrhs, const mxArray *prhs[])
 }
 
 
-//!Initialize All variables
+//! Checks if an input argument is a simulation handle
 /*!
+	\param arg mxArray input argument
+	\return true if arg is a numeric scalar
+*/
+bool IsHandle(const mxArray *arg)
+{
+	return mxIsNumeric(arg) && mxGetNumberOfElements(arg) == 1;
+}
+
+
+//! Gets the simulation for the handle in the input arguments
+/*!
+	Without a handle as second input argument, the latest initialized simulation is used
 	\param nrhs number of input arguments
 	\param prhs Array of pointers to the mxArray input arguments
+	\return iterator to the simulation in the handle table
 */
-void Initialize(int nrhs, const mxArray *prhs[])
+std::map<unsigned int, std::unique_ptr<Simulation> >::iterator GetSimulation(int nrhs, const mxArray *prhs[])
 {
+	unsigned int handle = lastHandle;
+	if (nrhs > 1 && IsHandle(prhs[1])) {
+		handle = (unsigned int)(mxGetScalar(prhs[1]));
+	}
+	std::map<unsigned int, std::unique_ptr<Simulation> >::iterator it = simulations.find(handle);
+	if (it == simulations.end()) {
+		throw(MatlabError("pulseqcestmex:mexFunction", "Invalid handle, the simulation was not initialized or is already closed"));
+	}
+	return it;
+}
+
+
+//! Creates a MATLAB struct with the counters and timers of a simulation
+/*!
+	EventCount and EventTime contain the ADC, spoiler, rf and delay events (in this order),
+	SquaringSteps(j+1) is the number of pade approximations with j squaring steps
+	\param stats counters and timers of the simulation
+	\return mxArray with the struct
+*/
+mxArray* CreateStatsStruct(const SimulationStats &stats)
+{
+	const char* fieldNames[] = { "Enabled", "PadeExponentials", "EigenExponentials", "EigenDecompositions", "SquaringSteps",
+		"ExpmvSteps", "ExpmvProducts", "PropagatorCacheHits", "PropagatorCacheMisses", "BlockPropagatorHits", "BlockPropagatorMisses",
+		"RFSamples", "EventCount", "EventTime", "PulseLibrarySize", "PulseLibrarySamples" };
+	mxArray* out = mxCreateStructMatrix(1, 1, sizeof(fieldNames) / sizeof(fieldNames[0]), fieldNames);
+	mxSetField(out, 0, "Enabled", mxCreateLogicalScalar(SimulationStats::IsEnabled()));
+	mxSetField(out, 0, "PadeExponentials", mxCreateDoubleScalar(double(stats.padeExponentials)));
+	mxSetField(out, 0, "EigenExponentials", mxCreateDoubleScalar(double(stats.eigenExponentials)));
+	mxSetField(out, 0, "EigenDecompositions", mxCreateDoubleScalar(double(stats.eigenDecompositions)));
+	mxArray* squaringSteps = mxCreateDoubleMatrix(1, STATS_MAX_SQUARING_STEPS + 1, mxREAL);
+	for (int j = 0; j <= STATS_MAX_SQUARING_STEPS; j++) {
+		mxGetPr(squaringSteps)[j] = double(stats.squaringSteps[j]);
+	}
+	mxSetField(out, 0, "SquaringSteps", squaringSteps);
+	mxSetField(out, 0, "ExpmvSteps", mxCreateDoubleScalar(double(stats.expmvSteps)));
+	mxSetField(out, 0, "ExpmvProducts", mxCreateDoubleScalar(double(stats.expmvProducts)));
+	mxSetField(out, 0, "PropagatorCacheHits", mxCreateDoubleScalar(double(stats.propagatorCacheHits)));
+	mxSetField(out, 0, "PropagatorCacheMisses", mxCreateDoubleScalar(double(stats.propagatorCacheMisses)));
+	mxSetField(out, 0, "BlockPropagatorHits", mxCreateDoubleScalar(double(stats.blockPropagatorHits)));
+	mxSetField(out, 0, "BlockPropagatorMisses", mxCreateDoubleScalar(double(stats.blockPropagatorMisses)));
+	mxSetField(out, 0, "RFSamples", mxCreateDoubleScalar(double(stats.rfSamples)));
+	mxArray* eventCount = mxCreateDoubleMatrix(1, STATS_NUM_EVENT_KINDS, mxREAL);
+	mxArray* eventTime = mxCreateDoubleMatrix(1, STATS_NUM_EVENT_KINDS, mxREAL);
+	for (int k = 0; k < STATS_NUM_EVENT_KINDS; k++) {
+		mxGetPr(eventCount)[k] = double(stats.eventCount[k]);
+		mxGetPr(eventTime)[k] = stats.eventTime[k];
+	}
+	mxSetField(out, 0, "EventCount", eventCount);
+	mxSetField(out, 0, "EventTime", eventTime);
+	mxSetField(out, 0, "PulseLibrarySize", mxCreateDoubleScalar(double(stats.pulseLibrarySize)));
+	mxSetField(out, 0, "PulseLibrarySamples", mxCreateDoubleScalar(double(stats.pulseLibrarySamples)));
+	return out;
+}
+
+
+//! Frees all simulations if the mex function gets cleared
+void ClearSimulations()
+{
+	simulations.clear();
+	lastHandle = 0;
+}
+
+
+//!Initialize a new simulation
+/*!
+	\param nrhs number of input arguments
+	\param prhs Array of pointers to the mxArray input arguments
+	\return handle of the new simulation
+*/
+unsigned int Initialize(int nrhs, const mxArray *prhs[])
+{
+	if (nrhs < 3 || !mxIsChar(prhs[2]))
+		throw(MatlabError("pulseqcestmex:Initialize", "Initialization needs the parameter struct and the .seq filename"));
+	std::unique_ptr<Simulation> sim(new Simulation);
 	// parse input
-	ParseInputStruct(nrhs, prhs, sp);
+	ParseInputStruct(prhs[1], sim->sp);
 	// init framework
-	simFramework = std::unique_ptr<BMCSim>(new BMCSim(sp));
+	sim->simFramework = std::unique_ptr<BMCSim>(new BMCSim(sim->sp));
 	// get seq filename
 	const int charBufferSize = 2048;
 	char tmpCharBuffer[charBufferSize];
@@ -267,14 +421,23 @@ void Initialize(int nrhs, const mxArray *prhs[])
 	mxGetString(prhs[2], tmpCharBuffer, charBufferSize);
 	std::string seqFileName = std::string(tmpCharBuffer);
 	// set sequence 
-	if (!simFramework->LoadExternalSequence(seqFileName)) {
+	if (!sim->simFramework->LoadExternalSequence(seqFileName)) {
 		throw(MatlabError("pulseqcestmex:Initialize", "Could not read external .seq file"));
 	}
+	// register simulation
+	unsigned int handle = nextHandle++;
+	simulations[handle] = std::move(sim);
+	lastHandle = handle;
+	return handle;
 }
 
 
 //! Enry point for MATLAB mex function
 /*!
+	Each init call returns a handle for a new simulation that stays in memory until it is closed:
+	h = pulseqcestmex('init', PMEX, seq_fn), pulseqcestmex('update', h, PMEX), M = pulseqcestmex('run', h), pulseqcestmex('close', h)
+	S = pulseqcestmex('stats', h) returns the counters and timers of the simulation (with PULSEQCEST_STATS), pulseqcestmex('stats', h, 'reset') also resets them
+	Without the handle, the latest initialized simulation is used. 'close' without a handle closes all simulations.
     \param nlhs number of output arguments
 	\param plhs Array of pointers to the mxArray output arguments
 	\param nrhs number of input arguments
@@ -287,18 +450,62 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 		switch (GetCallMode(nrhs, prhs))
 		{
 		case INIT:
-			mexLock(); // start with locking mex
-			Initialize(nrhs, prhs);
+		{
+			unsigned int handle = Initialize(nrhs, prhs);
+			if (!mexIsLocked()) {
+				mexLock(); // keep the simulations in memory
+			}
+			mexAtExit(ClearSimulations);
+			plhs[0] = mxCreateDoubleScalar(handle);
 			break;
+		}
 		case UPDATE:
-			ParseInputStruct(nrhs, prhs, sp);
+		{
+			Simulation &sim = *GetSimulation(nrhs, prhs)->second;
+			const mxArray *inStruct = (nrhs > 1 && !IsHandle(prhs[1])) ? prhs[1] : (nrhs > 2 ? prhs[2] : NULL); // struct follows the optional handle
+			ParseInputStruct(inStruct, sim.sp);
 			break;
+		}
 		case RUN:
-			simFramework->RunSimulation();
-			ReturnResultToMATLAB(plhs, simFramework->GetMagnetizationVectors());
+		{
+			Simulation &sim = *GetSimulation(nrhs, prhs)->second;
+			// the simulation writes the magnetization vectors directly to the output array
+			plhs[0] = mxCreateUninitNumericMatrix(sim.sp.GetNumberOfOutputComponents(), sim.simFramework->GetNumberOfOutputADCs(), mxDOUBLE_CLASS, mxREAL);
+			sim.simFramework->SetOutputBuffer(mxGetPr(plhs[0]));
+			bool success = sim.simFramework->RunSimulation();
+			sim.simFramework->SetOutputBuffer(NULL);
+			if (!success) {
+				mxDestroyArray(plhs[0]);
+				throw(MatlabError("pulseqcestmex:mexFunction", "Simulation failed, please check OutputComponents, OutputADCs and NormalizationADC"));
+			}
+			break;
+		}
+		case STATS:
+		{
+			// the counters are reset with pulseqcestmex('stats', h, 'reset')
+			Simulation &sim = *GetSimulation(nrhs, prhs)->second;
+			plhs[0] = CreateStatsStruct(sim.simFramework->GetStats());
+			const mxArray *option = (nrhs > 1 && !IsHandle(prhs[1])) ? prhs[1] : (nrhs > 2 ? prhs[2] : NULL); // option follows the optional handle
+			if (option != NULL && mxIsChar(option)) {
+				const int charBufferSize = 64;
+				char tmpCharBuffer[charBufferSize];
+				mxGetString(option, tmpCharBuffer, charBufferSize);
+				if (strcmp("reset", tmpCharBuffer)) {
+					mxDestroyArray(plhs[0]);
+					throw(MatlabError("pulseqcestmex:mexFunction", "Invalid stats option, only 'reset' is supported"));
+				}
+				sim.simFramework->ResetStats();
+			}
 			break;
+		}
 		case CLOSE:
-			if (mexIsLocked()) {
+			if (nrhs > 1) {
+				simulations.erase(GetSimulation(nrhs, prhs));
+			}
+			else {
+				ClearSimulations();
+			}
+			if (simulations.empty() && mexIsLocked()) {
 				mexUnlock();
 			}
 			break;
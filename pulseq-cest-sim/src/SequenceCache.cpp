@@ -0,0 +1,175 @@
+//!  SequenceCache.cpp
+/*!
+Binary image of a compiled sequence for fast repeated loading
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "SequenceCache.h"
+#include <cstdio>
+#include <fstream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//! Constructor
+SequenceCache::SequenceCache()
+{
+	data = NULL;
+	size = 0;
+}
+
+//! Destructor, unmaps the file
+SequenceCache::~SequenceCache()
+{
+	this->Unmap();
+}
+
+//! Map a cache file read-only
+/*!
+	\param path filename
+	\return false if the file does not exist or could not be mapped
+*/
+bool SequenceCache::Map(const std::string &path)
+{
+	this->Unmap();
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+		HANDLE fileMapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (fileMapping != NULL) {
+			data = MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+			size = size_t(fileSize.QuadPart);
+			CloseHandle(fileMapping); // the view keeps the mapping alive
+		}
+	}
+	CloseHandle(file);
+#else
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(file, &st) == 0 && st.st_size > 0) {
+		data = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_SHARED, file, 0);
+		size = size_t(st.st_size);
+		if (data == MAP_FAILED) {
+			data = NULL;
+		}
+	}
+	close(file); // the mapping stays valid
+#endif
+	if (data == NULL) {
+		size = 0;
+	}
+	return data != NULL;
+}
+
+//! Unmap the file
+void SequenceCache::Unmap()
+{
+	if (data != NULL) {
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap(data, size);
+#endif
+		data = NULL;
+		size = 0;
+	}
+}
+
+//! Get the mapped data
+/*!	\return start of the file, NULL if no file is mapped */
+const char* SequenceCache::GetData()
+{
+	return static_cast<const char*>(data);
+}
+
+//! Get the size of the mapped data
+/*!	\return size of the file [bytes] */
+size_t SequenceCache::GetSize()
+{
+	return size;
+}
+
+//! Write a cache file
+/*!
+	The buffer is written to a temporary file that replaces the cache file afterwards,
+	so other processes never map a partly written file
+	\param path filename
+	\param buffer content of the file
+	\return false if the file could not be written, e.g. in a read-only folder
+*/
+bool SequenceCache::Write(const std::string &path, const std::vector<char> &buffer)
+{
+	std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream out(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+		if (!out.write(buffer.data(), buffer.size())) {
+			out.close();
+			std::remove(tmpPath.c_str());
+			return false;
+		}
+	}
+#ifdef _WIN32
+	std::remove(path.c_str()); // rename does not replace existing files on windows
+#endif
+	if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+		std::remove(tmpPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+//! Hash the content of a file
+/*!
+	64 bit FNV-1a hash, reading the file is much faster than parsing it
+	\param path filename
+	\param hash hash of the content
+	\param size size of the file [bytes]
+	\return false if the file could not be read
+*/
+bool SequenceCache::HashFile(const std::string &path, uint64_t &hash, uint64_t &size)
+{
+	std::ifstream in(path.c_str(), std::ios::binary);
+	if (!in) {
+		return false;
+	}
+	hash = 14695981039346656037ULL;
+	size = 0;
+	std::vector<char> chunk(1 << 16);
+	while (in) {
+		in.read(chunk.data(), chunk.size());
+		std::streamsize numRead = in.gcount();
+		for (std::streamsize i = 0; i < numRead; i++) {
+			hash = (hash ^ (unsigned char)(chunk[i])) * 1099511628211ULL;
+		}
+		size += uint64_t(numRead);
+	}
+	return in.eof();
+}
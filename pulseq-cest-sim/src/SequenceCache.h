@@ -0,0 +1,104 @@
+//!  SequenceCache.h
+/*!
+Binary image of a compiled sequence for fast repeated loading
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define SEQUENCE_CACHE_VERSION 1 // version of the sequence cache file layout
+
+//! Fixed-size part of the sequence cache file header
+/*!
+	The header is followed by the simulation events (raw SimulationEvent structs), the first event (uint32) and the
+	accumulated rf phase (float) of each ADC segment, the shape ids (3 x int32) and pulse index (uint32) of each unique pulse
+	and the pulses (SequenceCachePulse followed by numSamples x PulseSample each).
+	All values are stored in the native byte order, the file is only valid for the build that wrote it.
+*/
+struct SequenceCacheHeader
+{
+	char magic[8];               /*!< "PQCSEQC" */
+	uint32_t version;            /*!< SEQUENCE_CACHE_VERSION */
+	uint32_t eventSize;          /*!< sizeof(SimulationEvent) */
+	uint64_t seqFileSize;        /*!< size of the .seq file [bytes] */
+	uint64_t seqFileHash;        /*!< hash of the .seq file */
+	uint32_t maxPulseSamples;    /*!< SimulationParameters::GetMaxNumberOfPulseSamples, 0 with adaptive resampling */
+	uint32_t numEvents;          /*!< number of simulation events */
+	double maxPulseError;        /*!< SimulationParameters::GetMaxPulseSampleError */
+	double relB1;                /*!< relative B1 of the adaptive resampling, 0 without adaptive resampling */
+	uint32_t numADCs;            /*!< number of ADC events */
+	uint32_t numSegments;        /*!< number of ADC segments (numADCs + 1) */
+	uint32_t numPulseIDs;        /*!< number of shape id tuples */
+	uint32_t numPulses;          /*!< number of unique pulses */
+};
+
+//! Pulse record of the sequence cache file
+struct SequenceCachePulse
+{
+	uint64_t hash;               /*!< hash of the raw samples (PulseLibrary key) */
+	uint32_t numRawSamples;      /*!< number of the raw samples (PulseLibrary key) */
+	uint32_t maxSamples;         /*!< max number of samples (PulseLibrary key) */
+	double deadTime;             /*!< dead time [s] */
+	double ringdownTime;         /*!< ringdown time [s] */
+	double maxError;             /*!< error bound of the adaptive resampling (PulseLibrary key) */
+	double maxAmplitude;         /*!< highest amplitude [Hz] (PulseLibrary key) */
+	double length;               /*!< pulse duration [us] */
+	uint32_t numSamples;         /*!< number of samples that follow the record */
+	uint32_t reserved;           /*!< padding */
+};
+
+//!  SequenceCache class. 
+/*!
+  Maps a sequence cache file read-only and writes new cache files.
+  BMCSim::WriteSequenceCache and BMCSim::ReadSequenceCache serialize the compiled sequence.
+*/
+class SequenceCache
+{
+public:
+
+	//! Constructor
+	SequenceCache();
+
+	//! Destructor, unmaps the file
+	~SequenceCache();
+
+	//! Map a cache file read-only
+	bool Map(const std::string &path);
+
+	//! Unmap the file
+	void Unmap();
+
+	//! Get the mapped data
+	const char* GetData();
+
+	//! Get the size of the mapped data [bytes]
+	size_t GetSize();
+
+	//! Write a cache file
+	static bool Write(const std::string &path, const std::vector<char> &buffer);
+
+	//! Hash the content of a file
+	static bool HashFile(const std::string &path, uint64_t &hash, uint64_t &size);
+
+private:
+	void* data;     /*!< start of the mapping, NULL if no file is mapped */
+	size_t size;    /*!< length of the mapping [bytes] */
+};
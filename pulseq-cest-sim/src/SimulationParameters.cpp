@@ -180,8 +180,21 @@ double MTPool::GetMTLineAtCurrentOffset(double offset, double omega0)
 	\return lineshape of MT pool
 */
 double MTPool::InterpolateSuperLorentzianShape(double dw)
+{
+	double derivative;
+	return InterpolateSuperLorentzianShape(dw, derivative);
+}
+
+//! Calculate the SuperLorentzian Lineshape and its derivative
+/*!
+	\param dw frequency offset between rf pulse and offset of MT pool [rad]
+	\param derivative derivative of the lineshape with respect to dw
+	\return lineshape of MT pool
+*/
+double MTPool::InterpolateSuperLorentzianShape(double dw, double &derivative)
 {
 	double mtLine = 0.0;
+	derivative = 0.0;
 	double T2 = 1 / R2;
 	int numberOfIntegrationSamples = 101; // number of
 	double integrationSampleStepSize = 0.01;
@@ -189,8 +202,11 @@ double MTPool::InterpolateSuperLorentzianShape(double dw)
 	for (int i = 0; i < numberOfIntegrationSamples; i++)
 	{
 		double powcu2 = abs(3.0 * pow(integrationSampleStepSize*double(i), 2.0) - 1.0); // helper variable
-		mtLine += sqrt_2_pi * T2 / powcu2 * exp(-2.0 * pow(dw * T2 / powcu2, 2.0)); // add to integrate
+		double sample = sqrt_2_pi * T2 / powcu2 * exp(-2.0 * pow(dw * T2 / powcu2, 2.0));
+		mtLine += sample; // add to integrate
+		derivative -= 4.0 * dw * pow(T2 / powcu2, 2.0) * sample; // d/ddw of the exponential
 	}
+	derivative *= (M_PI * integrationSampleStepSize);
 	return mtLine * (M_PI * integrationSampleStepSize); // final line
 }
 
@@ -201,7 +217,7 @@ double MTPool::InterpolateSuperLorentzianShape(double dw)
 	\param py vector with the y postion of the 4 grid points of the spline
 	\return lineshape of MT pool, 0.0 if non-valid input
 */
-double MTPool::CubicHermiteSplineInterpolation(double px_int, std::vector<double> px, std::vector<double> py)
+double MTPool::CubicHermiteSplineInterpolation(double px_int, const std::vector<double> &px, const std::vector<double> &py)
 {
 	if (px.size() != 4 || py.size() != 4)
 		return 0.0;
@@ -230,6 +246,121 @@ double MTPool::CubicHermiteSplineInterpolation(double px_int, std::vector<double
 
 
 
+// MT Lineshape Table Function Definitions ////
+
+//! Default Constructor
+MTLineshapeTable::MTLineshapeTable() : w0(0), initialized(false), minOffset(0), step(0) {}
+
+//! Default destructor
+MTLineshapeTable::~MTLineshapeTable() {}
+
+//! Build the table for a MT pool and larmor frequency
+/*!
+	The table is only rebuilt if the lineshape, R2, chemical shift or larmor frequency changed.
+	The grid starts with 257 samples and the number of intervals is doubled until the hermite
+	spline at the center of each interval matches the exact lineshape
+	\param mtPool MT pool
+	\param omega0 larmor frequency
+*/
+void MTLineshapeTable::Init(MTPool &mtPool, double omega0)
+{
+	if (initialized && pool.GetMTLineShape() == mtPool.GetMTLineShape() && pool.GetR2() == mtPool.GetR2()
+		&& pool.GetShiftinPPM() == mtPool.GetShiftinPPM() && w0 == omega0) {
+		pool = mtPool; // other parameters do not affect the table
+		return;
+	}
+	pool = mtPool;
+	w0 = omega0;
+	initialized = true;
+	values.clear();
+	derivatives.clear();
+	if (pool.GetMTLineShape() != SuperLorentzian || omega0 <= 0.0) {
+		return; // nothing to tabulate
+	}
+
+	// grid points of the spline in the pole region, see MTPool::GetMTLineAtCurrentOffset
+	poleX = { -300 - omega0, -100 - omega0, 100 + omega0, 300 + omega0 };
+	poleY.resize(poleX.size());
+	for (unsigned int i = 0; i < poleX.size(); i++) {
+		poleY[i] = pool.InterpolateSuperLorentzianShape(poleX[i]);
+	}
+
+	// the lineshape is symmetric, so only positive offsets are tabulated
+	minOffset = omega0; // empirical cutoff of the pole region is 1 ppm
+	double range = (MT_LINESHAPE_TABLE_RANGE_PPM - 1.0) * omega0;
+	unsigned int numSamples = 257;
+	step = range / (numSamples - 1);
+	values.resize(numSamples);
+	derivatives.resize(numSamples);
+	for (unsigned int i = 0; i < numSamples; i++) {
+		values[i] = pool.InterpolateSuperLorentzianShape(minOffset + i * step, derivatives[i]);
+	}
+	std::vector<double> midValues, midDerivatives;
+	while (true) {
+		// exact lineshape at the center of each interval
+		double maxValue = 0.0;
+		double maxError = 0.0;
+		midValues.resize(numSamples - 1);
+		midDerivatives.resize(numSamples - 1);
+		for (unsigned int i = 0; i < numSamples - 1; i++) {
+			midValues[i] = pool.InterpolateSuperLorentzianShape(minOffset + (i + 0.5) * step, midDerivatives[i]);
+			double spline = 0.5 * (values[i] + values[i + 1]) + 0.125 * step * (derivatives[i] - derivatives[i + 1]); // hermite spline at t = 0.5
+			maxError = std::max(maxError, std::abs(spline - midValues[i]));
+			maxValue = std::max(maxValue, std::abs(values[i]));
+		}
+		if (maxError <= MT_LINESHAPE_TABLE_TOLERANCE * maxValue || 2 * numSamples - 1 > MT_LINESHAPE_TABLE_MAX_SAMPLES) {
+			break;
+		}
+		// refine the grid, the centers become new samples
+		std::vector<double> newValues(2 * numSamples - 1), newDerivatives(2 * numSamples - 1);
+		for (unsigned int i = 0; i < numSamples; i++) {
+			newValues[2 * i] = values[i];
+			newDerivatives[2 * i] = derivatives[i];
+			if (i < numSamples - 1) {
+				newValues[2 * i + 1] = midValues[i];
+				newDerivatives[2 * i + 1] = midDerivatives[i];
+			}
+		}
+		values.swap(newValues);
+		derivatives.swap(newDerivatives);
+		numSamples = values.size();
+		step *= 0.5;
+	}
+}
+
+//! Get the MT parameter at the current offset
+/*!
+	Same as MTPool::GetMTLineAtCurrentOffset for the MT pool and larmor frequency of the table
+	\param offset frequency offset of rf pulse
+	\return Rrfb/(w1^2) of MT pool
+*/
+double MTLineshapeTable::GetMTLineAtCurrentOffset(double offset)
+{
+	if (values.empty()) {
+		return pool.GetMTLineAtCurrentOffset(offset, w0);
+	}
+	double dwPool = offset - pool.GetShiftinPPM() * w0;
+	double absDw = std::abs(dwPool);
+	if (absDw < minOffset) { // pole region
+		return pool.CubicHermiteSplineInterpolation(dwPool, poleX, poleY);
+	}
+	double x = (absDw - minOffset) / step;
+	unsigned int i = (unsigned int)(x);
+	if (x >= double(values.size() - 1)) { // outside of the table
+		return pool.InterpolateSuperLorentzianShape(absDw);
+	}
+	// cubic hermite spline between sample i and i+1
+	double c = x - i;
+	double c2 = c * c;
+	double c3 = c2 * c;
+	double h0 = 2 * c3 - 3 * c2 + 1;
+	double h1 = -2 * c3 + 3 * c2;
+	double h2 = c3 - 2 * c2 + c;
+	double h3 = c3 - c2;
+	return h0 * values[i] + h1 * values[i + 1] + step * (h2 * derivatives[i] + h3 * derivatives[i + 1]);
+}
+
+
 // Simulation Parameters Function Definitions ////
 
 //! Constructor
@@ -239,6 +370,15 @@ SimulationParameters::SimulationParameters()
 	verboseMode = false;
 	useInitMagnetization = true;
 	maxNumberOfPulseSamples = 100;
+	maxPulseSampleError = 0.0;
+	useSequenceCache = false;
+	useBlockPropagation = false;
+	numberOfThreads = 1;
+	numberOfIsochromats = 1;
+	t2Star = 0.0;
+	numberOfBatchLanes = 1;
+	propagationMethod = PadePropagation;
+	normalizationADC = -1;
 	InitScanner(0.0);
 }
 
@@ -448,3 +588,208 @@ unsigned int SimulationParameters::GetMaxNumberOfPulseSamples()
 	return maxNumberOfPulseSamples;
 }
 
+//! Set the error bound of the adaptive pulse resampling
+/*!
+	If the bound is > 0, adjacent pulse samples are merged to piecewise-constant segments as long as
+	the rf rotation of the resampled pulse deviates by less than maxError from the original pulse.
+	maxNumberOfPulseSamples is ignored in this case.
+	\param maxError max rotation error [rad] of a resampled pulse, 0 to use maxNumberOfPulseSamples (default)
+*/
+void SimulationParameters::SetMaxPulseSampleError(double maxError)
+{
+	maxPulseSampleError = maxError;
+}
+
+//! Get the error bound of the adaptive pulse resampling
+/*!	\return max rotation error [rad] of a resampled pulse, 0 if the pulses are resampled to maxNumberOfPulseSamples */
+double SimulationParameters::GetMaxPulseSampleError()
+{
+	return maxPulseSampleError;
+}
+
+//! Set use of the sequence cache file
+/*!
+	If true, BMCSim::LoadExternalSequence stores the compiled sequence in <seq file>.simcache and
+	loads it from there as long as the .seq file and the pulse resampling settings did not change
+	\param useCache true to use the cache file (default = false)
+*/
+void SimulationParameters::SetUseSequenceCache(bool useCache)
+{
+	useSequenceCache = useCache;
+}
+
+//! Get use of the sequence cache file
+/*!	\return true if the compiled sequence is stored in a cache file */
+bool SimulationParameters::GetUseSequenceCache()
+{
+	return useSequenceCache;
+}
+
+//! Set use of block propagators
+/*!
+	True, if each rf block (dead time, pulse samples, ringdown time and the following delay)
+	should be pre-composed to a single propagator. Consecutive identical blocks are then
+	applied without simulating the single pulse samples again.
+	\param blockProp true if block propagators should be used
+*/
+void SimulationParameters::SetUseBlockPropagation(bool blockProp)
+{
+	useBlockPropagation = blockProp;
+}
+
+//! Get use of block propagators
+/*!	\return true if rf blocks are simulated with block propagators */
+bool SimulationParameters::GetUseBlockPropagation()
+{
+	return useBlockPropagation;
+}
+
+//! Set number of threads
+/*!
+	If the magnetization is reset after each ADC, the ADC segments
+	and multiple isochromats are simulated in parallel with this number of threads
+	\param nThreads number of threads, 0 uses all available cores
+*/
+void SimulationParameters::SetNumberOfThreads(unsigned int nThreads)
+{
+	numberOfThreads = nThreads;
+}
+
+//! Get number of threads
+/*!	\return number of threads, 0 means all available cores */
+unsigned int SimulationParameters::GetNumberOfThreads()
+{
+	return numberOfThreads;
+}
+
+//! Set number of isochromats
+/*!
+	For more than one isochromat, the simulation is repeated for spins with
+	a Lorentzian off-resonance distribution given by T2* and the mean
+	magnetization is returned
+	\param nIsochromats number of isochromats
+*/
+void SimulationParameters::SetNumberOfIsochromats(unsigned int nIsochromats)
+{
+	numberOfIsochromats = nIsochromats;
+}
+
+//! Get number of isochromats
+/*!	\return number of isochromats */
+unsigned int SimulationParameters::GetNumberOfIsochromats()
+{
+	return numberOfIsochromats;
+}
+
+//! Set T2* for the isochromat distribution
+/*!	\param t2s T2* [s] */
+void SimulationParameters::SetT2Star(double t2s)
+{
+	t2Star = t2s;
+}
+
+//! Get T2* for the isochromat distribution
+/*!	\return T2* [s] */
+double SimulationParameters::GetT2Star()
+{
+	return t2Star;
+}
+
+//! Set number of batch lanes
+/*!
+	For more than one lane, multiple isochromats are simulated together by
+	the vectorized BatchedBlochMcConnellSolver. This is not used in combination
+	with block propagation.
+	\param nLanes number of isochromats per batch, 1 uses the standard solver
+*/
+void SimulationParameters::SetNumberOfBatchLanes(unsigned int nLanes)
+{
+	numberOfBatchLanes = nLanes;
+}
+
+//! Get number of batch lanes
+/*!	\return number of isochromats per batch */
+unsigned int SimulationParameters::GetNumberOfBatchLanes()
+{
+	return numberOfBatchLanes;
+}
+
+//! Set propagation method
+/*!
+	PadePropagation calculates and caches the full propagator exp(A*t) for each time step.
+	ExpmvPropagation calculates exp(A*t)*M directly, which needs no propagator cache and
+	scales linearly with the number of pools. It is used for more than three CEST pools.
+	\param method PropagationMethod
+*/
+void SimulationParameters::SetPropagationMethod(PropagationMethod method)
+{
+	propagationMethod = method;
+}
+
+//! Get propagation method
+/*!	\return PropagationMethod */
+PropagationMethod SimulationParameters::GetPropagationMethod()
+{
+	return propagationMethod;
+}
+
+//! Set the components of the magnetization vector that are returned
+/*!
+	Only these entries of the magnetization vector are written at each ADC event, e.g. only the water Mz
+	at index 2*(number of CEST pools + 1). Fewer components reduce the memory of the results.
+	\param components indices of the magnetization vector entries, empty for the full vector
+*/
+void SimulationParameters::SetOutputComponents(std::vector<unsigned int> components)
+{
+	outputComponents = components;
+}
+
+//! Get the components of the magnetization vector that are returned
+/*!	\return pointer to the indices of the returned magnetization vector entries, empty for the full vector */
+std::vector<unsigned int>* SimulationParameters::GetOutputComponents()
+{
+	return &outputComponents;
+}
+
+//! Get number of rows of the returned magnetization vectors
+/*!	\return number of selected components or the size of the magnetization vector if none are selected */
+unsigned int SimulationParameters::GetNumberOfOutputComponents()
+{
+	return outputComponents.empty() ? M.rows() : outputComponents.size();
+}
+
+//! Set the ADC events that are returned
+/*!
+	Only the magnetization at these ADC events is stored, in the given order.
+	If the magnetization is reset after each ADC, the other ADC segments are not simulated at all.
+	\param adcs indices of the ADC events, empty for all
+*/
+void SimulationParameters::SetOutputADCs(std::vector<unsigned int> adcs)
+{
+	outputADCs = adcs;
+}
+
+//! Get the ADC events that are returned
+/*!	\return pointer to the indices of the returned ADC events, empty for all */
+std::vector<unsigned int>* SimulationParameters::GetOutputADCs()
+{
+	return &outputADCs;
+}
+
+//! Set the ADC event that normalizes the returned magnetization vectors
+/*!
+	Each returned component is divided by its value at this ADC event, e.g. the M0 scan of a Z-spectrum.
+	The ADC event does not need to be part of the returned ADC events.
+	\param adc index of the ADC event, -1 for no normalization
+*/
+void SimulationParameters::SetNormalizationADC(int adc)
+{
+	normalizationADC = adc;
+}
+
+//! Get the ADC event that normalizes the returned magnetization vectors
+/*!	\return index of the ADC event, -1 for no normalization */
+int SimulationParameters::GetNormalizationADC()
+{
+	return normalizationADC;
+}
@@ -30,6 +30,12 @@ WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
 #define M_PI 3.14159265358979323846
 #endif // !M_PI
 
+#define MAX_CEST_POOLS 100 // max number of CEST pools that can be simulated
+
+#define MT_LINESHAPE_TABLE_TOLERANCE 1e-6  // max interpolation error of the MT lineshape table relative to the largest tabulated value
+#define MT_LINESHAPE_TABLE_RANGE_PPM 500.0 // the MT lineshape table covers offsets up to this distance from the MT pool
+#define MT_LINESHAPE_TABLE_MAX_SAMPLES 65537 // upper limit for the number of samples of the MT lineshape table
+
 //! Scanner related info
 struct Scanner
 {
@@ -48,6 +54,13 @@ enum MTLineshape
 	None
 };
 
+//! Method to solve the Bloch-McConnell equations
+enum PropagationMethod
+{
+	PadePropagation,  // cached propagators exp(A*t) calculated with the pade approximation
+	ExpmvPropagation  // exp(A*t)*M calculated directly with a truncated taylor series (more than three CEST pools only)
+};
+
 //!  Water Pool class. 
 /*!
   Class containing  relaxation parameters and fraction of Pools
@@ -154,17 +167,58 @@ public:
 	double GetMTLineAtCurrentOffset(double offset, double omega0);
 
 private:
+	friend class MTLineshapeTable;
 
 	//! Calculate the SuperLorentzian Lineshape
 	double InterpolateSuperLorentzianShape(double dw);
 
+	//! Calculate the SuperLorentzian Lineshape and its derivative
+	double InterpolateSuperLorentzianShape(double dw, double &derivative);
+
 	//! Spline interpolation to avoid pol in superlorentzian lineshape function
-	double CubicHermiteSplineInterpolation(double px_int, std::vector<double> px, std::vector<double> py);
+	double CubicHermiteSplineInterpolation(double px_int, const std::vector<double> &px, const std::vector<double> &py);
 
 	MTLineshape ls; /*!< MT lineshape */
 };
 
 
+//!  MT lineshape table class. 
+/*!
+  Lookup table of the lineshape of a MT pool for a fixed R2, chemical shift and larmor frequency.
+  The SuperLorentzian lineshape outside of the pole region is interpolated with cubic hermite splines
+  from exact values and derivatives. The grid is refined until the interpolation error is below MT_LINESHAPE_TABLE_TOLERANCE.
+  The spline in the pole region is evaluated from precomputed grid points.
+  Other lineshapes are cheap and are not tabulated
+*/
+class MTLineshapeTable
+{
+public:
+
+	//! Default Constructor
+	MTLineshapeTable();
+
+	//! Default destructor
+	~MTLineshapeTable();
+
+	//! Build the table for a MT pool and larmor frequency
+	void Init(MTPool &mtPool, double omega0);
+
+	//! Get the MT parameter at the current offset
+	double GetMTLineAtCurrentOffset(double offset);
+
+private:
+	MTPool pool;          /*!< MT pool the table was built for */
+	double w0;            /*!< larmor frequency the table was built for [rad] */
+	bool initialized;     /*!< true if the table was built */
+	double minOffset;     /*!< distance from the MT pool of the first sample [rad] */
+	double step;          /*!< distance between samples [rad] */
+	std::vector<double> values;      /*!< lineshape at the samples */
+	std::vector<double> derivatives; /*!< derivative of the lineshape at the samples */
+	std::vector<double> poleX;       /*!< x position of the spline grid points in the pole region */
+	std::vector<double> poleY;       /*!< y position of the spline grid points in the pole region */
+};
+
+
 
 //!  SimulationParameters class. 
 /*!
@@ -255,6 +309,75 @@ public: // TODO: write get and set methods for member variables and make them pr
 	//! Get number of max pulse samples
 	unsigned int GetMaxNumberOfPulseSamples();
 
+	//! Set the error bound of the adaptive pulse resampling
+	void SetMaxPulseSampleError(double maxError);
+
+	//! Get the error bound of the adaptive pulse resampling
+	double GetMaxPulseSampleError();
+
+	//! Set use of the sequence cache file
+	void SetUseSequenceCache(bool useCache);
+
+	//! Get use of the sequence cache file
+	bool GetUseSequenceCache();
+
+	//! Set use of block propagators
+	void SetUseBlockPropagation(bool blockProp);
+
+	//! Get use of block propagators
+	bool GetUseBlockPropagation();
+
+	//! Set number of threads
+	void SetNumberOfThreads(unsigned int nThreads);
+
+	//! Get number of threads
+	unsigned int GetNumberOfThreads();
+
+	//! Set number of isochromats
+	void SetNumberOfIsochromats(unsigned int nIsochromats);
+
+	//! Get number of isochromats
+	unsigned int GetNumberOfIsochromats();
+
+	//! Set T2* for the isochromat distribution
+	void SetT2Star(double t2s);
+
+	//! Get T2* for the isochromat distribution
+	double GetT2Star();
+
+	//! Set number of batch lanes
+	void SetNumberOfBatchLanes(unsigned int nLanes);
+
+	//! Get number of batch lanes
+	unsigned int GetNumberOfBatchLanes();
+
+	//! Set propagation method
+	void SetPropagationMethod(PropagationMethod method);
+
+	//! Get propagation method
+	PropagationMethod GetPropagationMethod();
+
+	//! Set the components of the magnetization vector that are returned
+	void SetOutputComponents(std::vector<unsigned int> components);
+
+	//! Get the components of the magnetization vector that are returned
+	std::vector<unsigned int>* GetOutputComponents();
+
+	//! Get number of rows of the returned magnetization vectors
+	unsigned int GetNumberOfOutputComponents();
+
+	//! Set the ADC events that are returned
+	void SetOutputADCs(std::vector<unsigned int> adcs);
+
+	//! Get the ADC events that are returned
+	std::vector<unsigned int>* GetOutputADCs();
+
+	//! Set the ADC event that normalizes the returned magnetization vectors
+	void SetNormalizationADC(int adc);
+
+	//! Get the ADC event that normalizes the returned magnetization vectors
+	int GetNormalizationADC();
+
 
 protected:
 
@@ -270,6 +393,17 @@ protected:
 	bool verboseMode;                      /*!< true, if you want to have some output information */
 	bool useInitMagnetization;             /*!< true, if the magnetization vector should be reset to the initial magnetization after each adc */
 	unsigned int maxNumberOfPulseSamples;  /*!< number of pulse samples for shaped pulses */
+	double maxPulseSampleError;            /*!< max rotation error [rad] of adaptively resampled pulses, 0 to use maxNumberOfPulseSamples */
+	bool useSequenceCache;                 /*!< true, if the compiled sequence should be stored in and loaded from a cache file next to the .seq file */
+	bool useBlockPropagation;              /*!< true, if rf blocks should be simulated with a single pre-composed propagator */
+	unsigned int numberOfThreads;          /*!< number of threads for the simulation, 0 uses all cores */
+	unsigned int numberOfIsochromats;      /*!< number of isochromats for the T2* simulation */
+	double t2Star;                         /*!< T2* of the isochromat distribution [s] */
+	unsigned int numberOfBatchLanes;       /*!< number of isochromats that are simulated together by the batched solver */
+	PropagationMethod propagationMethod;   /*!< method to solve the Bloch-McConnell equations */
+	std::vector<unsigned int> outputComponents; /*!< indices of the returned entries of the magnetization vector, empty for all */
+	std::vector<unsigned int> outputADCs;       /*!< indices of the returned ADC events, empty for all */
+	int normalizationADC;                       /*!< index of the ADC event the output gets divided by (e.g. M0 scan), -1 for none */
 
 };
 
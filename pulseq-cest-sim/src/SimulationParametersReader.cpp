@@ -0,0 +1,305 @@
+//!  SimulationParametersReader.cpp
+/*!
+Reads the simulation parameters from a yaml file, C++ equivalent of readSimulationParameters.m
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "SimulationParametersReader.h"
+#include "ThreadPool.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+
+//! Adds a warning to the list
+/*!
+	\param warnings list of warnings, can be NULL
+	\param msg warning message
+*/
+static void AddWarning(std::vector<std::string> *warnings, const std::string &msg)
+{
+	if (warnings != NULL) {
+		warnings->push_back(msg);
+	}
+}
+
+//! Checks if a pool contains all required keys
+/*!
+	\param pool yaml node of the pool
+	\param keys keys that must exist in the pool
+	\return true if f, r1/t1, r2/t2 and all keys exist
+*/
+static bool HasPoolKeys(const YamlNode &pool, const std::vector<std::string> &keys)
+{
+	if (!pool.HasKey("f") || (!pool.HasKey("r1") && !pool.HasKey("t1")) || (!pool.HasKey("r2") && !pool.HasKey("t2"))) {
+		return false;
+	}
+	for (size_t i = 0; i < keys.size(); i++) {
+		if (!pool.HasKey(keys[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//! Reads the relaxation rates of a pool
+/*!
+	\param pool yaml node of the pool
+	\param R1 longitudinal relaxation rate from r1 or 1/t1 [Hz]
+	\param R2 transversal relaxation rate from r2 or 1/t2 [Hz]
+*/
+static void ReadRelaxationRates(const YamlNode &pool, double &R1, double &R2)
+{
+	R1 = pool.HasKey("r1") ? pool["r1"].AsDouble() : 1.0 / pool["t1"].AsDouble();
+	R2 = pool.HasKey("r2") ? pool["r2"].AsDouble() : 1.0 / pool["t2"].AsDouble();
+}
+
+
+//! Reads the simulation parameters from a parsed yaml document
+/*!
+	Same keys, defaults and checks as readSimulationParameters.m. Errors are thrown as std::runtime_error
+	\param params root node of the yaml document
+	\param sp SimulationParameters object that gets filled
+	\param warnings if not NULL, warnings (e.g. missing CEST pools) get appended
+*/
+void ReadSimulationParameters(const YamlNode &params, SimulationParameters &sp, std::vector<std::string> *warnings)
+{
+	double R1, R2;
+
+	//** Water Pool **//
+	if (!params.HasKey("water_pool")) {
+		throw std::runtime_error("Water pool must be defined in \"water_pool\"");
+	}
+	const YamlNode &wp = params["water_pool"];
+	if (!HasPoolKeys(wp, std::vector<std::string>())) {
+		throw std::runtime_error("\"water_pool\" must contain \"f\", \"r1/t1\" and \"r2/t2\"");
+	}
+	ReadRelaxationRates(wp, R1, R2);
+	sp.SetWaterPool(WaterPool(R1, R2, wp["f"].AsDouble()));
+
+	// optional multi isochromats case
+	if (wp.HasKey("t2star") && wp.HasKey("isochromats")) {
+		sp.SetT2Star(wp["t2star"].AsDouble());
+		sp.SetNumberOfIsochromats(wp["isochromats"].AsDouble());
+		if (sp.GetNumberOfIsochromats() < 30) {
+			AddWarning(warnings, "Although the number of isochromats depends on various parameters, we recommend to use at least 30.");
+		}
+	}
+
+	//** CEST Pools **//
+	std::vector<std::string> cestKeys;
+	cestKeys.push_back("k");
+	cestKeys.push_back("dw");
+	if (params.HasKey("cest_pool")) {
+		const std::vector<std::pair<std::string, YamlNode> > &cp = params["cest_pool"].GetMapping();
+		unsigned int numCESTPools = cp.size();
+		if (numCESTPools > MAX_CEST_POOLS) {
+			AddWarning(warnings, "Only 100 CEST pools are possible! Ignoring the rest...");
+			numCESTPools = MAX_CEST_POOLS;
+		}
+		sp.SetNumberOfCESTPools(numCESTPools);
+		for (unsigned int i = 0; i < numCESTPools; i++) {
+			const YamlNode &cpool = cp[i].second;
+			if (!HasPoolKeys(cpool, cestKeys)) {
+				throw std::runtime_error(cp[i].first + " must contain \"f\", \"r1/t1\" , \"r2/t2\", \"k\" and \"dw\"");
+			}
+			ReadRelaxationRates(cpool, R1, R2);
+			sp.SetCESTPool(CESTPool(R1, R2, cpool["f"].AsDouble(), cpool["dw"].AsDouble(), cpool["k"].AsDouble()), i);
+		}
+	}
+	else {
+		AddWarning(warnings, "No CEST pools found in param files! specify with \"cest_pool\"");
+	}
+
+	//** MT Pool **//
+	if (params.HasKey("mt_pool")) {
+		const YamlNode &mt = params["mt_pool"];
+		cestKeys.push_back("lineshape");
+		if (!HasPoolKeys(mt, cestKeys)) {
+			throw std::runtime_error("\"mt_pool\" must contain \"f\", \"r1\" , \"r2\", \"k\", \"dw\" and \"lineshape\"");
+		}
+		MTLineshape ls;
+		const std::string &lineshape = mt["lineshape"].AsString();
+		if (lineshape == "SuperLorentzian") {
+			ls = SuperLorentzian;
+		}
+		else if (lineshape == "Lorentzian") {
+			ls = Lorentzian;
+		}
+		else if (lineshape == "None") {
+			ls = None;
+		}
+		else {
+			throw std::runtime_error(lineshape + " is invalid. Please use \"None\", \"Lorentzian\" or \"SuperLorentzian\"");
+		}
+		ReadRelaxationRates(mt, R1, R2);
+		sp.SetMTPool(MTPool(R1, R2, mt["f"].AsDouble(), mt["dw"].AsDouble(), mt["k"].AsDouble(), ls));
+	}
+	else {
+		AddWarning(warnings, "No MT pool found in param files! specify with \"mt_pool\"");
+	}
+
+	//** Initial magnetization vector (fully relaxed) **//
+	// [MxA, MxB, MxD, MyA, MyB, MyD, MzA, MzB, MzD, MzC]
+	// -> A: Water Pool, B: 1st CEST Pool, D: 2nd CEST Pool, C: MT Pool
+	unsigned int numPools = sp.GetNumberOfCESTPools() + 1;
+	Eigen::VectorXd M = Eigen::VectorXd::Zero(numPools * 3 + (sp.IsMTActive() ? 1 : 0));
+	M(numPools * 2) = sp.GetWaterPool()->GetFraction();
+	for (unsigned int i = 1; i < numPools; i++) {
+		M(numPools * 2 + i) = sp.GetCESTPool(i - 1)->GetFraction();
+	}
+	if (sp.IsMTActive()) {
+		M(numPools * 3) = sp.GetMTPool()->GetFraction();
+	}
+	if (params.HasKey("scale")) {
+		M *= params["scale"].AsDouble();
+	}
+	sp.SetInitialMagnetizationVector(M);
+
+	//** Scanner properties **//
+	if (!params.HasKey("b0") || !params.HasKey("gamma")) {
+		throw std::runtime_error("Parameter file must contain \"b0\" and \"gamma\"");
+	}
+	Scanner scanner;
+	scanner.B0 = params["b0"].AsDouble();
+	scanner.Gamma = params["gamma"].AsDouble();
+	scanner.B0Inhomogeneity = params.HasKey("b0_inhom") ? params["b0_inhom"].AsDouble() : 0.0;
+	scanner.relB1 = params.HasKey("rel_b1") ? params["rel_b1"].AsDouble() : 1.0;
+	sp.InitScanner(scanner);
+
+	//** More optional parameters **//
+	if (params.HasKey("verbose"))
+		sp.SetVerbose(params["verbose"].AsDouble() != 0.0);
+	if (params.HasKey("reset_init_mag"))
+		sp.SetUseInitMagnetization(params["reset_init_mag"].AsDouble() != 0.0);
+	if (params.HasKey("max_pulse_samples"))
+		sp.SetMaxNumberOfPulseSamples(params["max_pulse_samples"].AsDouble());
+	if (params.HasKey("max_pulse_error"))
+		sp.SetMaxPulseSampleError(params["max_pulse_error"].AsDouble());
+	if (params.HasKey("sequence_cache"))
+		sp.SetUseSequenceCache(params["sequence_cache"].AsDouble() != 0.0);
+	if (params.HasKey("block_propagation"))
+		sp.SetUseBlockPropagation(params["block_propagation"].AsDouble() != 0.0);
+	if (params.HasKey("num_threads"))
+		sp.SetNumberOfThreads(params["num_threads"].AsDouble());
+	if (params.HasKey("batch_lanes"))
+		sp.SetNumberOfBatchLanes(params["batch_lanes"].AsDouble());
+	if (params.HasKey("propagation_method")) {
+		const std::string &method = params["propagation_method"].AsString();
+		if (method == "Pade") {
+			sp.SetPropagationMethod(PadePropagation);
+		}
+		else if (method == "Expmv") {
+			sp.SetPropagationMethod(ExpmvPropagation);
+		}
+		else {
+			throw std::runtime_error(method + " is invalid. Please use \"Pade\" or \"Expmv\"");
+		}
+	}
+}
+
+
+//! Reads the simulation parameters from a yaml file
+/*!
+	\param yamlFile filename of the yaml parameter file
+	\param sp SimulationParameters object that gets filled
+	\param warnings if not NULL, warnings (e.g. missing CEST pools) get appended
+*/
+void ReadSimulationParameters(const std::string &yamlFile, SimulationParameters &sp, std::vector<std::string> *warnings)
+{
+	if (!std::ifstream(yamlFile.c_str())) {
+		throw std::runtime_error("yaml parameter file does not exist!");
+	}
+	ReadSimulationParameters(YamlNode::ParseFile(yamlFile), sp, warnings);
+}
+
+
+//! Reads the simulation parameters of all documents of a parsed yaml stream
+/*!
+	\param documents root nodes of the documents
+	\param name prefix for warnings and errors, e.g. the filename
+	\param sps one SimulationParameters object per document gets appended
+	\param warnings if not NULL, warnings get appended with the index of the document
+*/
+static void ReadDocuments(const std::vector<YamlNode> &documents, const std::string &name, std::vector<SimulationParameters> &sps, std::vector<std::string> *warnings)
+{
+	std::vector<std::string> docWarnings;
+	for (size_t d = 0; d < documents.size(); d++) {
+		std::ostringstream prefix;
+		prefix << name << " (document " << d + 1 << "): ";
+		SimulationParameters sp;
+		try {
+			ReadSimulationParameters(documents[d], sp, warnings != NULL ? &docWarnings : NULL);
+		}
+		catch (std::runtime_error &e) {
+			throw std::runtime_error(prefix.str() + e.what());
+		}
+		sps.push_back(sp);
+		for (size_t w = 0; w < docWarnings.size(); w++) {
+			warnings->push_back(prefix.str() + docWarnings[w]);
+		}
+		docWarnings.clear();
+	}
+}
+
+
+//! Reads the simulation parameters of all documents of a yaml file
+/*!
+	Documents are separated by ---, each document is a complete parameter set
+	\param yamlFile filename of the yaml parameter file
+	\param sps one SimulationParameters object per document gets appended
+	\param warnings if not NULL, warnings get appended with the index of the document
+*/
+void ReadSimulationParameters(const std::string &yamlFile, std::vector<SimulationParameters> &sps, std::vector<std::string> *warnings)
+{
+	if (!std::ifstream(yamlFile.c_str())) {
+		throw std::runtime_error(yamlFile + ": yaml parameter file does not exist!");
+	}
+	std::vector<YamlNode> documents;
+	try {
+		documents = YamlNode::ParseFileDocuments(yamlFile);
+	}
+	catch (std::runtime_error &e) {
+		throw std::runtime_error(yamlFile + ": " + e.what());
+	}
+	ReadDocuments(documents, yamlFile, sps, warnings);
+}
+
+
+//! Reads the simulation parameters of many yaml files
+/*!
+	The files are read and parsed in parallel, errors contain the filename
+	\param yamlFiles filenames of the yaml parameter files
+	\param sps one SimulationParameters object per document gets appended, in the order of the files
+	\param numThreads number of threads, 0 uses all available cores
+	\param warnings if not NULL, warnings get appended with the filename and the index of the document
+*/
+void ReadSimulationParameters(const std::vector<std::string> &yamlFiles, std::vector<SimulationParameters> &sps, unsigned int numThreads, std::vector<std::string> *warnings)
+{
+	// each file gets its own output, so that the order does not depend on the threads
+	std::vector<std::vector<SimulationParameters> > fileSps(yamlFiles.size());
+	std::vector<std::vector<std::string> > fileWarnings(yamlFiles.size());
+	ThreadPool pool(numThreads);
+	pool.Run(yamlFiles.size(), [&](unsigned int w, unsigned int f) {
+		ReadSimulationParameters(yamlFiles[f], fileSps[f], warnings != NULL ? &fileWarnings[f] : NULL);
+	});
+	for (size_t f = 0; f < yamlFiles.size(); f++) {
+		sps.insert(sps.end(), fileSps[f].begin(), fileSps[f].end());
+		if (warnings != NULL) {
+			warnings->insert(warnings->end(), fileWarnings[f].begin(), fileWarnings[f].end());
+		}
+	}
+}
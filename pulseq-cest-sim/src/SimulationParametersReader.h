@@ -0,0 +1,61 @@
+//!  SimulationParametersReader.h
+/*!
+Reads the simulation parameters from a yaml file, C++ equivalent of readSimulationParameters.m
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "SimulationParameters.h"
+#include "YamlParser.h"
+#include <string>
+#include <vector>
+
+//! Reads the simulation parameters from a parsed yaml document
+/*!
+	Same keys, defaults and checks as readSimulationParameters.m. Errors are thrown as std::runtime_error
+	\param params root node of the yaml document
+	\param sp SimulationParameters object that gets filled
+	\param warnings if not NULL, warnings (e.g. missing CEST pools) get appended
+*/
+void ReadSimulationParameters(const YamlNode &params, SimulationParameters &sp, std::vector<std::string> *warnings = NULL);
+
+//! Reads the simulation parameters from a yaml file
+/*!
+	\param yamlFile filename of the yaml parameter file
+	\param sp SimulationParameters object that gets filled
+	\param warnings if not NULL, warnings (e.g. missing CEST pools) get appended
+*/
+void ReadSimulationParameters(const std::string &yamlFile, SimulationParameters &sp, std::vector<std::string> *warnings = NULL);
+
+//! Reads the simulation parameters of all documents of a yaml file
+/*!
+	Documents are separated by ---, each document is a complete parameter set
+	\param yamlFile filename of the yaml parameter file
+	\param sps one SimulationParameters object per document gets appended
+	\param warnings if not NULL, warnings get appended with the index of the document
+*/
+void ReadSimulationParameters(const std::string &yamlFile, std::vector<SimulationParameters> &sps, std::vector<std::string> *warnings = NULL);
+
+//! Reads the simulation parameters of many yaml files
+/*!
+	The files are read and parsed in parallel, errors contain the filename
+	\param yamlFiles filenames of the yaml parameter files
+	\param sps one SimulationParameters object per document gets appended, in the order of the files
+	\param numThreads number of threads, 0 uses all available cores
+	\param warnings if not NULL, warnings get appended with the filename and the index of the document
+*/
+void ReadSimulationParameters(const std::vector<std::string> &yamlFiles, std::vector<SimulationParameters> &sps, unsigned int numThreads = 0, std::vector<std::string> *warnings = NULL);
@@ -0,0 +1,120 @@
+//!  SimulationStats.h
+/*!
+Counters and timers of the simulation hot path, compiled in with PULSEQCEST_STATS
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+#define STATS_MAX_SQUARING_STEPS 32 // squaring steps j of the pade approximation above this value are counted in the last bin
+#define STATS_NUM_EVENT_KINDS 4     // ADC, spoiler, rf and delay events
+
+// the macros compile to nothing without PULSEQCEST_STATS, so the hot path is unchanged by default
+#ifdef PULSEQCEST_STATS
+#define STATS_ADD(stats, counter, value) ((stats).counter += (value))
+#define STATS_SQUARING_STEPS(stats, j, count) ((stats).squaringSteps[std::min(int(j), STATS_MAX_SQUARING_STEPS)] += (count))
+#define STATS_TIMER_START(timer) SimulationStats::Clock::time_point timer = SimulationStats::Clock::now()
+#define STATS_TIMER_STOP(stats, kind, timer) ((stats).eventTime[kind] += std::chrono::duration<double>(SimulationStats::Clock::now() - (timer)).count(), (stats).eventCount[kind]++)
+#else
+#define STATS_ADD(stats, counter, value) ((void)0)
+#define STATS_SQUARING_STEPS(stats, j, count) ((void)0)
+#define STATS_TIMER_START(timer) ((void)0)
+#define STATS_TIMER_STOP(stats, kind, timer) ((void)0)
+#endif
+
+//! Counters and timers of a simulation
+/*!
+  Each solver and simulation thread has its own instance, BMCSim::GetStats sums them up.
+  All values stay zero if the library was compiled without PULSEQCEST_STATS.
+*/
+struct SimulationStats
+{
+	typedef std::chrono::steady_clock Clock;
+
+	uint64_t padeExponentials;      /*!< matrix exponentials with the pade approximation */
+	uint64_t eigenExponentials;     /*!< propagators from a cached eigendecomposition */
+	uint64_t eigenDecompositions;   /*!< diagonalized Bloch matrices */
+	uint64_t squaringSteps[STATS_MAX_SQUARING_STEPS + 1]; /*!< histogram of the squaring steps j of the pade approximation */
+	uint64_t expmvSteps;            /*!< taylor steps of the truncated taylor series (ExpmvPropagation) */
+	uint64_t expmvProducts;         /*!< matrix-vector products of the truncated taylor series (ExpmvPropagation) */
+	uint64_t propagatorCacheHits;   /*!< propagators found in the cache */
+	uint64_t propagatorCacheMisses; /*!< propagators that had to be calculated */
+	uint64_t blockPropagatorHits;   /*!< rf blocks with an existing block propagator */
+	uint64_t blockPropagatorMisses; /*!< rf blocks that had to be composed */
+	uint64_t rfSamples;             /*!< simulated pulse samples */
+	uint64_t eventCount[STATS_NUM_EVENT_KINDS]; /*!< simulated events, indexed by SimulationEventKind */
+	double eventTime[STATS_NUM_EVENT_KINDS];    /*!< time spent in the events [s], indexed by SimulationEventKind */
+	uint64_t pulseLibrarySize;      /*!< number of unique pulses */
+	uint64_t pulseLibrarySamples;   /*!< samples of all unique pulses */
+
+	//! Constructor, all values are zero
+	SimulationStats()
+	{
+		this->Reset();
+	}
+
+	//! Set all values to zero
+	void Reset()
+	{
+		padeExponentials = eigenExponentials = eigenDecompositions = 0;
+		std::fill(squaringSteps, squaringSteps + STATS_MAX_SQUARING_STEPS + 1, 0);
+		expmvSteps = expmvProducts = 0;
+		propagatorCacheHits = propagatorCacheMisses = 0;
+		blockPropagatorHits = blockPropagatorMisses = 0;
+		rfSamples = 0;
+		std::fill(eventCount, eventCount + STATS_NUM_EVENT_KINDS, 0);
+		std::fill(eventTime, eventTime + STATS_NUM_EVENT_KINDS, 0.0);
+		pulseLibrarySize = pulseLibrarySamples = 0;
+	}
+
+	//! Add the counters and timers of another instance
+	/*!	\param s stats of another solver or thread, the pulse library info is not added */
+	void Add(const SimulationStats &s)
+	{
+		padeExponentials += s.padeExponentials;
+		eigenExponentials += s.eigenExponentials;
+		eigenDecompositions += s.eigenDecompositions;
+		for (int j = 0; j <= STATS_MAX_SQUARING_STEPS; j++) {
+			squaringSteps[j] += s.squaringSteps[j];
+		}
+		expmvSteps += s.expmvSteps;
+		expmvProducts += s.expmvProducts;
+		propagatorCacheHits += s.propagatorCacheHits;
+		propagatorCacheMisses += s.propagatorCacheMisses;
+		blockPropagatorHits += s.blockPropagatorHits;
+		blockPropagatorMisses += s.blockPropagatorMisses;
+		rfSamples += s.rfSamples;
+		for (int k = 0; k < STATS_NUM_EVENT_KINDS; k++) {
+			eventCount[k] += s.eventCount[k];
+			eventTime[k] += s.eventTime[k];
+		}
+	}
+
+	//! Check if the counters are compiled in
+	/*!	\return true if the library was compiled with PULSEQCEST_STATS */
+	static bool IsEnabled()
+	{
+#ifdef PULSEQCEST_STATS
+		return true;
+#else
+		return false;
+#endif
+	}
+};
@@ -0,0 +1,158 @@
+//!  ThreadPool.h 
+/*!
+Simple thread pool to run independent simulation tasks in parallel
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <vector>
+
+//!  ThreadPool class. 
+/*!
+  Runs a number of independent tasks on a number of threads with work stealing.
+  Each thread starts with a contiguous range of tasks, so that neighbouring tasks (e.g. with the
+  same parameters) run on the same thread. A thread that is done steals the upper half of the
+  remaining range of the thread with the most remaining tasks.
+*/
+class ThreadPool
+{
+public:
+
+	// typedef for a task function with the worker (thread) index and the task index
+	typedef std::function<void(unsigned int, unsigned int)> Task;
+
+	//! Constructor
+	/*!	\param nThreads number of threads, 0 uses all available cores */
+	ThreadPool(unsigned int nThreads = 0) {
+		numThreads = nThreads > 0 ? nThreads : std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	//! Get number of threads
+	/*!	\return number of threads of the pool */
+	unsigned int GetNumberOfThreads() {
+		return numThreads;
+	}
+
+	//! Run the tasks
+	/*!
+		Returns after all tasks are done. The first exception that is thrown in a task gets rethrown here.
+		\param numTasks number of tasks
+		\param task function that gets called with the worker index [0 ... numThreads-1] and the task index [0 ... numTasks-1]
+	*/
+	void Run(unsigned int numTasks, Task task) {
+		unsigned int numWorkers = std::min(numThreads, numTasks);
+		// remaining task range of each worker, packed as (begin << 32 | end) to update it atomically
+		std::vector<std::atomic<uint64_t> > ranges(numWorkers);
+		for (unsigned int w = 0; w < numWorkers; w++) {
+			ranges[w] = PackRange(uint64_t(numTasks) * w / numWorkers, uint64_t(numTasks) * (w + 1) / numWorkers);
+		}
+		std::vector<std::exception_ptr> errors(numWorkers);
+		std::vector<std::thread> workers;
+		for (unsigned int w = 0; w < numWorkers; w++) {
+			workers.push_back(std::thread([&, w]() {
+				try {
+					unsigned int t;
+					while (true) {
+						if (PopTask(ranges[w], t)) {
+							task(w, t);
+						}
+						else if (!StealTasks(ranges, w)) {
+							break; // all tasks are taken
+						}
+					}
+				}
+				catch (...) {
+					errors[w] = std::current_exception();
+					for (unsigned int i = 0; i < numWorkers; i++) {
+						ranges[i] = 0; // stop the other workers
+					}
+				}
+			}));
+		}
+		for (unsigned int w = 0; w < numWorkers; w++) {
+			workers[w].join();
+		}
+		for (unsigned int w = 0; w < numWorkers; w++) {
+			if (errors[w]) {
+				std::rethrow_exception(errors[w]);
+			}
+		}
+	}
+
+private:
+	unsigned int numThreads; /*!< number of threads */
+
+	//! Pack a task range into a single integer
+	static uint64_t PackRange(uint64_t begin, uint64_t end) {
+		return (begin << 32) | end;
+	}
+
+	//! Take the first task of the own range
+	/*!
+		\param range remaining tasks of the worker
+		\param t index of the task
+		\return false if the range is empty
+	*/
+	static bool PopTask(std::atomic<uint64_t> &range, unsigned int &t) {
+		uint64_t r = range.load();
+		while (uint32_t(r >> 32) < uint32_t(r)) {
+			if (range.compare_exchange_weak(r, r + (uint64_t(1) << 32))) {
+				t = uint32_t(r >> 32);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	//! Steal the upper half of the largest remaining range of another worker
+	/*!
+		\param ranges remaining tasks of all workers
+		\param w index of the worker that steals
+		\return false if all tasks are taken
+	*/
+	static bool StealTasks(std::vector<std::atomic<uint64_t> > &ranges, unsigned int w) {
+		while (true) {
+			unsigned int victim = 0;
+			uint64_t victimRange = 0;
+			uint32_t maxRemaining = 0;
+			for (unsigned int i = 0; i < ranges.size(); i++) {
+				uint64_t r = ranges[i].load();
+				uint32_t begin = uint32_t(r >> 32), end = uint32_t(r);
+				if (end > begin && end - begin > maxRemaining) {
+					victim = i;
+					victimRange = r;
+					maxRemaining = end - begin;
+				}
+			}
+			if (maxRemaining == 0) {
+				return false;
+			}
+			uint32_t begin = uint32_t(victimRange >> 32), end = uint32_t(victimRange);
+			uint32_t mid = begin + maxRemaining / 2;
+			if (ranges[victim].compare_exchange_strong(victimRange, PackRange(begin, mid))) {
+				ranges[w] = PackRange(mid, end);
+				return true;
+			}
+		}
+	}
+};
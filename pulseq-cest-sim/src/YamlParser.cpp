@@ -0,0 +1,599 @@
+//!  YamlParser.cpp
+/*!
+Minimal YAML parser for the simulation parameter files
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "YamlParser.h"
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+
+//!  YamlReader class.
+/*!
+  Recursive descent parser that builds the YamlNode tree.
+  Block content is parsed line by line based on the indentation, flow content ({...} and [...])
+  is collected until all brackets are closed and parsed character by character.
+*/
+class YamlReader
+{
+public:
+
+	//! Constructor
+	/*!	\param text YAML document */
+	YamlReader(const std::string &text) : numLines(0)
+	{
+		std::istringstream stream(text);
+		std::string line;
+		unsigned int number = 0;
+		documentStarts.push_back(0);
+		while (std::getline(stream, line)) {
+			number++;
+			line = StripComment(line);
+			size_t first = line.find_first_not_of(" \t");
+			if (first == std::string::npos) {
+				continue; // empty line
+			}
+			std::string content = line.substr(first);
+			if (first == 0 && content.compare(0, 3, "---") == 0 && (content.size() == 3 || content[3] == ' ' || content[3] == '\t')) {
+				documentStarts.push_back(lines.size()); // start of the next document
+				content = Trim(content.substr(3));
+				if (content.empty()) {
+					continue;
+				}
+				first = 4;
+			}
+			else if (first == 0 && content == "...") {
+				continue; // end of the document
+			}
+			Line l = { int(first), content, number };
+			lines.push_back(l);
+		}
+		documentStarts.push_back(lines.size());
+	}
+
+	//! Parse all documents
+	/*!	\return root nodes of all non-empty documents */
+	std::vector<YamlNode> ParseDocuments()
+	{
+		std::vector<YamlNode> documents;
+		for (size_t d = 0; d + 1 < documentStarts.size(); d++) {
+			size_t i = documentStarts[d];
+			numLines = documentStarts[d + 1];
+			if (i == numLines) {
+				continue; // empty document, e.g. before the first ---
+			}
+			documents.push_back(ParseBlock(i, lines[i].indent));
+			if (i < numLines) {
+				Error("unexpected indentation", lines[i].number);
+			}
+		}
+		return documents;
+	}
+
+private:
+
+	//! Non-empty line without comment
+	struct Line
+	{
+		int indent;          /*!< number of leading spaces */
+		std::string text;    /*!< content without indentation */
+		unsigned int number; /*!< line number in the file */
+	};
+
+	std::vector<Line> lines;            /*!< all non-empty lines */
+	std::vector<size_t> documentStarts; /*!< index of the first line of each document, followed by the number of lines */
+	size_t numLines;                    /*!< end of the document that gets parsed */
+
+	//! Throw a parse error
+	/*!
+		\param msg error description
+		\param lineNumber line in the file
+	*/
+	static void Error(const std::string &msg, unsigned int lineNumber)
+	{
+		std::ostringstream err;
+		err << "YAML parse error in line " << lineNumber << ": " << msg;
+		throw std::runtime_error(err.str());
+	}
+
+	//! Remove a comment from a line
+	/*!
+		A # starts a comment if it is outside of quotes and at the start of the line or after a whitespace
+		\param line line of the file
+		\return line without comment and trailing whitespace
+	*/
+	static std::string StripComment(const std::string &line)
+	{
+		char quote = 0;
+		size_t end = line.size();
+		for (size_t i = 0; i < line.size(); i++) {
+			char c = line[i];
+			if (quote) {
+				if (c == quote) {
+					quote = 0;
+				}
+			}
+			else if (c == '\'' || c == '"') {
+				quote = c;
+			}
+			else if (c == '#' && (i == 0 || line[i - 1] == ' ' || line[i - 1] == '\t')) {
+				end = i;
+				break;
+			}
+		}
+		size_t last = line.find_last_not_of(" \t\r", end == 0 ? std::string::npos : end - 1);
+		return (end == 0 || last == std::string::npos) ? std::string() : line.substr(0, last + 1);
+	}
+
+	//! Trim leading and trailing whitespace
+	static std::string Trim(const std::string &s)
+	{
+		size_t first = s.find_first_not_of(" \t");
+		if (first == std::string::npos) {
+			return std::string();
+		}
+		return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+	}
+
+	//! Create a scalar node
+	static YamlNode MakeScalar(const std::string &value)
+	{
+		YamlNode node;
+		node.type = YamlNode::Scalar;
+		node.scalar = value;
+		return node;
+	}
+
+	//! Find the colon that separates key and value in a block mapping
+	/*!
+		\param text content of the line
+		\return position of the colon, npos if the line is no mapping entry
+	*/
+	static size_t FindKeySeparator(const std::string &text)
+	{
+		char quote = 0;
+		for (size_t i = 0; i < text.size(); i++) {
+			char c = text[i];
+			if (quote) {
+				if (c == quote) {
+					quote = 0;
+				}
+			}
+			else if ((c == '\'' || c == '"') && i == 0) {
+				quote = c;
+			}
+			else if (c == '{' || c == '[') {
+				return std::string::npos; // flow content before a colon
+			}
+			else if (c == ':' && (i + 1 == text.size() || text[i + 1] == ' ' || text[i + 1] == '\t')) {
+				return i;
+			}
+		}
+		return std::string::npos;
+	}
+
+	//! Check if a line is a block sequence item
+	static bool IsSequenceItem(const std::string &text)
+	{
+		return text[0] == '-' && (text.size() == 1 || text[1] == ' ' || text[1] == '\t');
+	}
+
+	//! Parse block content that starts at line i with the given indentation
+	/*!
+		\param i index of the first line, points to the first line after the block afterwards
+		\param indent indentation of the block
+		\return block node
+	*/
+	YamlNode ParseBlock(size_t &i, int indent)
+	{
+		YamlNode node;
+		if (IsSequenceItem(lines[i].text)) {
+			node.type = YamlNode::Sequence;
+			while (i < numLines && lines[i].indent == indent && IsSequenceItem(lines[i].text)) {
+				std::string rest = Trim(lines[i].text.substr(1));
+				if (rest.empty()) {
+					i++;
+					node.sequence.push_back(i < numLines && lines[i].indent > indent ? ParseBlock(i, lines[i].indent) : YamlNode());
+				}
+				else if (FindKeySeparator(rest) != std::string::npos) {
+					// compact mapping "- key: value", the item continues at the indentation of its first key
+					lines[i].indent += int(lines[i].text.size() - rest.size());
+					lines[i].text = rest;
+					node.sequence.push_back(ParseBlock(i, lines[i].indent));
+				}
+				else {
+					node.sequence.push_back(ParseInlineValue(rest, i));
+				}
+			}
+			return node;
+		}
+		if (FindKeySeparator(lines[i].text) == std::string::npos) { // single value
+			return ParseInlineValue(lines[i].text, i);
+		}
+		node.type = YamlNode::Map;
+		while (i < numLines && lines[i].indent == indent) {
+			const std::string &text = lines[i].text;
+			size_t colon = FindKeySeparator(text);
+			if (colon == std::string::npos) {
+				Error("expected a key", lines[i].number);
+			}
+			std::string key = Unquote(Trim(text.substr(0, colon)), lines[i].number);
+			std::string rest = Trim(text.substr(colon + 1));
+			if (node.HasKey(key)) {
+				Error("duplicate key " + key, lines[i].number);
+			}
+			YamlNode value;
+			if (rest.empty()) {
+				i++;
+				// nested block, sequences may start at the indentation of the key
+				if (i < numLines && (lines[i].indent > indent || (lines[i].indent == indent && IsSequenceItem(lines[i].text)))) {
+					value = ParseBlock(i, lines[i].indent);
+				}
+			}
+			else {
+				value = ParseInlineValue(rest, i);
+			}
+			node.mapping.push_back(std::make_pair(key, value));
+		}
+		return node;
+	}
+
+	//! Parse a value that starts in the current line
+	/*!
+		Flow content can span multiple lines
+		\param text value in the current line
+		\param i index of the current line, points to the next line afterwards
+		\return value node
+	*/
+	YamlNode ParseInlineValue(const std::string &text, size_t &i)
+	{
+		unsigned int lineNumber = lines[i].number;
+		std::string flow = text;
+		i++;
+		if (text[0] == '{' || text[0] == '[') {
+			while (!IsBalanced(flow)) {
+				if (i >= numLines) {
+					Error("unclosed bracket", lineNumber);
+				}
+				flow += " " + lines[i].text;
+				i++;
+			}
+		}
+		size_t pos = 0;
+		YamlNode node = ParseFlow(flow, pos, lineNumber);
+		SkipWhitespace(flow, pos);
+		if (pos != flow.size()) {
+			Error("unexpected characters after value", lineNumber);
+		}
+		return node;
+	}
+
+	//! Check if all brackets of flow content are closed
+	static bool IsBalanced(const std::string &text)
+	{
+		int depth = 0;
+		char quote = 0;
+		for (size_t i = 0; i < text.size(); i++) {
+			char c = text[i];
+			if (quote) {
+				if (c == quote) {
+					quote = 0;
+				}
+			}
+			else if (c == '\'' || c == '"') {
+				quote = c;
+			}
+			else if (c == '{' || c == '[') {
+				depth++;
+			}
+			else if (c == '}' || c == ']') {
+				depth--;
+			}
+		}
+		return depth <= 0;
+	}
+
+	//! Skip whitespace in flow content
+	static void SkipWhitespace(const std::string &text, size_t &pos)
+	{
+		while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t')) {
+			pos++;
+		}
+	}
+
+	//! Parse flow content
+	/*!
+		\param text flow content
+		\param pos current position, points after the value afterwards
+		\param lineNumber line of the value in the file
+		\return value node
+	*/
+	YamlNode ParseFlow(const std::string &text, size_t &pos, unsigned int lineNumber)
+	{
+		SkipWhitespace(text, pos);
+		if (pos >= text.size()) {
+			return YamlNode();
+		}
+		char open = text[pos];
+		if (open != '{' && open != '[') {
+			return MakeScalar(ParseFlowScalar(text, pos, false, lineNumber));
+		}
+		char close = open == '{' ? '}' : ']';
+		YamlNode node;
+		node.type = open == '{' ? YamlNode::Map : YamlNode::Sequence;
+		pos++;
+		while (true) {
+			SkipWhitespace(text, pos);
+			if (pos >= text.size()) {
+				Error("unclosed bracket", lineNumber);
+			}
+			if (text[pos] == close) {
+				pos++;
+				break;
+			}
+			if (node.type == YamlNode::Map) {
+				std::string key = ParseFlowScalar(text, pos, true, lineNumber);
+				SkipWhitespace(text, pos);
+				if (pos >= text.size() || text[pos] != ':') {
+					Error("expected ':' after key " + key, lineNumber);
+				}
+				pos++;
+				SkipWhitespace(text, pos);
+				if (node.HasKey(key)) {
+					Error("duplicate key " + key, lineNumber);
+				}
+				bool empty = pos < text.size() && (text[pos] == ',' || text[pos] == close);
+				node.mapping.push_back(std::make_pair(key, empty ? YamlNode() : ParseFlow(text, pos, lineNumber)));
+			}
+			else {
+				node.sequence.push_back(ParseFlow(text, pos, lineNumber));
+			}
+			SkipWhitespace(text, pos);
+			if (pos < text.size() && text[pos] == ',') {
+				pos++;
+			}
+			else if (pos >= text.size() || text[pos] != close) {
+				Error(std::string("expected ',' or '") + close + "'", lineNumber);
+			}
+		}
+		return node;
+	}
+
+	//! Parse a plain or quoted scalar in flow content
+	/*!
+		\param text flow content
+		\param pos current position, points after the scalar afterwards
+		\param isKey true if the scalar is a mapping key that ends at a colon
+		\param lineNumber line of the value in the file
+		\return value of the scalar
+	*/
+	std::string ParseFlowScalar(const std::string &text, size_t &pos, bool isKey, unsigned int lineNumber)
+	{
+		char quote = text[pos];
+		if (quote == '\'' || quote == '"') {
+			size_t start = pos;
+			pos++;
+			while (pos < text.size()) {
+				if (text[pos] == quote) {
+					if (quote == '\'' && pos + 1 < text.size() && text[pos + 1] == '\'') {
+						pos += 2; // escaped single quote
+						continue;
+					}
+					break;
+				}
+				pos += (quote == '"' && text[pos] == '\\') ? 2 : 1;
+			}
+			if (pos >= text.size()) {
+				Error("unclosed quote", lineNumber);
+			}
+			pos++;
+			return Unquote(text.substr(start, pos - start), lineNumber);
+		}
+		size_t start = pos;
+		while (pos < text.size() && text[pos] != ',' && text[pos] != '}' && text[pos] != ']') {
+			if (isKey && text[pos] == ':') {
+				break;
+			}
+			pos++;
+		}
+		return Trim(text.substr(start, pos - start));
+	}
+
+	//! Remove the quotes of a scalar
+	/*!
+		\param s plain or quoted scalar
+		\param lineNumber line of the scalar in the file
+		\return value of the scalar
+	*/
+	static std::string Unquote(const std::string &s, unsigned int lineNumber)
+	{
+		if (s.size() < 2 || (s[0] != '\'' && s[0] != '"')) {
+			return s;
+		}
+		char quote = s[0];
+		if (s[s.size() - 1] != quote) {
+			Error("unclosed quote", lineNumber);
+		}
+		std::string value;
+		for (size_t i = 1; i + 1 < s.size(); i++) {
+			if (quote == '\'' && s[i] == '\'') {
+				i++; // '' is an escaped '
+			}
+			else if (quote == '"' && s[i] == '\\') {
+				i++;
+				switch (s[i]) {
+				case 'n': value += '\n'; continue;
+				case 't': value += '\t'; continue;
+				default: break;
+				}
+			}
+			value += s[i];
+		}
+		return value;
+	}
+};
+
+
+// YamlNode Function Definitions ////
+
+//! Default Constructor
+YamlNode::YamlNode() : type(Null) {}
+
+//! Read a whole file
+/*!
+	\param path filename
+	\return content of the file
+*/
+static std::string ReadFile(const std::string &path)
+{
+	std::ifstream file(path.c_str(), std::ios::binary);
+	if (!file) {
+		throw std::runtime_error("Could not open yaml file " + path);
+	}
+	std::string text;
+	file.seekg(0, std::ios::end);
+	text.resize(size_t(file.tellg()));
+	file.seekg(0, std::ios::beg);
+	file.read(&text[0], text.size());
+	return text;
+}
+
+//! Parse a YAML document
+/*!
+	\param text YAML document
+	\return root node, throws if the text contains more than one document
+*/
+YamlNode YamlNode::Parse(const std::string &text)
+{
+	std::vector<YamlNode> documents = ParseDocuments(text);
+	if (documents.size() > 1) {
+		throw std::runtime_error("YAML text contains more than one document");
+	}
+	return documents.empty() ? YamlNode() : documents[0];
+}
+
+//! Parse a YAML file
+/*!
+	\param path filename of the YAML file
+	\return root node, throws if the file contains more than one document
+*/
+YamlNode YamlNode::ParseFile(const std::string &path)
+{
+	return Parse(ReadFile(path));
+}
+
+//! Parse all documents of a YAML stream
+/*!
+	Documents are separated by lines that start with ---, empty documents are skipped
+	\param text YAML stream
+	\return root nodes of all documents
+*/
+std::vector<YamlNode> YamlNode::ParseDocuments(const std::string &text)
+{
+	YamlReader reader(text);
+	return reader.ParseDocuments();
+}
+
+//! Parse all documents of a YAML file
+/*!
+	\param path filename of the YAML file
+	\return root nodes of all documents
+*/
+std::vector<YamlNode> YamlNode::ParseFileDocuments(const std::string &path)
+{
+	return ParseDocuments(ReadFile(path));
+}
+
+//! Get the type of the node
+/*!	\return type of the node */
+YamlNode::Type YamlNode::GetType() const { return type; }
+
+//! Check if a mapping contains a key
+/*!
+	\param key key of the mapping
+	\return true if the node is a mapping that contains the key
+*/
+bool YamlNode::HasKey(const std::string &key) const
+{
+	for (size_t i = 0; i < mapping.size(); i++) {
+		if (mapping[i].first == key) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//! Get the child node of a key
+/*!
+	\param key key of the mapping
+	\return child node, throws if the key does not exist
+*/
+const YamlNode& YamlNode::operator[](const std::string &key) const
+{
+	for (size_t i = 0; i < mapping.size(); i++) {
+		if (mapping[i].first == key) {
+			return mapping[i].second;
+		}
+	}
+	throw std::runtime_error("Key " + key + " not found");
+}
+
+//! Get the keys and child nodes of a mapping
+/*!	\return keys and child nodes in the order of the file */
+const std::vector<std::pair<std::string, YamlNode> >& YamlNode::GetMapping() const { return mapping; }
+
+//! Get the items of a sequence
+/*!	\return items in the order of the file */
+const std::vector<YamlNode>& YamlNode::GetSequence() const { return sequence; }
+
+//! Get the scalar as a string
+/*!	\return value of the scalar, empty for non-scalar nodes */
+const std::string& YamlNode::AsString() const { return scalar; }
+
+//! Get the scalar as a number
+/*!
+	Same conversion as str2param in readSimulationParameters.m: booleans become 0 or 1
+	and fractions such as 1/3 get evaluated
+	\return value of the scalar, throws if it is not numeric
+*/
+double YamlNode::AsDouble() const
+{
+	if (type == Scalar) {
+		if (scalar == "true" || scalar == "True" || scalar == "TRUE") {
+			return 1.0;
+		}
+		if (scalar == "false" || scalar == "False" || scalar == "FALSE") {
+			return 0.0;
+		}
+		size_t slash = scalar.find('/');
+		const char* begin = scalar.c_str();
+		char* end;
+		errno = 0;
+		double value = strtod(begin, &end);
+		if (slash != std::string::npos && end == begin + slash) { // fraction
+			const char* denominator = begin + slash + 1;
+			value /= strtod(denominator, &end);
+		}
+		if (end != begin && *end == '\0' && errno == 0 && value == value) {
+			return value;
+		}
+	}
+	throw std::runtime_error("Could not parse a numeric value from " + scalar);
+}
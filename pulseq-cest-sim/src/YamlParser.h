@@ -0,0 +1,83 @@
+//!  YamlParser.h
+/*!
+Minimal YAML parser for the simulation parameter files
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+//!  YamlNode class.
+/*!
+  Node of a parsed YAML document. It is either empty, a scalar, a mapping or a sequence.
+  The parser supports the subset of YAML that is used by the simulation parameter files:
+  block and flow mappings and sequences, plain and quoted scalars, comments and multiple documents separated by ---.
+  Mappings keep the order of their keys, so that e.g. the CEST pools stay in the order of the file.
+*/
+class YamlNode
+{
+public:
+
+	//! Type of the node
+	enum Type { Null, Scalar, Map, Sequence };
+
+	//! Default Constructor
+	YamlNode();
+
+	//! Parse a YAML document
+	static YamlNode Parse(const std::string &text);
+
+	//! Parse a YAML file
+	static YamlNode ParseFile(const std::string &path);
+
+	//! Parse all documents of a YAML stream
+	static std::vector<YamlNode> ParseDocuments(const std::string &text);
+
+	//! Parse all documents of a YAML file
+	static std::vector<YamlNode> ParseFileDocuments(const std::string &path);
+
+	//! Get the type of the node
+	Type GetType() const;
+
+	//! Check if a mapping contains a key
+	bool HasKey(const std::string &key) const;
+
+	//! Get the child node of a key
+	const YamlNode& operator[](const std::string &key) const;
+
+	//! Get the keys and child nodes of a mapping
+	const std::vector<std::pair<std::string, YamlNode> >& GetMapping() const;
+
+	//! Get the items of a sequence
+	const std::vector<YamlNode>& GetSequence() const;
+
+	//! Get the scalar as a string
+	const std::string& AsString() const;
+
+	//! Get the scalar as a number
+	double AsDouble() const;
+
+private:
+	Type type;                                            /*!< type of the node */
+	std::string scalar;                                   /*!< value of a scalar */
+	std::vector<std::pair<std::string, YamlNode> > mapping; /*!< keys and values of a mapping */
+	std::vector<YamlNode> sequence;                       /*!< items of a sequence */
+
+	friend class YamlReader;
+};
@@ -0,0 +1,158 @@
+//!  PropagatorBenchmark.cpp
+/*!
+Benchmark of the propagator calculation of the Bloch-McConnell solver.
+Compares the augmented system [A C; 0 0] with the former formulation that inverts A to get the affine term.
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "BlochMcConnellSolver.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+// !BenchmarkSolver class.
+/*!
+  Gives access to the propagator calculation of the solver and adds the former formulation with A^-1 * C
+*/
+template <int size> class BenchmarkSolver : public BlochMcConnellSolver<size>
+{
+public:
+	typedef typename BlochMcConnellSolver<size>::MatrixNd MatrixNd;
+	typedef typename BlochMcConnellSolver<size>::VectorNd VectorNd;
+	typedef typename BlochMcConnellSolver<size>::Propagator Propagator;
+
+	BenchmarkSolver(SimulationParameters &sp) : BlochMcConnellSolver<size>(sp) {}
+
+	//! Propagator of the augmented system
+	void AugmentedPropagator(double t, Propagator &prop)
+	{
+		this->SetupBlochMatrix();
+		this->CalculatePropagator(t, prop);
+	}
+
+	//! Propagator with the affine term (F - I) * A^-1 * C
+	void InversePropagator(double t, Propagator &prop)
+	{
+		this->SetupBlochMatrix();
+		MatrixNd &A = this->A;
+		VectorNd AInvT = A.inverse()*this->C;
+		MatrixNd At = A * t;
+		int infExp;
+		std::frexp(At.template lpNorm<Eigen::Infinity>(), &infExp);
+		int j = std::max(0, infExp + 1);
+		At = At * (1.0 / (pow(2, j)));
+		MatrixNd X(At);
+		double c = 0.5;
+		MatrixNd N(At);
+		N.setIdentity();
+		MatrixNd D = N - c * At;
+		N += c * At;
+		bool p = true;
+		double q = this->numApprox;
+		for (int k = 2; k <= q; k++)
+		{
+			c *= (q - k + 1) / (k*(2 * q - k + 1));
+			X = At * X;
+			N += c * X;
+			p ? D += c * X : D -= c * X;
+			p = !p;
+		}
+		MatrixNd F = D.inverse()*N;
+		for (int k = 1; k <= j; k++)
+		{
+			F *= F;
+		}
+		prop.F = F;
+		prop.offset = F * AInvT - AInvT;
+	}
+};
+
+//! Set up pools with typical in vivo parameters
+/*!
+	\param sp SimulationParameters that get filled
+	\param numPools number of CEST pools
+	\param mt true if a MT pool should be added
+*/
+void SetupPools(SimulationParameters &sp, unsigned int numPools, bool mt)
+{
+	sp.SetWaterPool(WaterPool(1.0 / 1.3, 1.0 / 75e-3, 1.0));
+	sp.SetNumberOfCESTPools(numPools);
+	for (unsigned int i = 0; i < numPools; i++) {
+		sp.SetCESTPool(CESTPool(1.0 / 1.3, 10.0 + i, 1e-3 * (i + 1), 3.5 - 1.5 * i, 30.0 + 200.0 * i), i);
+	}
+	if (mt) {
+		sp.SetMTPool(MTPool(1.0, 1e5, 0.1, -2.5, 40.0, SuperLorentzian));
+	}
+	Eigen::VectorXd M = Eigen::VectorXd::Zero(3 * (numPools + 1) + (mt ? 1 : 0));
+	M(2 * (numPools + 1)) = 1.0;
+	sp.SetInitialMagnetizationVector(M);
+	sp.InitScanner(3.0);
+}
+
+//! Time both formulations for one matrix size
+/*!
+	\param name name of the matrix size
+	\param numPools number of CEST pools
+	\param mt true if a MT pool should be added
+	\param numReps number of propagators per formulation
+*/
+template<int size> void RunBenchmark(const char* name, unsigned int numPools, bool mt, unsigned int numReps)
+{
+	SimulationParameters sp;
+	SetupPools(sp, numPools, mt);
+	BenchmarkSolver<size> solver(sp);
+	typename BenchmarkSolver<size>::Propagator propInv, propAug;
+	double maxDiff = 0.0;
+	double timeInv = 0.0, timeAug = 0.0;
+	for (unsigned int r = 0; r < numReps; r++) {
+		// pulse sample with changing amplitude, like a shaped pulse
+		double t = 1e-4 * (1 + r % 10);
+		solver.UpdateBlochMatrix(sp, 1.0 + r % 200, 3.5 * 128.0, 0.0);
+		std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+		solver.InversePropagator(t, propInv);
+		std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+		solver.AugmentedPropagator(t, propAug);
+		std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
+		timeInv += std::chrono::duration<double>(t1 - t0).count();
+		timeAug += std::chrono::duration<double>(t2 - t1).count();
+		maxDiff = std::max(maxDiff, (propInv.F - propAug.F).cwiseAbs().maxCoeff());
+		maxDiff = std::max(maxDiff, (propInv.offset - propAug.offset).cwiseAbs().maxCoeff());
+	}
+	printf("%-8s %5u %12.3f %12.3f %8.2f %12.3e\n", name, 3 * (numPools + 1) + (mt ? 1 : 0),
+		1e6 * timeInv / numReps, 1e6 * timeAug / numReps, timeInv / timeAug, maxDiff);
+}
+
+//! Run the benchmark for all matrix sizes with a fixed-size solver and for the dynamic solver
+/*!
+	Usage: PropagatorBenchmark [number of propagators per size]
+*/
+int main(int argc, char* argv[])
+{
+	unsigned int numReps = argc > 1 ? atoi(argv[1]) : 20000;
+	printf("%-8s %5s %12s %12s %8s %12s\n", "solver", "n", "inverse[us]", "augmented[us]", "speedup", "max diff");
+	RunBenchmark<3>("3", 0, false, numReps);
+	RunBenchmark<4>("4", 0, true, numReps);
+	RunBenchmark<6>("6", 1, false, numReps);
+	RunBenchmark<7>("7", 1, true, numReps);
+	RunBenchmark<9>("9", 2, false, numReps);
+	RunBenchmark<10>("10", 2, true, numReps);
+	RunBenchmark<12>("12", 3, false, numReps);
+	RunBenchmark<13>("13", 3, true, numReps);
+	for (unsigned int numPools = 0; numPools <= 3; numPools++) {
+		RunBenchmark<Eigen::Dynamic>("Dynamic", numPools, true, numReps);
+	}
+	return 0;
+}
@@ -0,0 +1,216 @@
+//!  SimulationBenchmark.cpp
+/*!
+Benchmark suite of the Bloch-McConnell solvers and of complete simulations.
+Results are written as one JSON object per line, e.g. to compare two builds.
+
+kai.herz@tuebingen.mpg.de
+
+Copyright 2021 Kai Herz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "BMCSim.h"
+#include "SimulationParametersReader.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+
+#ifndef PULSEQCEST_EXAMPLES_DIR
+#define PULSEQCEST_EXAMPLES_DIR "../../examples" // default folder with the example .seq and .yaml files
+#endif
+
+#define SOLVER_CALLS_PER_REP 1000 // UpdateBlochMatrix + SolveBlochEquation calls per timed repetition
+#define NUM_CACHED_SAMPLES 100    // distinct pulse samples of the cached solver benchmark
+
+typedef std::chrono::steady_clock BenchmarkClock;
+
+//! Timings of all repetitions of a benchmark
+struct BenchmarkResult
+{
+	std::vector<double> times;  /*!< time of each repetition [s] */
+
+	//! Median time of a repetition
+	double Median()
+	{
+		std::vector<double> t(times);
+		std::sort(t.begin(), t.end());
+		return t.empty() ? 0.0 : (t.size() % 2 ? t[t.size() / 2] : 0.5 * (t[t.size() / 2 - 1] + t[t.size() / 2]));
+	}
+
+	//! Fastest repetition
+	double Min()
+	{
+		return times.empty() ? 0.0 : *std::min_element(times.begin(), times.end());
+	}
+};
+
+//! Print a result as a single line of JSON
+/*!
+	\param group benchmark group (solver, decode or simulation)
+	\param name name of the benchmark
+	\param params additional JSON members without braces, e.g. "\"n\": 7"
+	\param result timings
+	\param timeScale factor that divides the repetition time, e.g. the number of calls per repetition
+*/
+void PrintResult(const char* group, const std::string &name, const std::string &params, BenchmarkResult &result, double timeScale = 1.0)
+{
+	printf("{\"group\": \"%s\", \"name\": \"%s\", %s, \"reps\": %u, \"median_us\": %.6g, \"min_us\": %.6g}\n",
+		group, name.c_str(), params.c_str(), unsigned(result.times.size()), 1e6 * result.Median() / timeScale, 1e6 * result.Min() / timeScale);
+	fflush(stdout);
+}
+
+//! Set up pools with typical in vivo parameters
+/*!
+	\param sp SimulationParameters that get filled
+	\param numPools number of CEST pools
+	\param mt true if a MT pool should be added
+	\param lineshape lineshape of the MT pool
+*/
+void SetupPools(SimulationParameters &sp, unsigned int numPools, bool mt, MTLineshape lineshape)
+{
+	sp.SetWaterPool(WaterPool(1.0 / 1.3, 1.0 / 75e-3, 1.0));
+	sp.SetNumberOfCESTPools(numPools);
+	for (unsigned int i = 0; i < numPools; i++) {
+		sp.SetCESTPool(CESTPool(1.0 / 1.3, 10.0 + i, 1e-3 * (i + 1), 3.5 - 1.5 * i, 30.0 + 200.0 * i), i);
+	}
+	if (mt) {
+		sp.SetMTPool(MTPool(1.0, 1e5, 0.1, -2.5, 40.0, lineshape));
+	}
+	Eigen::VectorXd M = Eigen::VectorXd::Zero(3 * (numPools + 1) + (mt ? 1 : 0));
+	M(2 * (numPools + 1)) = 1.0;
+	sp.SetInitialMagnetizationVector(M);
+	sp.InitScanner(3.0);
+}
+
+//! Time UpdateBlochMatrix + SolveBlochEquation for one matrix size
+/*!
+	The uncached benchmark uses a new rf amplitude for every call, like the samples of a shaped pulse that is
+	simulated for the first time. The cached benchmark repeats NUM_CACHED_SAMPLES samples, like the following pulses of a pulse train.
+	\param name name of the solver
+	\param numPools number of CEST pools
+	\param mt true if a MT pool should be added
+	\param lineshape lineshape of the MT pool
+	\param numReps number of timed repetitions
+*/
+template<int size> void RunSolverBenchmark(const char* name, unsigned int numPools, bool mt, MTLineshape lineshape, unsigned int numReps)
+{
+	static const char* lineshapeNames[] = { "SuperLorentzian", "Lorentzian", "None" };
+	SimulationParameters sp;
+	SetupPools(sp, numPools, mt, lineshape);
+	std::string params = "\"n\": " + std::to_string(3 * (numPools + 1) + (mt ? 1 : 0)) + ", \"mt_lineshape\": \"" + (mt ? lineshapeNames[lineshape] : "") + "\"";
+	for (int cached = 0; cached < 2; cached++) {
+		BlochMcConnellSolver<size> solver(sp);
+		Eigen::VectorXd M = *sp.GetInitialMagnetizationVector();
+		BenchmarkResult result;
+		unsigned int sample = 0;
+		for (int r = -1; r < int(numReps); r++) { // first repetition fills the cache and is not timed
+			BenchmarkClock::time_point t0 = BenchmarkClock::now();
+			for (unsigned int c = 0; c < SOLVER_CALLS_PER_REP; c++, sample++) {
+				unsigned int s = cached ? sample % NUM_CACHED_SAMPLES : sample;
+				solver.UpdateBlochMatrix(sp, 1.0 + 1e-3 * s, 3.5 * 128.0, 0.1 * (s % 7));
+				solver.SolveBlochEquation(M, 1e-4);
+			}
+			if (r >= 0) {
+				result.times.push_back(std::chrono::duration<double>(BenchmarkClock::now() - t0).count());
+			}
+			M = *sp.GetInitialMagnetizationVector();
+		}
+		PrintResult("solver", std::string(name) + (cached ? "_cached" : ""), params, result, SOLVER_CALLS_PER_REP);
+	}
+}
+
+//! Time the decoding and the simulation of an example sequence
+/*!
+	\param examplesDir folder with the example files
+	\param seqName filename of the .seq file
+	\param sp simulation parameters
+	\param numReps number of timed repetitions
+*/
+void RunSequenceBenchmark(const std::string &examplesDir, const std::string &seqName, SimulationParameters &sp, unsigned int numReps)
+{
+	std::string seqFile = examplesDir + "/" + seqName;
+	BMCSim simFramework(sp);
+	BenchmarkResult decode;
+	for (unsigned int r = 0; r < numReps; r++) {
+		BenchmarkClock::time_point t0 = BenchmarkClock::now();
+		if (!simFramework.LoadExternalSequence(seqFile)) {
+			throw std::runtime_error("Could not read external .seq file " + seqFile);
+		}
+		decode.times.push_back(std::chrono::duration<double>(BenchmarkClock::now() - t0).count());
+	}
+	std::string params = "\"adcs\": " + std::to_string(simFramework.GetNumberOfADCEvents());
+	PrintResult("decode", seqName, params, decode);
+	// single-threaded and with all cores
+	unsigned int numThreadsOfParameters = sp.GetNumberOfThreads();
+	unsigned int threadCounts[] = { 1, std::max(1u, std::thread::hardware_concurrency()) };
+	for (unsigned int numThreads : threadCounts) {
+		sp.SetNumberOfThreads(numThreads);
+		BenchmarkResult simulation;
+		for (unsigned int r = 0; r < numReps; r++) {
+			BenchmarkClock::time_point t0 = BenchmarkClock::now();
+			if (!simFramework.RunSimulation()) {
+				throw std::runtime_error("Simulation of " + seqFile + " failed");
+			}
+			simulation.times.push_back(std::chrono::duration<double>(BenchmarkClock::now() - t0).count());
+		}
+		PrintResult("simulation", seqName, params + ", \"threads\": " + std::to_string(numThreads), simulation);
+	}
+	sp.SetNumberOfThreads(numThreadsOfParameters);
+}
+
+//! Run all benchmarks
+/*!
+	Usage: SimulationBenchmark [examples folder] [number of repetitions]
+	\return 0 on success, 1 if an example could not be simulated
+*/
+int main(int argc, char* argv[])
+{
+	std::string examplesDir = argc > 1 ? argv[1] : PULSEQCEST_EXAMPLES_DIR;
+	unsigned int numReps = argc > 2 ? atoi(argv[2]) : 10;
+
+	// solvers of all instantiated sizes, MT sizes with all lineshapes
+	MTLineshape lineshapes[] = { None, Lorentzian, SuperLorentzian };
+	for (unsigned int pools = 0; pools <= 3; pools++) {
+		switch (pools) {
+		case 0: RunSolverBenchmark<3>("3", pools, false, None, numReps); break;
+		case 1: RunSolverBenchmark<6>("6", pools, false, None, numReps); break;
+		case 2: RunSolverBenchmark<9>("9", pools, false, None, numReps); break;
+		case 3: RunSolverBenchmark<12>("12", pools, false, None, numReps); break;
+		}
+		RunSolverBenchmark<Eigen::Dynamic>("Dynamic", pools, false, None, numReps);
+		for (unsigned int l = 0; l < 3; l++) {
+			switch (pools) {
+			case 0: RunSolverBenchmark<4>("4", pools, true, lineshapes[l], numReps); break;
+			case 1: RunSolverBenchmark<7>("7", pools, true, lineshapes[l], numReps); break;
+			case 2: RunSolverBenchmark<10>("10", pools, true, lineshapes[l], numReps); break;
+			case 3: RunSolverBenchmark<13>("13", pools, true, lineshapes[l], numReps); break;
+			}
+			RunSolverBenchmark<Eigen::Dynamic>("Dynamic", pools, true, lineshapes[l], numReps);
+		}
+	}
+
+	// decoding and complete simulations of the examples
+	try {
+		SimulationParameters sp;
+		ReadSimulationParameters(examplesDir + "/GM_3T_example_bmsim.yaml", sp);
+		RunSequenceBenchmark(examplesDir, "APTw_3T_example.seq", sp, numReps);
+		RunSequenceBenchmark(examplesDir, "OH_3T_example.seq", sp, numReps);
+	}
+	catch (std::exception &e) {
+		fprintf(stderr, "Error: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}